@@ -39,6 +39,18 @@
 #include "utils.h"
 #include "proc_utils.h"
 #include "monitor_utils.h"
+#include "send_queue.h"
+#include "xdr_encoder.h"
+#include "aggregator.h"
+#include "deadband.h"
+#include "dgram_log.h"
+#include "latency.h"
+
+#ifndef WIN32
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#endif
 
 using namespace apmon_utils;
 using namespace apmon_mon_utils;
@@ -46,6 +58,10 @@ using namespace apmon_mon_utils;
 #define RECHECK_CONF 0
 #define SYS_INFO_SEND 1
 #define JOB_INFO_SEND 2
+#define COALESCE_FLUSH 3
+#define AGGREGATE_FLUSH 4
+#define DGRAM_LOG_FLUSH 5
+#define SELF_STATS_SEND 6
 
 char boolStrings[][10] = {"false", "true"};
 
@@ -366,6 +382,7 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
   int tmpNDestinations;
   char **tmpAddresses, **tmpPasswds;
   int *tmpPorts;
+  ApMonDestTable *tmpTable;
 
   if (destAddresses == NULL || destPorts == NULL || nDestinations == 0)
     return;
@@ -408,8 +425,7 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
     strcpy(this -> myIP, "unknown");
    
     /* default values for cluster name and node name */
-    this -> clusterName = strdup("ApMon_UserSend");
-    this -> nodeName = strdup(myHostname);
+    this -> defaultNames = createNames((char *)"ApMon_UserSend", myHostname);
 
 #ifndef WIN32
     int sockd = socket(PF_INET, SOCK_STREAM, 0);
@@ -467,25 +483,8 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
     this -> sysMonCluster = strdup("ApMon_SysMon");
     this -> sysMonNode = strdup(this -> myIP);
 
-    this -> prvTime = 0;
-    this -> prvSent = 0;
-    this -> prvDrop = 0;
-    this -> crtTime = 0;
-    this -> crtSent = 0;
-    this -> crtDrop = 0;
-    
-    //  exp(-5.0/60.0);
-    this -> hWeight = 0.92004441462932322925;
-
     srand(time(NULL));
 
-    /* initialize buffer for XDR encoding */
-    this -> buf = (char *)malloc(MAX_DGRAM_SIZE);
-    if (this -> buf == NULL)
-	return;
-
-    this -> dgramSize = 0;
-
     /*create the socket & set options*/
     initSocket();
 
@@ -542,6 +541,17 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
     return;
   }
 
+  /* resolve the destinations now, so that the addresses don't have to be
+     parsed again for each datagram */
+  tmpTable = resolveDestinations(tmpNDestinations, tmpAddresses, tmpPorts,
+				 tmpPasswds);
+  if (tmpTable == NULL) {
+    freeMat(tmpAddresses, tmpNDestinations);
+    freeMat(tmpPasswds, tmpNDestinations);
+    free(tmpPorts);
+    return;
+  }
+
   pthread_mutex_lock(&mutex);
   if (!firstTime)
       freeConf();
@@ -549,6 +559,9 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
   this -> destAddresses = tmpAddresses;
   this -> destPorts = tmpPorts;
   this -> destPasswds = tmpPasswds;
+  /* the threads which are sending datagrams switch to the new table 
+     before their next datagram */
+  publishDestTable(tmpTable);
   pthread_mutex_unlock(&mutex);
 
   /* start job/system monitoring according to the settings previously read 
@@ -557,11 +570,22 @@ void ApMon::arrayInit(int nDestinations, char **destAddresses, int *destPorts,
   setSysMonitoring(sysMonitoring, sysMonitorInterval);
   setGenMonitoring(genMonitoring, genMonitorIntervals);
   setConfRecheck(confCheck, recheckInterval);
+  if (asyncSend || asyncEnabled)
+    setAsyncSend(asyncSend, asyncQueueSize, asyncOverflowPolicy);
+  if (coalesce || coalesceEnabled)
+    setCoalescing(coalesce, coalesceInterval);
+  if (aggregate || aggregateEnabled)
+    setAggregation(aggregate, aggregateInterval);
+  if (selfStats || selfStatsEnabled)
+    setSelfStats(selfStats, selfStatsInterval);
 }
 
 
 ApMon::~ApMon() {
   int i;
+  ApMonThreadContext *ctx;
+  ApMonNames *names;
+  ApMonSchema *schema;
 
   if (bkThreadStarted) {
     if (getJobMonitoring()) {
@@ -571,17 +595,61 @@ ApMon::~ApMon() {
     }
   }
 
+  /* send the summaries of the recorded values and the coalesced 
+     parameters */
+  setAggregation(false);
+  setCoalescing(false);
+
   pthread_mutex_lock(&mutexBack);
   setBackgroundThread(false);
+  /* send the datagrams left in the queue */
+  stopAsyncSend();
   pthread_mutex_unlock(&mutexBack);
 
+  /* write the datagrams logged since the last time */
+  setDatagramLog(DGRAM_LOG_OFF);
+  setLatencyDumpSignal(false);
+
+  /* free the contexts of the threads which used this object (the 
+     destructors of the key are not called after the key is deleted) */
+#ifndef WIN32
+  pthread_key_delete(ctxKey);
+#else
+  TlsFree(ctxKey);
+#endif
+  while (threadContexts != NULL) {
+    ctx = threadContexts;
+    threadContexts = ctx -> next;
+    freeThreadContext(ctx);
+  }
+  delete retiredAgg;
+  delete counterTable;
+  delete deadbandTable;
+  delete dgramLog;
+  delete[] retiredLatency;
+  releaseDestTable(destTable);
+
   pthread_mutex_destroy(&mutex);
+  pthread_mutex_destroy(&mutexDest);
   pthread_mutex_destroy(&mutexBack);
+  pthread_mutex_destroy(&mutexDeadband);
+  pthread_mutex_destroy(&mutexDgramLog);
   pthread_mutex_destroy(&mutexCond);
   pthread_cond_destroy(&confChangedCond);
 
-  free(clusterName);
-  free(nodeName);
+  while (preparedSchemas != NULL) {
+    schema = preparedSchemas;
+    preparedSchemas = schema -> next;
+    freeSchema(schema);
+  }
+  freeNames(defaultNames);
+  while (registeredNames != NULL) {
+    names = registeredNames;
+    registeredNames = names -> next;
+    freeNames(names);
+  }
+  for (i = 0; i < nRateGroups; i++)
+    free(rateGroups[i].clusterName);
   free(sysMonCluster); free(sysMonNode);
 
   freeConf();
@@ -592,7 +660,6 @@ ApMon::~ApMon() {
   }
   free(initSources);
   
-  free(buf);
 #ifndef WIN32
   close(sockfd);
 #else
@@ -601,155 +668,2787 @@ ApMon::~ApMon() {
 #endif
 }
 
-void ApMon::freeConf() {
-  int i;
-  freeMat(destAddresses, nDestinations);
-  freeMat(destPasswds, nDestinations);
-  free(destPorts);
+ApMonDestTable *ApMon::resolveDestinations(int nDest, char **addresses, 
+					   int *ports, char **passwds) {
+  int i;
+  char logmsg[200];
+  ApMonDestination *dests, *d;
+  ApMonDestTable *table;
+#ifdef WIN32
+  char crtAddr[128];
+  int ret, addrLen;
+#endif
+
+  table = (ApMonDestTable *)malloc(sizeof(ApMonDestTable));
+  if (table == NULL)
+    return NULL;
+  table -> nDestinations = 0;
+  table -> refs = 1;
+  table -> destinations = dests = 
+    (ApMonDestination *)malloc(nDest * sizeof(ApMonDestination));
+  if (dests == NULL) {
+    free(table);
+    return NULL;
+  }
+
+  /* the destinations which cannot be resolved are left out of the table,
+     without affecting the others */
+  for (i = 0; i < nDest; i++) {
+    d = &dests[table -> nDestinations];
+    memset(&d -> addr, 0, sizeof(d -> addr));
+    d -> addr.sin_family = AF_INET;
+    d -> addr.sin_port = htons(ports[i]);
+#ifndef WIN32
+    d -> sockfd = -1;
+    if (inet_pton(AF_INET, addresses[i], &d -> addr.sin_addr) != 1) {
+      snprintf(logmsg, 199, "[ resolveDestinations() ] Invalid address %s, the destination is ignored", 
+	       addresses[i]);
+      logger(WARNING, logmsg);
+      continue;
+    }
+#else
+    d -> sockfd = INVALID_SOCKET;
+    addrLen = sizeof(d -> addr);
+    snprintf(crtAddr, 127, "%s:%d", addresses[i], ports[i]);
+    ret = WSAStringToAddress(crtAddr, AF_INET, NULL, 
+			     (struct sockaddr *) &d -> addr, &addrLen);
+    if (ret) {
+      snprintf(logmsg, 199, "[ resolveDestinations() ] Error packing address %s, code %d, the destination is ignored", crtAddr, WSAGetLastError());
+      logger(WARNING, logmsg);
+      continue;
+    }
+#endif
+
+    /* the header changes from a datagram to another only by the sequence
+       number, which is added when sending */
+    d -> headerLen = encodeHeader(passwds[i], d -> header);
+    if (d -> headerLen == RET_ERROR) {
+      snprintf(logmsg, 199, "[ resolveDestinations() ] Cannot encode the header for %s (password too long?)", addresses[i]);
+      logger(WARNING, logmsg);
+    }
+
+    d -> address = strdup(addresses[i]);
+    d -> nErrors = 0;
+    table -> nDestinations++;
+  }
+
+  if (connectedSockets)
+    openDestSockets(dests, table -> nDestinations);
+  return table;
+}
+
+void ApMon::publishDestTable(ApMonDestTable *table) {
+  ApMonDestTable *old;
+
+  pthread_mutex_lock(&mutexDest);
+  old = destTable;
+  destTable = table;
+  APMON_ATOMIC_ADD(&destGeneration, 1);
+  pthread_mutex_unlock(&mutexDest);
+
+  releaseDestTable(old);
+}
+
+void ApMon::releaseDestTable(ApMonDestTable *table) {
+  int i;
+
+  if (table == NULL || APMON_ATOMIC_ADD(&(table -> refs), -1) > 0)
+    return;
+
+  closeDestSockets(table -> destinations, table -> nDestinations);
+  for (i = 0; i < table -> nDestinations; i++)
+    free(table -> destinations[i].address);
+  free(table -> destinations);
+  free(table);
+}
+
+/** Adds the statistics of a thread to a sum. */
+static void addThreadStats(ApMonThreadStats *sum, ApMonThreadStats *stats) {
+  sum -> dgramsSent += stats -> dgramsSent;
+  sum -> bytesSent += stats -> bytesSent;
+  sum -> dgramsEncoded += stats -> dgramsEncoded;
+  sum -> encodeTime += stats -> encodeTime;
+  sum -> lockWaits += stats -> lockWaits;
+  sum -> lockWaitTime += stats -> lockWaitTime;
+}
+
+ApMonThreadContext *ApMon::getThreadContext() {
+  ApMonThreadContext *ctx;
+
+#ifndef WIN32
+  ctx = (ApMonThreadContext *)pthread_getspecific(ctxKey);
+#else
+  ctx = (ApMonThreadContext *)TlsGetValue(ctxKey);
+#endif
+  if (ctx != NULL)
+    return ctx;
+
+  ctx = (ApMonThreadContext *)malloc(sizeof(ApMonThreadContext));
+  if (ctx == NULL)
+    return NULL;
+  ctx -> names = NULL;
+  ctx -> destTable = NULL;
+  ctx -> destGeneration = -1;
+  ctx -> priority = PRIORITY_NORMAL;
+  ctx -> agg = NULL;
+  ctx -> bulkBuf = NULL;
+  ctx -> keptNames = NULL;
+  ctx -> keptTypes = NULL;
+  ctx -> keptValues = NULL;
+  ctx -> deadbandUpdates = NULL;
+  ctx -> keptCapacity = 0;
+  memset(&(ctx -> stats), 0, sizeof(ctx -> stats));
+  ctx -> latency = NULL;
+  ctx -> apm = this;
+  ctx -> prev = NULL;
+
+  pthread_mutex_lock(&mutexDest);
+  ctx -> next = threadContexts;
+  if (threadContexts != NULL)
+    threadContexts -> prev = ctx;
+  threadContexts = ctx;
+  pthread_mutex_unlock(&mutexDest);
+
+#ifndef WIN32
+  pthread_setspecific(ctxKey, ctx);
+#else
+  TlsSetValue(ctxKey, ctx);
+#endif
+  return ctx;
+}
+
+ApMonDestTable *ApMon::getDestTable(ApMonThreadContext *ctx) {
+  ApMonDestTable *old;
+
+  if (ctx -> destGeneration == destGeneration)
+    return ctx -> destTable;
+
+  /* a new table was published */
+  pthread_mutex_lock(&mutexDest);
+  old = ctx -> destTable;
+  ctx -> destTable = destTable;
+  APMON_ATOMIC_ADD(&(destTable -> refs), 1);
+  ctx -> destGeneration = destGeneration;
+  pthread_mutex_unlock(&mutexDest);
+
+  releaseDestTable(old);
+  return ctx -> destTable;
+}
+
+void ApMon::freeThreadContext(ApMonThreadContext *ctx) {
+  releaseDestTable(ctx -> destTable);
+  freeNames(ctx -> names);
+  delete ctx -> agg;
+  free(ctx -> bulkBuf);
+  free(ctx -> keptNames);
+  free(ctx -> keptTypes);
+  free(ctx -> keptValues);
+  free(ctx -> deadbandUpdates);
+  delete[] ctx -> latency;
+  free(ctx);
+}
+
+void ApMon::threadContextDestructor(void *param) {
+  ApMonThreadContext *ctx = (ApMonThreadContext *)param;
+  ApMon *apm = ctx -> apm;
+  int i;
+
+  pthread_mutex_lock(&(apm -> mutexDest));
+  if (ctx -> prev != NULL)
+    ctx -> prev -> next = ctx -> next;
+  else
+    apm -> threadContexts = ctx -> next;
+  if (ctx -> next != NULL)
+    ctx -> next -> prev = ctx -> prev;
+  /* keep the values recorded by the thread until the next summaries */
+  if (ctx -> agg != NULL && apm -> retiredAgg != NULL)
+    ctx -> agg -> drainTo(apm -> retiredAgg);
+  addThreadStats(&(apm -> retiredStats), &(ctx -> stats));
+  if (ctx -> latency != NULL) {
+    if (apm -> retiredLatency == NULL) {
+      try {
+	apm -> retiredLatency = new LatencyHistogram[N_LATENCY_STAGES];
+      } catch (bad_alloc &err) {
+      }
+    }
+    for (i = 0; i < N_LATENCY_STAGES && apm -> retiredLatency != NULL; i++)
+      apm -> retiredLatency[i].add(ctx -> latency[i]);
+  }
+  pthread_mutex_unlock(&(apm -> mutexDest));
+
+  apm -> freeThreadContext(ctx);
+}
+
+void ApMon::openDestSockets(ApMonDestination *dests, int nDest) {
+#ifndef WIN32
+  int i, fd;
+  char logmsg[200];
+  struct timeval optval;
+
+  for (i = 0; i < nDest; i++) {
+    if (dests[i].sockfd >= 0)
+      continue;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&dests[i].addr, 
+			  sizeof(dests[i].addr)) < 0) {
+      snprintf(logmsg, 199, "[ openDestSockets() ] Cannot connect a socket to %s, using the shared socket: %s", inet_ntoa(dests[i].addr.sin_addr), strerror(errno));
+      logger(WARNING, logmsg);
+      if (fd >= 0)
+	close(fd);
+      continue;
+    }
+
+#ifndef __SUNOS
+    /* the same send timeout as for the shared socket */
+    optval.tv_sec = 20;
+    optval.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char *) &optval, sizeof(optval));
+#endif
+    dests[i].sockfd = fd;
+  }
+#else
+  logger(WARNING, "[ openDestSockets() ] Connected sockets are not supported on Windows");
+#endif
+}
+
+void ApMon::closeDestSockets(ApMonDestination *dests, int nDest) {
+#ifndef WIN32
+  int i;
+
+  if (dests == NULL)
+    return;
+  for (i = 0; i < nDest; i++) {
+    if (dests[i].sockfd >= 0) {
+      close(dests[i].sockfd);
+      dests[i].sockfd = -1;
+    }
+  }
+#endif
+}
+
+void ApMon::setConnectedSockets(bool connected) {
+  ApMonDestTable *table;
+
+  pthread_mutex_lock(&mutex);
+  this -> connectedSockets = connected;
+  /* the published table is not modified, because other threads may be 
+     sending through its sockets */
+  if (nDestinations > 0) {
+    table = resolveDestinations(nDestinations, destAddresses, destPorts, 
+				destPasswds);
+    if (table != NULL)
+      publishDestTable(table);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void ApMon::freeConf() {
+  int i;
+  freeMat(destAddresses, nDestinations);
+  freeMat(destPasswds, nDestinations);
+  free(destPorts);
+
+  for (i = 0; i < confURLs.nConfURLs; i++) {
+      free(confURLs.vURLs[i]);
+      free(confURLs.lastModifURLs[i]);
+  }
+}
+
+int ApMon::sendParameters(char *clusterName, char *nodeName,
+	       int nParams, char **paramNames, int *valueTypes, 
+			 char **paramValues) {
+ return sendTimedParameters(clusterName, nodeName, nParams, 
+			    paramNames, valueTypes, paramValues, -1);
+}
+
+int ApMon::sendTimedParameters(char *clusterName, char *nodeName,
+	       int nParams, char **paramNames, int *valueTypes, 
+	       char **paramValues, int timestamp) {
+  return sendTimedParameters(clusterName, nodeName, nParams, paramNames, 
+			     valueTypes, paramValues, timestamp, NULL);
+}
+
+int ApMon::sendTimedParameters(char *clusterName, char *nodeName,
+	       int nParams, char **paramNames, int *valueTypes, 
+	       char **paramValues, int timestamp, int *nDgrams) {
+  ApMonThreadContext *ctx;
+  ApMonNames *names = NULL;
+
+  ctx = getThreadContext();
+  if (ctx != NULL)
+    names = resolveNames(ctx, clusterName, nodeName);
+  if (names == NULL) {
+    if (nDgrams != NULL)
+      *nDgrams = 0;
+    return RET_ERROR;
+  }
+  return sendTimedParameters(names, nParams, paramNames, valueTypes, 
+			     paramValues, timestamp, nDgrams);
+}
+
+int ApMon::sendParameters(ApMonNames *names, int nParams, char **paramNames,
+			  int *valueTypes, char **paramValues) {
+  return sendTimedParameters(names, nParams, paramNames, valueTypes, 
+			     paramValues, -1, NULL);
+}
+
+int ApMon::sendTimedParameters(ApMonNames *names, int nParams, 
+			       char **paramNames, int *valueTypes, 
+			       char **paramValues, int timestamp) {
+  return sendTimedParameters(names, nParams, paramNames, valueTypes, 
+			     paramValues, timestamp, NULL);
+}
+
+int ApMon::sendTimedParameters(ApMonNames *names, int nParams, 
+			       char **paramNames, int *valueTypes, 
+			       char **paramValues, int timestamp, 
+			       int *nDgrams) {
+  int ret, nKept = -1;
+  long long start = 0;
+  bool timed = latencyEnabled;
+  ApMonThreadContext *ctx = NULL;
+
+  if (timed)
+    start = LatencyHistogram::now();
+
+  if (names != NULL && deadbandEnabled && 
+      (ctx = getThreadContext()) != NULL) {
+    /* leave out the values which didn't change */
+    nKept = filterDeadband(ctx, names, nParams, paramNames, valueTypes, 
+			   paramValues);
+    if (nKept == 0) {
+      if (nDgrams != NULL)
+	*nDgrams = 0;
+      return RET_SUCCESS;
+    }
+    if (nKept > 0) {
+      nParams = nKept;
+      paramNames = ctx -> keptNames;
+      valueTypes = ctx -> keptTypes;
+      paramValues = ctx -> keptValues;
+    }
+  }
+
+  if (names == NULL)
+    ret = RET_ERROR;
+  else
+    ret = sendParamsDatagram(names, nParams, paramNames, valueTypes, 
+			     paramValues, timestamp);
+  if (ret == RET_TOO_LARGE)
+    ret = sendSplitParameters(names, nParams, paramNames, valueTypes, 
+			      paramValues, timestamp, nDgrams);
+  else if (nDgrams != NULL)
+    *nDgrams = (ret == RET_SUCCESS) ? 1 : 0;
+  /* the values are recorded only if all their datagrams were sent, so 
+     that a dropped change is sent again */
+  if (nKept > 0 && ret == RET_SUCCESS)
+    commitDeadband(ctx, nKept);
+  if (timed)
+    recordLatency(getThreadContext(), LATENCY_TOTAL, 
+		  LatencyHistogram::now() - start);
+  return ret;
+}
+
+int ApMon::setDeadband(char *paramName, double deadband, bool relative, 
+		       long maxSilence) {
+  int ret;
+  char logmsg[200];
+
+  if (paramName == NULL)
+    return RET_ERROR;
+
+  pthread_mutex_lock(&mutexDeadband);
+  if (deadbandTable == NULL) {
+    if (deadband < 0) {
+      pthread_mutex_unlock(&mutexDeadband);
+      return RET_SUCCESS;
+    }
+    try {
+      deadbandTable = new DeadbandTable();
+    } catch (runtime_error &err) {
+      pthread_mutex_unlock(&mutexDeadband);
+      logger(WARNING, err.what());
+      return RET_ERROR;
+    }
+  }
+  ret = deadbandTable -> setRule(paramName, deadband, relative, maxSilence);
+  deadbandEnabled = (deadbandTable -> getNumRules() > 0);
+  pthread_mutex_unlock(&mutexDeadband);
+
+  if (ret == RET_SUCCESS && deadband >= 0) {
+    snprintf(logmsg, 199, "Deadband for %s: %g%s, refresh interval %ld s", 
+	     paramName, deadband, relative ? "%" : "", maxSilence);
+    logger(FINE, logmsg);
+  } else if (ret != RET_SUCCESS) {
+    snprintf(logmsg, 199, "[ setDeadband() ] Cannot set the deadband for %s", paramName);
+    logger(WARNING, logmsg);
+  }
+  return ret;
+}
+
+int ApMon::filterDeadband(ApMonThreadContext *ctx, ApMonNames *names, 
+			  int nParams, char **paramNames, int *valueTypes, 
+			  char **paramValues) {
+  int i, n, capacity;
+  long long now;
+  DeadbandUpdate *update;
+
+  if (nParams > ctx -> keptCapacity) {
+    /* the arrays only grow, so that they are not allocated for each 
+       datagram */
+    capacity = (nParams > 2 * ctx -> keptCapacity) ? nParams 
+      : 2 * ctx -> keptCapacity;
+    free(ctx -> keptNames);
+    free(ctx -> keptTypes);
+    free(ctx -> keptValues);
+    free(ctx -> deadbandUpdates);
+    ctx -> keptNames = (char **)malloc(capacity * sizeof(char *));
+    ctx -> keptTypes = (int *)malloc(capacity * sizeof(int));
+    ctx -> keptValues = (char **)malloc(capacity * sizeof(char *));
+    ctx -> deadbandUpdates = 
+      (DeadbandUpdate *)malloc(capacity * sizeof(DeadbandUpdate));
+    ctx -> keptCapacity = capacity;
+    if (ctx -> keptNames == NULL || ctx -> keptTypes == NULL || 
+	ctx -> keptValues == NULL || ctx -> deadbandUpdates == NULL) {
+      ctx -> keptCapacity = 0;
+      return RET_ERROR;
+    }
+  }
+
+  now = getMonotonicTime();
+  n = 0;
+  pthread_mutex_lock(&mutexDeadband);
+  for (i = 0; i < nParams; i++) {
+    update = &(ctx -> deadbandUpdates[n]);
+    update -> paramName = NULL;
+    if (deadbandTable != NULL && 
+	!deadbandTable -> check(names -> clusterName, names -> nodeName, 
+				paramNames[i], valueTypes[i], 
+				paramValues[i], now, update))
+      continue;
+    ctx -> keptNames[n] = paramNames[i];
+    ctx -> keptTypes[n] = valueTypes[i];
+    ctx -> keptValues[n++] = paramValues[i];
+  }
+  pthread_mutex_unlock(&mutexDeadband);
+  return n;
+}
+
+void ApMon::commitDeadband(ApMonThreadContext *ctx, int nKept) {
+  int i;
+  long long now;
+
+  now = getMonotonicTime();
+  pthread_mutex_lock(&mutexDeadband);
+  if (deadbandTable != NULL) {
+    for (i = 0; i < nKept; i++)
+      deadbandTable -> commit(&(ctx -> deadbandUpdates[i]), now);
+  }
+  pthread_mutex_unlock(&mutexDeadband);
+}
+
+int ApMon::setDatagramLog(int sink, char *path) {
+  FILE *f = NULL;
+  char logmsg[MAX_STRING_LEN];
+  bool changed;
+
+  if (sink == DGRAM_LOG_FILE) {
+    if (path == NULL || strcmp(path, "stderr") == 0)
+      f = stderr;
+    else if ((f = fopen(path, "a")) == NULL) {
+      snprintf(logmsg, MAX_STRING_LEN - 1, "[ setDatagramLog() ] Cannot open the file %s", path);
+      logger(WARNING, logmsg);
+      return RET_ERROR;
+    }
+  } else if (sink != DGRAM_LOG_MEMORY)
+    sink = DGRAM_LOG_OFF;
+
+  pthread_mutex_lock(&mutexDgramLog);
+  if (sink != DGRAM_LOG_OFF && dgramLog == NULL) {
+    try {
+      dgramLog = new DatagramLog();
+    } catch (runtime_error &err) {
+      pthread_mutex_unlock(&mutexDgramLog);
+      logger(WARNING, err.what());
+      if (f != NULL && f != stderr)
+	fclose(f);
+      return RET_ERROR;
+    }
+  }
+  changed = (sink != dgramLogSink || f != NULL || dgramLogFile != NULL);
+  dgramLogSink = sink;
+  /* the datagrams logged for the previous file are written in it; a new 
+     file receives only the datagrams logged from now on */
+  if (dgramLogFile != NULL) {
+    writeDatagramLog(dgramLogFile, false);
+    if (dgramLogFile != stderr)
+      fclose(dgramLogFile);
+  } else if (f != NULL)
+    dgramLog -> skipNew();
+  dgramLogFile = f;
+  pthread_mutex_unlock(&mutexDgramLog);
+
+  if (changed) {
+    if (sink == DGRAM_LOG_FILE)
+      snprintf(logmsg, MAX_STRING_LEN - 1, "Logging the datagrams sent in %s", path != NULL ? path : "stderr");
+    else if (sink == DGRAM_LOG_MEMORY)
+      snprintf(logmsg, MAX_STRING_LEN - 1, "Logging the datagrams sent in memory");
+    else
+      snprintf(logmsg, MAX_STRING_LEN - 1, "Disabling the datagram log...");
+    logger(INFO, logmsg);
+  }
+
+  pthread_mutex_lock(&mutexBack);
+  this -> dgramLogFlush = (sink == DGRAM_LOG_FILE);
+  this -> dgramLogChanged = true;
+  if (dgramLogFlush)
+    setBackgroundThread(true);
+  else {
+    // disable the background thread if it is not needed anymore
+    if (jobMonitoring == false && sysMonitoring == false && 
+	confCheck == false && coalesce == false && aggregate == false &&
+	selfStats == false)
+      setBackgroundThread(false);
+  }
+  pthread_mutex_unlock(&mutexBack);
+  return RET_SUCCESS;
+}
+
+int ApMon::dumpDatagramLog(char *path) {
+  FILE *f = stderr;
+  int n = 0;
+
+  if (path != NULL && strcmp(path, "stderr") != 0) {
+    f = fopen(path, "a");
+    if (f == NULL)
+      return RET_ERROR;
+  }
+
+  pthread_mutex_lock(&mutexDgramLog);
+  if (dgramLog != NULL)
+    n = writeDatagramLog(f, true);
+  pthread_mutex_unlock(&mutexDgramLog);
+
+  if (f != stderr)
+    fclose(f);
+  return n;
+}
+
+int ApMon::writeDatagramLog(FILE *f, bool all) {
+  ApMonDestTable *table;
+  long generation;
+  int n;
+
+  /* the current destination table, for the addresses */
+  pthread_mutex_lock(&mutexDest);
+  table = destTable;
+  if (table != NULL)
+    APMON_ATOMIC_ADD(&(table -> refs), 1);
+  generation = destGeneration;
+  pthread_mutex_unlock(&mutexDest);
+
+  if (all)
+    n = dgramLog -> writeAll(f, table, generation);
+  else
+    n = dgramLog -> writeNew(f, table, generation);
+  fflush(f);
+
+  releaseDestTable(table);
+  return n;
+}
+
+void ApMon::flushDatagramLog() {
+  pthread_mutex_lock(&mutexDgramLog);
+  if (dgramLogFile != NULL)
+    writeDatagramLog(dgramLogFile, false);
+  pthread_mutex_unlock(&mutexDgramLog);
+}
+
+int ApMon::getStats(ApMonStats *stats) {
+  int i;
+  ApMonThreadStats sum;
+  ApMonThreadContext *ctx;
+  ApMonDestTable *table;
+
+  memset(stats, 0, sizeof(*stats));
+
+  pthread_mutex_lock(&mutexDest);
+  sum = retiredStats;
+  for (ctx = threadContexts; ctx != NULL; ctx = ctx -> next)
+    addThreadStats(&sum, &(ctx -> stats));
+  for (i = 0; i < N_COLLECTORS; i++) {
+    stats -> collectorRuns[i] = collectorRuns[i];
+    stats -> collectorTime[i] = collectorTime[i];
+  }
+  table = destTable;
+  if (table != NULL) {
+    stats -> nDestinations = table -> nDestinations;
+    for (i = 0; i < table -> nDestinations; i++) {
+      snprintf(stats -> destAddresses[i], MAX_ADDRESS_LEN, "%s:%d",
+	       table -> destinations[i].address,
+	       ntohs(table -> destinations[i].addr.sin_port));
+      stats -> sendErrors[i] = table -> destinations[i].nErrors;
+    }
+  }
+  pthread_mutex_unlock(&mutexDest);
+
+  stats -> dgramsSent = sum.dgramsSent;
+  stats -> bytesSent = sum.bytesSent;
+  stats -> dgramsEncoded = sum.dgramsEncoded;
+  stats -> encodeTime = sum.encodeTime;
+  stats -> lockWaits = sum.lockWaits;
+  stats -> lockWaitTime = sum.lockWaitTime;
+
+  /* the rate groups are only added, so they can be read without locking */
+  stats -> rateDropped = defaultBucket.nDropped;
+  for (i = 0; i < nRateGroups; i++) {
+    if (rateGroups[i].ownLimit)
+      stats -> rateDropped += rateGroups[i].nDropped;
+  }
+  stats -> queueDropped = asyncDropped;
+  return RET_SUCCESS;
+}
+
+void ApMon::setSelfStats(bool selfStats, long interval) {
+  char logmsg[100];
+
+  if (interval <= 0)
+    interval = SELF_STATS_INTERVAL;
+  if (selfStats) {
+    snprintf(logmsg, 99, "Enabling the statistics of ApMon, time interval %ld s... ", interval);
+    logger(INFO, logmsg);
+  } else if (selfStatsEnabled)
+    logger(INFO, "Disabling the statistics of ApMon...");
+  selfStatsEnabled = selfStats;
+
+  pthread_mutex_lock(&mutexBack);
+  this -> selfStats = selfStats;
+  this -> selfStatsInterval = interval;
+  this -> selfStatsChanged = true;
+  if (selfStats)
+    setBackgroundThread(true);
+  else {
+    // disable the background thread if it is not needed anymore
+    if (jobMonitoring == false && sysMonitoring == false && 
+	confCheck == false && coalesce == false && aggregate == false &&
+	dgramLogFlush == false)
+      setBackgroundThread(false);
+  }
+  pthread_mutex_unlock(&mutexBack);
+}
+
+void ApMon::lockSendMutex() {
+  long long start, wait;
+  ApMonThreadContext *ctx;
+
+  if (!selfStatsEnabled && !latencyEnabled) {
+    pthread_mutex_lock(&mutex);
+    return;
+  }
+
+#ifndef WIN32
+  /* the clock is read only if the mutex is held by another thread (on 
+     Windows, every acquisition is timed) */
+  if (pthread_mutex_trylock(&mutex) == 0) {
+    if (latencyEnabled)
+      recordLatency(getThreadContext(), LATENCY_LOCK, 0);
+    return;
+  }
+#endif
+  start = LatencyHistogram::now();
+  pthread_mutex_lock(&mutex);
+  wait = LatencyHistogram::now() - start;
+  if ((ctx = getThreadContext()) == NULL)
+    return;
+  if (selfStatsEnabled) {
+    ctx -> stats.lockWaits++;
+    ctx -> stats.lockWaitTime += wait;
+  }
+  if (latencyEnabled)
+    recordLatency(ctx, LATENCY_LOCK, wait);
+}
+
+void ApMon::addCollectorTime(int collector, long long start) {
+  long long duration = getMonotonicTime() - start;
+
+  pthread_mutex_lock(&mutexDest);
+  collectorRuns[collector]++;
+  collectorTime[collector] += duration;
+  pthread_mutex_unlock(&mutexDest);
+}
+
+/** Adds a value to the parameters of the self-monitoring datagram. */
+static void addSelfStat(char **paramNames, double *values, int *nParams,
+			const char *name, double value) {
+  paramNames[*nParams] = (char *)name;
+  values[*nParams] = value;
+  (*nParams)++;
+}
+
+void ApMon::sendSelfStats() {
+  static const char *collectorNames[N_COLLECTORS] = 
+    {"sys_info", "job_info", "general_info"};
+  ApMonStats stats;
+  int i, n = 0, prevPriority;
+  /* 8 global values, 2 for each collector and 1 for each destination */
+  char *paramNames[8 + 2 * N_COLLECTORS + MAX_N_DESTINATIONS];
+  char *paramValues[8 + 2 * N_COLLECTORS + MAX_N_DESTINATIONS];
+  int valueTypes[8 + 2 * N_COLLECTORS + MAX_N_DESTINATIONS];
+  double values[8 + 2 * N_COLLECTORS + MAX_N_DESTINATIONS];
+  char names[2 * N_COLLECTORS + MAX_N_DESTINATIONS][MAX_ADDRESS_LEN + 20];
+
+  logger(INFO, "Sending the statistics of ApMon...");
+  getStats(&stats);
+
+  /* the times are sent in ms */
+  addSelfStat(paramNames, values, &n, "dgrams_sent", stats.dgramsSent);
+  addSelfStat(paramNames, values, &n, "bytes_sent", stats.bytesSent);
+  addSelfStat(paramNames, values, &n, "dgrams_dropped_rate", 
+	      stats.rateDropped);
+  addSelfStat(paramNames, values, &n, "dgrams_dropped_queue", 
+	      stats.queueDropped);
+  addSelfStat(paramNames, values, &n, "dgrams_encoded", 
+	      stats.dgramsEncoded);
+  addSelfStat(paramNames, values, &n, "encode_time", 
+	      stats.encodeTime / 1e6);
+  addSelfStat(paramNames, values, &n, "lock_waits", stats.lockWaits);
+  addSelfStat(paramNames, values, &n, "lock_wait_time", 
+	      stats.lockWaitTime / 1e6);
+  for (i = 0; i < N_COLLECTORS; i++) {
+    snprintf(names[2 * i], MAX_ADDRESS_LEN + 19, "%s_runs", 
+	     collectorNames[i]);
+    addSelfStat(paramNames, values, &n, names[2 * i], 
+		stats.collectorRuns[i]);
+    snprintf(names[2 * i + 1], MAX_ADDRESS_LEN + 19, "%s_time", 
+	     collectorNames[i]);
+    addSelfStat(paramNames, values, &n, names[2 * i + 1], 
+		stats.collectorTime[i] / 1e6);
+  }
+  for (i = 0; i < stats.nDestinations; i++) {
+    snprintf(names[2 * N_COLLECTORS + i], MAX_ADDRESS_LEN + 19, 
+	     "send_errors_%s", stats.destAddresses[i]);
+    addSelfStat(paramNames, values, &n, names[2 * N_COLLECTORS + i], 
+		stats.sendErrors[i]);
+  }
+
+  for (i = 0; i < n; i++) {
+    valueTypes[i] = XDR_REAL64;
+    paramValues[i] = (char *)&values[i];
+  }
+
+  /* the statistics are sent like the system monitoring datagrams */
+  prevPriority = setThreadPriority(PRIORITY_BULK);
+  try {
+    sendParameters((char *)SELF_STATS_CLUSTER, sysMonNode, n, paramNames,
+		   valueTypes, paramValues);
+  } catch (runtime_error& err) {
+    logger(WARNING, err.what());
+  }
+  if (prevPriority >= 0)
+    setThreadPriority(prevPriority);
+}
+
+void ApMon::setLatencyHistograms(bool enable) {
+  if (enable && !latencyEnabled)
+    logger(INFO, "Enabling the latency histograms...");
+  else if (!enable && latencyEnabled)
+    logger(INFO, "Disabling the latency histograms...");
+  latencyEnabled = enable;
+}
+
+LatencyHistogram *ApMon::getThreadLatency(ApMonThreadContext *ctx) {
+  LatencyHistogram *lat;
+
+  if (ctx -> latency != NULL)
+    return ctx -> latency;
+  try {
+    lat = new LatencyHistogram[N_LATENCY_STAGES];
+  } catch (bad_alloc &err) {
+    return NULL;
+  }
+  /* the histograms are read by the other threads */
+  APMON_MEMORY_BARRIER();
+  ctx -> latency = lat;
+  return lat;
+}
+
+void ApMon::recordLatency(ApMonThreadContext *ctx, int stage, 
+			  long long duration) {
+  LatencyHistogram *lat;
+
+  if (ctx != NULL && (lat = getThreadLatency(ctx)) != NULL)
+    lat[stage].record(duration);
+}
+
+int ApMon::getLatencyHistogram(int stage, LatencyHistogram *hist) {
+  ApMonThreadContext *ctx;
+
+  if (stage < 0 || stage >= N_LATENCY_STAGES || hist == NULL)
+    return RET_ERROR;
+
+  hist -> reset();
+  pthread_mutex_lock(&mutexDest);
+  if (retiredLatency != NULL)
+    hist -> add(retiredLatency[stage]);
+  for (ctx = threadContexts; ctx != NULL; ctx = ctx -> next) {
+    if (ctx -> latency != NULL)
+      hist -> add(ctx -> latency[stage]);
+  }
+  pthread_mutex_unlock(&mutexDest);
+  return RET_SUCCESS;
+}
+
+int ApMon::dumpLatencyHistograms(char *path) {
+  static const char *stageNames[N_LATENCY_STAGES] = 
+    {"lock", "encode", "header", "send", "total"};
+  FILE *f = stderr;
+  LatencyHistogram hist;
+  time_t crtTime;
+  char timeStr[30];
+  int i;
+
+  if (path != NULL && strcmp(path, "stderr") != 0) {
+    f = fopen(path, "a");
+    if (f == NULL)
+      return RET_ERROR;
+  }
+
+  crtTime = time(NULL);
+#ifndef WIN32
+  ctime_r(&crtTime, timeStr);
+#else
+  strncpy(timeStr, ctime(&crtTime), 29);
+  timeStr[29] = 0;
+#endif
+  timeStr[strlen(timeStr) - 1] = 0;
+  fprintf(f, "[%s] ApMon latency histograms, instance id %d:\n", timeStr,
+	  instance_id);
+  for (i = 0; i < N_LATENCY_STAGES; i++) {
+    getLatencyHistogram(i, &hist);
+    hist.write(f, stageNames[i]);
+  }
+  fflush(f);
+
+  if (f != stderr)
+    fclose(f);
+  return RET_SUCCESS;
+}
+
+#ifndef WIN32
+/** The write end of the pipe of the ApMon object which writes its latency
+ * histograms on SIGUSR1 (-1 if there is none). */
+static volatile int latencySignalFd = -1;
+/** The handler of SIGUSR1 which was replaced. */
+static struct sigaction prevLatencyAction;
+
+/** The handler of SIGUSR1: it only wakes up the thread which writes the 
+ * histograms (write() may be called from a signal handler). */
+static void latencySignalHandler(int) {
+  int savedErrno = errno, fd = latencySignalFd;
+  char c = 'd';
+
+  if (fd >= 0 && write(fd, &c, 1) < 0) {
+    /* EAGAIN: the pipe is full (it is non-blocking), so the histograms 
+       will be written anyway */
+  }
+  errno = savedErrno;
+}
+
+void *latencyDumpTask(void *param) {
+  ApMon *apm = (ApMon *)param;
+  char c, path[MAX_STRING_LEN];
+  bool toFile;
+  int ret;
+
+  while (1) {
+    ret = read(apm -> latencyPipe[0], &c, 1);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+
+    pthread_mutex_lock(&(apm -> mutexBack));
+    toFile = (apm -> latencyDumpPath != NULL);
+    if (toFile) {
+      strncpy(path, apm -> latencyDumpPath, MAX_STRING_LEN - 1);
+      path[MAX_STRING_LEN - 1] = 0;
+    }
+    pthread_mutex_unlock(&(apm -> mutexBack));
+
+    if (apm -> dumpLatencyHistograms(toFile ? path : NULL) != RET_SUCCESS)
+      logger(WARNING, "[ latencyDumpTask() ] Cannot write the latency histograms");
+  }
+  return NULL;
+}
+#endif
+
+int ApMon::setLatencyDumpSignal(bool enable, char *path) {
+#ifndef WIN32
+  struct sigaction sa;
+  int fds[2];
+  char logmsg[MAX_STRING_LEN];
+
+  pthread_mutex_lock(&mutexBack);
+  /* the file may be changed while the dump is enabled */
+  free(latencyDumpPath);
+  latencyDumpPath = NULL;
+  if (enable && path != NULL && strcmp(path, "stderr") != 0)
+    latencyDumpPath = strdup(path);
+  if (enable == latencyDump) {
+    pthread_mutex_unlock(&mutexBack);
+    return RET_SUCCESS;
+  }
+
+  if (enable) {
+    if (latencySignalFd >= 0) {
+      pthread_mutex_unlock(&mutexBack);
+      logger(WARNING, "[ setLatencyDumpSignal() ] SIGUSR1 is already used by another ApMon object");
+      return RET_ERROR;
+    }
+    if (pipe(latencyPipe) != 0) {
+      pthread_mutex_unlock(&mutexBack);
+      snprintf(logmsg, MAX_STRING_LEN - 1, "[ setLatencyDumpSignal() ] Cannot create a pipe: %s", strerror(errno));
+      logger(WARNING, logmsg);
+      return RET_ERROR;
+    }
+    /* the signal handler must not block when the pipe is full, and the
+       pipe is not inherited by the programs executed by the application */
+    fcntl(latencyPipe[1], F_SETFL, fcntl(latencyPipe[1], F_GETFL) | 
+	  O_NONBLOCK);
+    fcntl(latencyPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(latencyPipe[1], F_SETFD, FD_CLOEXEC);
+    if (pthread_create(&latencyDumpThread, NULL, &latencyDumpTask, 
+		       this) != 0) {
+      close(latencyPipe[0]);
+      close(latencyPipe[1]);
+      pthread_mutex_unlock(&mutexBack);
+      logger(WARNING, "[ setLatencyDumpSignal() ] Cannot create the thread");
+      return RET_ERROR;
+    }
+    latencySignalFd = latencyPipe[1];
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = latencySignalHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, &prevLatencyAction);
+    latencyDump = true;
+    pthread_mutex_unlock(&mutexBack);
+    snprintf(logmsg, MAX_STRING_LEN - 1, "Writing the latency histograms in %s on SIGUSR1", path != NULL ? path : "stderr");
+    logger(INFO, logmsg);
+    return RET_SUCCESS;
+  }
+
+  /* the thread takes mutexBack, so it is stopped after the mutex is 
+     released */
+  sigaction(SIGUSR1, &prevLatencyAction, NULL);
+  latencySignalFd = -1;
+  latencyDump = false;
+  fds[0] = latencyPipe[0];
+  fds[1] = latencyPipe[1];
+  pthread_mutex_unlock(&mutexBack);
+
+  /* the thread stops when it reads the end of the pipe */
+  close(fds[1]);
+  pthread_join(latencyDumpThread, NULL);
+  close(fds[0]);
+  logger(INFO, "The latency histograms are no longer written on SIGUSR1");
+  return RET_SUCCESS;
+#else
+  if (enable) {
+    logger(WARNING, "[ setLatencyDumpSignal() ] Not supported on Windows");
+    return RET_ERROR;
+  }
+  return RET_SUCCESS;
+#endif
+}
+
+ApMonNames *ApMon::registerNames(char *clusterName, char *nodeName,
+				  int priority) {
+  ApMonNames *names;
+
+  if (clusterName == NULL || priority >= N_PRIORITIES)
+    return NULL;
+  if (nodeName == NULL)
+    nodeName = this -> myHostname;
+  names = createNames(clusterName, nodeName);
+  if (names == NULL)
+    return NULL;
+  names -> priority = priority < 0 ? -1 : priority;
+
+  lockSendMutex();
+  names -> next = registeredNames;
+  registeredNames = names;
+  pthread_mutex_unlock(&mutex);
+  return names;
+}
+
+ApMonNames *ApMon::createNames(char *clusterName, char *nodeName) {
+  ApMonNames *names;
+  int clusterLen, nodeLen;
+
+  names = (ApMonNames *)malloc(sizeof(ApMonNames));
+  if (names == NULL)
+    return NULL;
+  names -> clusterName = strdup(clusterName);
+  names -> nodeName = strdup(nodeName);
+  clusterLen = strlen(clusterName);
+  nodeLen = strlen(nodeName);
+  names -> encodedLen = XdrEncoder::stringSize(clusterLen) + 
+    XdrEncoder::stringSize(nodeLen);
+  names -> rateGroup = -1;
+  names -> rateGroupsSeen = 0;
+  names -> priority = -1;
+  names -> encoded = (char *)malloc(names -> encodedLen);
+  names -> next = NULL;
+  if (names -> clusterName == NULL || names -> nodeName == NULL || 
+      names -> encoded == NULL) {
+    freeNames(names);
+    return NULL;
+  }
+
+  XdrEncoder enc(names -> encoded, names -> encodedLen);
+  enc.putString(clusterName, clusterLen);
+  enc.putString(nodeName, nodeLen);
+  return names;
+}
+
+void ApMon::freeNames(ApMonNames *names) {
+  if (names == NULL)
+    return;
+  free(names -> clusterName);
+  free(names -> nodeName);
+  free(names -> encoded);
+  free(names);
+}
+
+/** Encodes the value of a parameter (without the name and the type). */
+static bool encodeValue(XdrEncoder& enc, int valueType, char *value) {
+  switch (valueType) {
+  case XDR_STRING:
+    enc.putString(value);
+    return true;
+    //INT16 is not supported
+  case XDR_INT32:
+    enc.putInt(*(int *)value);
+    return true;
+  case XDR_REAL32:
+    enc.putFloat(*(float *)value);
+    return true;
+  case XDR_REAL64:
+    enc.putDouble(*(double *)value);
+    return true;
+  default:
+    return false;
+  }
+}
+
+ApMonSchema *ApMon::prepareParameters(ApMonNames *names, int nParams, 
+				      char **paramNames, int *valueTypes) {
+  ApMonSchema *schema;
+  int i, pos;
+  bool ok = true;
+
+  if (names == NULL || nParams <= 0 || paramNames == NULL || 
+      valueTypes == NULL)
+    return NULL;
+
+  schema = (ApMonSchema *)malloc(sizeof(ApMonSchema));
+  if (schema == NULL)
+    return NULL;
+  schema -> names = names;
+  schema -> nParams = nParams;
+  schema -> paramNames = (char **)malloc(nParams * sizeof(char *));
+  schema -> valueTypes = (int *)malloc(nParams * sizeof(int));
+  schema -> paramOffsets = (int *)malloc(nParams * sizeof(int));
+  schema -> valueOffsets = (int *)malloc(nParams * sizeof(int));
+  schema -> tmpl = NULL;
+  schema -> hasStrings = false;
+  schema -> next = NULL;
+  if (schema -> paramNames == NULL || schema -> valueTypes == NULL || 
+      schema -> paramOffsets == NULL || schema -> valueOffsets == NULL) {
+    free(schema -> paramNames);
+    schema -> paramNames = NULL;
+    freeSchema(schema);
+    return NULL;
+  }
+
+  /* compute the layout of the template */
+  pos = names -> encodedLen + xdrSize(XDR_INT32, NULL);
+  for (i = 0; i < nParams; i++) {
+    schema -> paramNames[i] = NULL;
+    schema -> valueTypes[i] = valueTypes[i];
+    if (paramNames[i] == NULL || (valueTypes[i] != XDR_INT32 && 
+	valueTypes[i] != XDR_REAL32 && valueTypes[i] != XDR_REAL64 &&
+	valueTypes[i] != XDR_STRING)) {
+      logger(WARNING, "[ prepareParameters() ] Invalid parameter name or type");
+      ok = false;
+      continue;
+    }
+    schema -> paramNames[i] = strdup(paramNames[i]);
+    if (schema -> paramNames[i] == NULL)
+      ok = false;
+    schema -> paramOffsets[i] = pos;
+    pos += xdrSize(XDR_STRING, paramNames[i]) + xdrSize(XDR_INT32, NULL);
+    schema -> valueOffsets[i] = pos;
+    if (valueTypes[i] == XDR_STRING)
+      schema -> hasStrings = true;
+    else
+      pos += xdrSize(valueTypes[i], NULL);
+  }
+  schema -> tmplLen = pos;
+  if (ok)
+    schema -> tmpl = (char *)malloc(schema -> tmplLen);
+  if (schema -> tmpl == NULL) {
+    freeSchema(schema);
+    return NULL;
+  }
+
+  /* encode everything except the values (the room for the values which
+     have a fixed size is filled with zeros) */
+  XdrEncoder enc(schema -> tmpl, schema -> tmplLen);
+  enc.putBytes(names -> encoded, names -> encodedLen);
+  enc.putInt(nParams);
+  for (i = 0; i < nParams; i++) {
+    enc.putString(schema -> paramNames[i]);
+    enc.putInt(schema -> valueTypes[i]);
+    if (valueTypes[i] == XDR_REAL64)
+      enc.putDouble(0.0);
+    else if (valueTypes[i] != XDR_STRING)
+      enc.putInt(0);
+  }
+
+  lockSendMutex();
+  schema -> next = preparedSchemas;
+  preparedSchemas = schema;
+  pthread_mutex_unlock(&mutex);
+  return schema;
+}
+
+void ApMon::freeSchema(ApMonSchema *schema) {
+  int i;
+
+  if (schema -> paramNames != NULL) {
+    for (i = 0; i < schema -> nParams; i++)
+      free(schema -> paramNames[i]);
+  }
+  free(schema -> paramNames);
+  free(schema -> valueTypes);
+  free(schema -> paramOffsets);
+  free(schema -> valueOffsets);
+  free(schema -> tmpl);
+  free(schema);
+}
+
+int ApMon::sendPreparedParameters(ApMonSchema *schema, char **paramValues) {
+  return sendTimedPreparedParameters(schema, paramValues, -1);
+}
+
+int ApMon::sendTimedPreparedParameters(ApMonSchema *schema, 
+				       char **paramValues, int timestamp) {
+  int ret, size, len;
+  ApMonThreadContext *ctx;
+
+  if (schema == NULL || paramValues == NULL)
+    return RET_ERROR;
+  size = preparedSize(schema, paramValues, timestamp);
+  if (size < 0)
+    return size;
+
+  /* the coalesced parameters and the ones which must be split among 
+     several datagrams are sent by the general functions */
+  if (coalesceEnabled || deadbandEnabled || 
+      size + MAX_HEADER_LENGTH > MAX_DGRAM_SIZE)
+    return sendTimedParameters(schema -> names, schema -> nParams, 
+			       schema -> paramNames, schema -> valueTypes,
+			       paramValues, timestamp);
+
+#ifndef WIN32
+  if (asyncEnabled) {
+    APMON_ATOMIC_ADD(&asyncProducers, 1);
+    if (asyncEnabled) {
+      ret = enqueuePrepared(schema, paramValues, timestamp);
+      APMON_ATOMIC_ADD(&asyncProducers, -1);
+      return ret;
+    }
+    APMON_ATOMIC_ADD(&asyncProducers, -1);
+  }
+#endif
+
+  ctx = getThreadContext();
+  if (ctx == NULL)
+    return RET_ERROR;
+  len = encodePrepared(ctx -> buf, schema, paramValues, timestamp);
+  if (len < 0)
+    return len;
+  return sendEncodedParams(ctx, schema -> names, len, schema -> nParams, 
+			   schema -> paramNames, schema -> valueTypes, 
+			   paramValues);
+}
+
+int ApMon::preparedSize(ApMonSchema *schema, char **paramValues, 
+			int timestamp) {
+  int i, size, n;
+
+  size = schema -> tmplLen;
+  n = schema -> nParams;
+  if (schema -> hasStrings) {
+    for (i = 0; i < schema -> nParams; i++) {
+      if (schema -> valueTypes[i] != XDR_STRING)
+	continue;
+      if (paramValues[i] == NULL) {
+	/* the parameter is skipped */
+	size -= schema -> valueOffsets[i] - schema -> paramOffsets[i];
+	n--;
+      } else {
+	size += xdrSize(XDR_STRING, paramValues[i]);
+      }
+    }
+  }
+  if (n == 0)
+    return RET_ERROR;
+  if (timestamp > 0)
+    size += xdrSize(XDR_INT32, NULL);
+  return size;
+}
+
+int ApMon::encodePrepared(char *outBuf, ApMonSchema *schema, 
+			  char **paramValues, int timestamp) {
+  int i, pos, len, n;
+  uint32_t tmp;
+
+  if (!schema -> hasStrings) {
+    /* copy the template and put the values in their places */
+    memcpy(outBuf, schema -> tmpl, schema -> tmplLen);
+    for (i = 0; i < schema -> nParams; i++) {
+      XdrEncoder enc(outBuf + schema -> valueOffsets[i], 
+		     xdrSize(schema -> valueTypes[i], NULL));
+      if (!encodeValue(enc, schema -> valueTypes[i], paramValues[i]))
+	return RET_ERROR;
+    }
+    pos = schema -> tmplLen;
+  } else {
+    /* the values which follow a string are not at fixed offsets, so the 
+       body is built from the pieces of the template */
+    pos = schema -> paramOffsets[0];
+    memcpy(outBuf, schema -> tmpl, pos);
+    n = 0;
+    for (i = 0; i < schema -> nParams; i++) {
+      if (schema -> valueTypes[i] == XDR_STRING && paramValues[i] == NULL) {
+	logger(WARNING, "NULL parameter name or value - skipping parameter...");
+	continue;
+      }
+      len = schema -> valueOffsets[i] - schema -> paramOffsets[i];
+      memcpy(outBuf + pos, schema -> tmpl + schema -> paramOffsets[i], len);
+      pos += len;
+      XdrEncoder enc(outBuf + pos, MAX_DGRAM_SIZE - pos);
+      if (!encodeValue(enc, schema -> valueTypes[i], paramValues[i]))
+	return RET_ERROR;
+      pos += enc.length();
+      n++;
+    }
+    tmp = htonl(n);
+    memcpy(outBuf + schema -> paramOffsets[0] - 4, &tmp, 4);
+  }
+
+  if (timestamp > 0) {
+    tmp = htonl(timestamp);
+    memcpy(outBuf + pos, &tmp, 4);
+    pos += 4;
+  }
+  return pos;
+}
+
+/** A parameter and the size of its encoding, used when a set of 
+    parameters is split among several datagrams. */
+typedef struct ParamSize {
+  int index;
+  int size;
+} ParamSize;
+
+/** Orders the parameters by decreasing size (for qsort()). */
+static int compareParamSizes(const void *p1, const void *p2) {
+  const ParamSize *ps1 = (const ParamSize *)p1, *ps2 = (const ParamSize *)p2;
+  if (ps1 -> size != ps2 -> size)
+    return ps2 -> size - ps1 -> size;
+  return ps1 -> index - ps2 -> index;
+}
+
+int ApMon::sendRecords(int nRecords, ApMonRecord *records, int *results) {
+  ApMonThreadContext *ctx;
+  ApMonNames tmpNames, *names = NULL;
+  char nameBuf[MAX_DGRAM_SIZE];
+  char *bodies[MAX_SEND_VECTOR];
+  int bodyLens[MAX_SEND_VECTOR], recordOf[MAX_SEND_VECTOR];
+  int priorities[MAX_SEND_VECTOR];
+  ApMonRateBucket *buckets[MAX_SEND_VECTOR], *bucket = NULL;
+  char *clusterName, *nodeName;
+  int i, nDgrams = 0, used = 0, len, clusterLen, nodeLen, priority = -1;
+  int result = RET_SUCCESS, *ownResults = NULL;
+  ApMonRecord *rec;
+
+  if (nRecords <= 0 || records == NULL)
+    return RET_ERROR;
+  if (results == NULL) {
+    ownResults = (int *)malloc(nRecords * sizeof(int));
+    if (ownResults == NULL)
+      return RET_ERROR;
+    results = ownResults;
+  }
+  for (i = 0; i < nRecords; i++)
+    results[i] = RET_ERROR;
+
+  ctx = getThreadContext();
+  if (ctx != NULL && ctx -> bulkBuf == NULL)
+    ctx -> bulkBuf = (char *)malloc(BULK_BUFFER_SIZE);
+  if (ctx == NULL || ctx -> bulkBuf == NULL) {
+    free(ownResults);
+    return RET_ERROR;
+  }
+
+  tmpNames.clusterName = tmpNames.nodeName = NULL;
+  tmpNames.encoded = nameBuf;
+  for (i = 0; i < nRecords; i++) {
+    rec = &records[i];
+
+    if (coalesceEnabled || asyncEnabled || deadbandEnabled) {
+      /* these modes have their own batching */
+      len = sendTimedParameters(rec -> clusterName, rec -> nodeName, 
+				rec -> nParams, rec -> paramNames, 
+				rec -> valueTypes, rec -> paramValues, 
+				rec -> timestamp);
+      results[i] = len;
+      continue;
+    }
+
+    /* the names are encoded in a local buffer, and only when they differ
+       from the ones of the previous record */
+    clusterName = rec -> clusterName;
+    nodeName = (rec -> nodeName != NULL) ? rec -> nodeName : myHostname;
+    if (clusterName == NULL) {
+      /* the names of the previous record, or else of the thread */
+      if (names == NULL) {
+	names = resolveNames(ctx, NULL, NULL);
+	if (names != NULL)
+	  bucket = selectBucket(names, &priority);
+      }
+    } else if (names != &tmpNames || 
+	       strcmp(tmpNames.clusterName, clusterName) != 0 ||
+	       strcmp(tmpNames.nodeName, nodeName) != 0) {
+      clusterLen = strlen(clusterName);
+      nodeLen = strlen(nodeName);
+      tmpNames.encodedLen = XdrEncoder::stringSize(clusterLen) + 
+	XdrEncoder::stringSize(nodeLen);
+      if (tmpNames.encodedLen > MAX_DGRAM_SIZE - MAX_HEADER_LENGTH) {
+	names = NULL;
+      } else {
+	XdrEncoder enc(nameBuf, tmpNames.encodedLen);
+	enc.putString(clusterName, clusterLen);
+	enc.putString(nodeName, nodeLen);
+	tmpNames.clusterName = clusterName;
+	tmpNames.nodeName = nodeName;
+	tmpNames.rateGroup = -1;
+	tmpNames.rateGroupsSeen = 0;
+	tmpNames.priority = -1;
+	names = &tmpNames;
+	bucket = selectBucket(names, &priority);
+      }
+    }
+    if (names == NULL)
+      continue;
+
+    /* the batch is sent when the buffer may not have room for another
+       datagram */
+    if (nDgrams == MAX_SEND_VECTOR || 
+	used + MAX_DGRAM_SIZE - MAX_HEADER_LENGTH > BULK_BUFFER_SIZE) {
+      sendRecordBatch(ctx, nDgrams, bodies, bodyLens, recordOf, buckets,
+		      priorities, records, results);
+      nDgrams = 0;
+      used = 0;
+    }
+
+    try {
+      len = encodeParams(ctx -> bulkBuf + used, names, rec -> nParams, 
+			 rec -> paramNames, rec -> valueTypes, 
+			 rec -> paramValues, rec -> timestamp);
+    } catch (runtime_error& err) {
+      len = RET_ERROR;
+    }
+    if (len == RET_TOO_LARGE) {
+      /* the record is split among several datagrams, after the ones 
+	 which precede it are sent */
+      sendRecordBatch(ctx, nDgrams, bodies, bodyLens, recordOf, buckets,
+		      priorities, records, results);
+      nDgrams = 0;
+      used = 0;
+      len = sendSplitParameters(names, rec -> nParams, rec -> paramNames, 
+				rec -> valueTypes, rec -> paramValues, 
+				rec -> timestamp, NULL);
+      results[i] = len;
+      continue;
+    }
+    if (len < 0)
+      continue;
+
+    bodies[nDgrams] = ctx -> bulkBuf + used;
+    bodyLens[nDgrams] = len;
+    recordOf[nDgrams] = i;
+    buckets[nDgrams] = bucket;
+    priorities[nDgrams] = priority;
+    nDgrams++;
+    used += len;
+  }
+  sendRecordBatch(ctx, nDgrams, bodies, bodyLens, recordOf, buckets, 
+		  priorities, records, results);
+
+  for (i = 0; i < nRecords; i++) {
+    if (results[i] == RET_ERROR) {
+      result = RET_ERROR;
+      break;
+    }
+    if (results[i] != RET_SUCCESS)
+      result = RET_NOT_SENT;
+  }
+  free(ownResults);
+  return result;
+}
+
+void ApMon::sendRecordBatch(ApMonThreadContext *ctx, int nDgrams, 
+			    char **bodies, int *bodyLens, int *recordOf, 
+			    ApMonRateBucket **buckets, int *priorities,
+			    ApMonRecord *records, int *results) {
+  int destResults[MAX_SEND_VECTOR * MAX_N_DESTINATIONS];
+  int i, j, k, n, granted, nDest, crtSeq, ret;
+  char msg[200];
+  ApMonDestTable *table;
+  ApMonRecord *rec;
+
+  /* the tokens are taken for each run of datagrams with the same bucket 
+     and priority; the last datagrams of a run are dropped if there are 
+     not enough tokens */
+  n = 0;
+  for (i = 0; i < nDgrams; i = j) {
+    for (j = i + 1; j < nDgrams && buckets[j] == buckets[i] && 
+	   priorities[j] == priorities[i]; j++)
+      ;
+    granted = takeTokens(buckets[i], priorities[i], j - i);
+    for (k = i; k < j; k++) {
+      if (k - i < granted) {
+	bodies[n] = bodies[k];
+	bodyLens[n] = bodyLens[k];
+	recordOf[n++] = recordOf[k];
+      } else
+	results[recordOf[k]] = RET_NOT_SENT;
+    }
+  }
+  if (n == 0)
+    return;
+
+  table = getDestTable(ctx);
+  nDest = table -> nDestinations;
+  ret = sendDatagrams(table, n, bodies, bodyLens, destResults, &crtSeq);
+  for (i = 0; i < n; i++) {
+    results[recordOf[i]] = RET_SUCCESS;
+    if (ret == RET_ERROR) {
+      for (j = 0; j < nDest; j++) {
+	if (destResults[i * nDest + j] == RET_ERROR)
+	  results[recordOf[i]] = RET_ERROR;
+      }
+    }
+    if (!isLoggable(FINE))
+      continue;
+    rec = &records[recordOf[i]];
+    for (j = 0; j < nDest; j++) {
+      if (destResults[i * nDest + j] == RET_ERROR)
+	continue;
+      snprintf(msg, 199, "Datagram with size %d, instance id %d, sequence number %d, sent to %s, containing parameters:", destResults[i * nDest + j], instance_id, (crtSeq + i) % TWO_BILLION, table -> destinations[j].address);
+      logger(FINE, msg);
+      logParameters(FINE, rec -> nParams, rec -> paramNames, 
+		    rec -> valueTypes, rec -> paramValues);
+    }
+  }
+}
+
+int ApMon::sendSplitParameters(ApMonNames *crtNames,
+	       int nParams, char **paramNames, int *valueTypes, 
+	       char **paramValues, int timestamp, int *nDgrams) {
+  ParamSize *sizes;
+  int *dgramOf, *loads, *types;
+  char **names, **values;
+  int i, j, n, nSizes, nBins, capacity, ret, result, nSent;
+  char logmsg[200];
+
+  if (nDgrams != NULL)
+    *nDgrams = 0;
+  if (crtNames == NULL)
+    return RET_ERROR;
+
+  /* the room left for the parameters in a datagram (all the datagrams 
+     have the same cluster and node names) */
+  capacity = MAX_DGRAM_SIZE - MAX_HEADER_LENGTH - crtNames -> encodedLen -
+    xdrSize(XDR_INT32, NULL);
+  if (timestamp > 0)
+    capacity -= xdrSize(XDR_INT32, NULL);
+
+  sizes = (ParamSize *)malloc(nParams * sizeof(ParamSize));
+  dgramOf = (int *)malloc(nParams * sizeof(int));
+  loads = (int *)malloc(nParams * sizeof(int));
+  names = (char **)malloc(nParams * sizeof(char *));
+  types = (int *)malloc(nParams * sizeof(int));
+  values = (char **)malloc(nParams * sizeof(char *));
+  if (sizes == NULL || dgramOf == NULL || loads == NULL || names == NULL ||
+      types == NULL || values == NULL) {
+    free(sizes); free(dgramOf); free(loads);
+    free(names); free(types); free(values);
+    return RET_ERROR;
+  }
+
+  /* compute the size of each parameter (name + type + value) */
+  nSizes = 0;
+  for (i = 0; i < nParams; i++) {
+    dgramOf[i] = -1;
+    if (paramNames[i] == NULL || (valueTypes[i] == XDR_STRING && 
+				  paramValues[i] == NULL))
+      continue;
+    sizes[nSizes].index = i;
+    sizes[nSizes].size = xdrSize(XDR_STRING, paramNames[i]) + 
+      xdrSize(XDR_INT32, NULL) + xdrSize(valueTypes[i], paramValues[i]);
+    if (sizes[nSizes].size > capacity) {
+      snprintf(logmsg, 199, "Parameter %s doesn't fit in a datagram - skipping parameter...", paramNames[i]);
+      logger(WARNING, logmsg);
+      continue;
+    }
+    nSizes++;
+  }
+
+  /* first-fit decreasing: the largest parameters are placed first, each 
+     of them in the first datagram which has room for it */
+  qsort(sizes, nSizes, sizeof(ParamSize), compareParamSizes);
+  nBins = 0;
+  for (i = 0; i < nSizes; i++) {
+    for (j = 0; j < nBins; j++) {
+      if (loads[j] + sizes[i].size <= capacity)
+	break;
+    }
+    if (j == nBins)
+      loads[nBins++] = 0;
+    loads[j] += sizes[i].size;
+    dgramOf[sizes[i].index] = j;
+  }
+
+  snprintf(logmsg, 199, "Splitting %d parameters among %d datagrams", nParams, nBins);
+  logger(FINE, logmsg);
+
+  /* send the datagrams, keeping the original order of the parameters */
+  result = (nBins > 0) ? RET_SUCCESS : RET_ERROR;
+  nSent = 0;
+  for (j = 0; j < nBins; j++) {
+    n = 0;
+    for (i = 0; i < nParams; i++) {
+      if (dgramOf[i] == j) {
+	names[n] = paramNames[i];
+	types[n] = valueTypes[i];
+	values[n++] = paramValues[i];
+      }
+    }
+    ret = sendParamsDatagram(crtNames, n, names, types, values, timestamp);
+    if (ret == RET_SUCCESS)
+      nSent++;
+    else if (result != RET_ERROR)
+      result = (ret == RET_NOT_SENT) ? RET_NOT_SENT : RET_ERROR;
+  }
+  if (nDgrams != NULL)
+    *nDgrams = nSent;
+
+  free(sizes); free(dgramOf); free(loads);
+  free(names); free(types); free(values);
+  return result;
+}
+
+int ApMon::sendParamsDatagram(ApMonNames *names,
+	       int nParams, char **paramNames, int *valueTypes, 
+	       char **paramValues, int timestamp) {
+  int ret, len;
+  ApMonThreadContext *ctx;
+
+  if (coalesceEnabled)
+    return coalesceParameters(names, nParams, paramNames, valueTypes, 
+			      paramValues, timestamp);
+
+#ifndef WIN32
+  if (asyncEnabled) {
+    /* the sender thread may be stopped meanwhile; it waits for the 
+       producers which have seen the flag set */
+    APMON_ATOMIC_ADD(&asyncProducers, 1);
+    if (asyncEnabled) {
+      ret = enqueueParameters(names, nParams, paramNames, valueTypes, 
+			      paramValues, timestamp);
+      APMON_ATOMIC_ADD(&asyncProducers, -1);
+      return ret;
+    }
+    APMON_ATOMIC_ADD(&asyncProducers, -1);
+  }
+#endif
+
+  /* the datagram is encoded in the buffer of the current thread, without
+     locking */
+  ctx = getThreadContext();
+  if (ctx == NULL)
+    return RET_ERROR;
+
+  //sortParams(nParams, paramNames, valueTypes, paramValues);
+
+  /* try to encode the parameters */
+  try {
+    len = encodeParams(ctx -> buf, names, nParams, paramNames, valueTypes, 
+		       paramValues, timestamp);
+  } catch (runtime_error& err) {
+    len = RET_ERROR;
+  }
+  if (len < 0)
+    return len;
+
+  return sendEncodedParams(ctx, names, len, nParams, paramNames, valueTypes,
+			   paramValues);
+}
+
+int ApMon::sendEncodedParams(ApMonThreadContext *ctx, ApMonNames *names, 
+			     int len, int nParams, char **paramNames, 
+			     int *valueTypes, char **paramValues) {
+  int i, ret, crtSeq;
+  int results[MAX_N_DESTINATIONS];
+  char msg[200];
+  char *body = ctx -> buf;
+  ApMonDestTable *table;
+
+  if (!shouldSend(names))
+    return RET_NOT_SENT;
+
+  /* send the datagram to all the destinations */
+  table = getDestTable(ctx);
+  ret = sendDatagrams(table, 1, &body, &len, results, &crtSeq);
+
+  if (!isLoggable(FINE))
+    return ret;
+  for (i = 0; i < table -> nDestinations; i++) {
+    if (results[i] == RET_ERROR)
+      continue;
+    snprintf(msg, 199, "Datagram with size %d, instance id %d, sequence number %d, sent to %s, containing parameters:", results[i], instance_id, crtSeq, table -> destinations[i].address);
+    logger(FINE, msg);
+    if (paramNames != NULL)
+      logParameters(FINE, nParams, paramNames, valueTypes, paramValues);
+  }
+
+  return ret;
+}
+
+bool ApMon::canEncodeDirectly(int size) {
+  return !coalesceEnabled && !asyncEnabled && !deadbandEnabled &&
+    size + MAX_HEADER_LENGTH <= MAX_DGRAM_SIZE && !isLoggable(FINE);
+}
+
+ApMonNames *ApMon::resolveNames(ApMonThreadContext *ctx, char *clusterName,
+				char *nodeName) {
+  if (clusterName != NULL) { // don't keep the cached values for cluster name
+    // and node name
+    if (nodeName == NULL) /* set the node name to the node's IP */
+      nodeName = this -> myHostname;
+
+    /* the names are copied and encoded only when they change */
+    if (ctx -> names == NULL || 
+	strcmp(ctx -> names -> clusterName, clusterName) != 0 ||
+	strcmp(ctx -> names -> nodeName, nodeName) != 0) {
+      freeNames(ctx -> names);
+      ctx -> names = createNames(clusterName, nodeName);
+      if (ctx -> names == NULL)
+	return NULL;
+    }
+  } // if
+
+  if (ctx -> names != NULL)
+    return ctx -> names;
+  /* the thread didn't give any names yet */
+  return defaultNames;
+}
+
+#ifndef WIN32
+int ApMon::enqueueParameters(ApMonNames *names, int nParams,
+			     char **paramNames, int *valueTypes, 
+			     char **paramValues, int timestamp) {
+  SendQueueSlot *slot;
+  ApMonRateBucket *bucket;
+  int len, priority;
+
+  bucket = selectBucket(names, &priority);
+  if (!takeToken(bucket, priority))
+    return RET_NOT_SENT;
+
+  if ((slot = claimSendSlot()) == NULL) {
+    /* the datagram was dropped by the queue, so it doesn't count for the
+       rate limit */
+    returnTokens(bucket, 1);
+    return RET_NOT_SENT;
+  }
+
+  /* encode the datagram directly in the slot */
+  try {
+    len = encodeParams(slot -> data, names, nParams, paramNames, 
+		       valueTypes, paramValues, timestamp);
+  } catch (runtime_error& err) {
+    len = RET_ERROR;
+  }
+
+  /* the slot is published even if the encoding failed, so that the sender
+     thread can release it; the token is given back, since nothing is sent
+     (the parameters which don't fit are split by the caller, taking a 
+     token for each datagram) */
+  if (len <= 0)
+    returnTokens(bucket, 1);
+  sendQueue -> publish(slot, len > 0 ? len : 0);
+  sendQueue -> notifyConsumer();
+  return len > 0 ? RET_SUCCESS : len;
+}
+
+int ApMon::enqueuePrepared(ApMonSchema *schema, char **paramValues, 
+			   int timestamp) {
+  SendQueueSlot *slot;
+  ApMonRateBucket *bucket;
+  int len, priority;
+
+  bucket = selectBucket(schema -> names, &priority);
+  if (!takeToken(bucket, priority))
+    return RET_NOT_SENT;
+
+  if ((slot = claimSendSlot()) == NULL) {
+    returnTokens(bucket, 1);
+    return RET_NOT_SENT;
+  }
+
+  /* the caller checked that the datagram fits in the slot */
+  len = encodePrepared(slot -> data, schema, paramValues, timestamp);
+  if (len <= 0)
+    returnTokens(bucket, 1);
+  sendQueue -> publish(slot, len > 0 ? len : 0);
+  sendQueue -> notifyConsumer();
+  return len > 0 ? RET_SUCCESS : len;
+}
+
+SendQueueSlot *ApMon::claimSendSlot() {
+  SendQueueSlot *slot, *old;
+
+  /* mutex may be locked (when the coalesced datagrams are queued), but the
+     sender thread doesn't need it, so it can make room in the queue 
+     meanwhile */
+  while ((slot = sendQueue -> claim()) == NULL) {
+    if (asyncOverflowPolicy == ASYNC_DROP_OLDEST) {
+      old = sendQueue -> take();
+      if (old != NULL) {
+	if (old -> len > 0)
+	  APMON_ATOMIC_ADD(&asyncDropped, 1);
+	sendQueue -> release(old);
+      } else {
+	/* the oldest datagram is being encoded by another thread */
+	sched_yield();
+      }
+    } else if (asyncOverflowPolicy == ASYNC_BLOCK) {
+      sendQueue -> waitNotFull(10);
+    } else {
+      APMON_ATOMIC_ADD(&asyncDropped, 1);
+      return NULL;
+    }
+  }
+  return slot;
+}
+
+void *asyncSendTask(void *param) {
+  ApMon *apm = (ApMon *)param;
+  SendQueue *q = apm -> sendQueue;
+  SendQueueSlot *slots[ASYNC_SEND_BATCH], *slot;
+  char *bodies[ASYNC_SEND_BATCH];
+  int lens[ASYNC_SEND_BATCH];
+  int results[ASYNC_SEND_BATCH * MAX_N_DESTINATIONS];
+  int i, j, n, nTaken, crtSeq;
+  bool stop;
+  char msg[200];
+  ApMonThreadContext *ctx;
+  ApMonDestTable *table;
+
+  logger(INFO, "[Starting the sender thread...]");
+  ctx = apm -> getThreadContext();
+
+  while (1) {
+    /* the flag is read before taking the datagrams, so that no datagram is 
+       left in the queue when the thread stops */
+    stop = apm -> stopAsyncThread;
+    APMON_MEMORY_BARRIER();
+
+    nTaken = n = 0;
+    while (nTaken < ASYNC_SEND_BATCH && (slot = q -> take()) != NULL) {
+      slots[nTaken++] = slot;
+      if (slot -> len > 0) {
+	bodies[n] = slot -> data;
+	lens[n++] = slot -> len;
+      }
+    }
+
+    if (nTaken == 0) {
+      if (stop)
+	break;
+      q -> waitNotEmpty(100);
+      continue;
+    }
+
+    if (n > 0 && ctx != NULL) {
+      table = apm -> getDestTable(ctx);
+      apm -> sendDatagrams(table, n, bodies, lens, results, &crtSeq);
+      for (i = 0; i < n && isLoggable(FINE); i++) {
+	for (j = 0; j < table -> nDestinations; j++) {
+	  if (results[i * table -> nDestinations + j] == RET_ERROR)
+	    continue;
+	  snprintf(msg, 199, "Datagram with size %d, instance id %d, sequence number %d, sent to %s", results[i * table -> nDestinations + j], apm -> instance_id, (crtSeq + i) % TWO_BILLION, table -> destinations[j].address);
+	  logger(FINE, msg);
+	}
+      }
+    }
+
+    for (i = 0; i < nTaken; i++)
+      q -> release(slots[i]);
+    q -> notifyProducers();
+  }
+
+  logger(INFO, "[Sender thread stopped]");
+  return NULL;
+}
+#endif
+
+void ApMon::setAsyncSend(bool async, int queueSize, int overflowPolicy) {
+  char logmsg[100];
+
+#ifdef WIN32
+  if (async)
+    logger(WARNING, "[ setAsyncSend() ] Asynchronous sending is not supported on Windows");
+  return;
+#else
+  if (queueSize <= 0)
+    queueSize = ASYNC_QUEUE_SIZE;
+  if (overflowPolicy < ASYNC_DROP_NEWEST || overflowPolicy > ASYNC_BLOCK)
+    overflowPolicy = ASYNC_DROP_NEWEST;
+
+  pthread_mutex_lock(&mutexBack);
+  this -> asyncOverflowPolicy = overflowPolicy;
+  if (async && asyncEnabled && queueSize == asyncQueueSize) {
+    /* nothing else changed */
+    pthread_mutex_unlock(&mutexBack);
+    return;
+  }
+
+  if (async) {
+    snprintf(logmsg, 99, "Enabling asynchronous sending, queue size %d", queueSize);
+    logger(INFO, logmsg);
+  } else if (asyncEnabled)
+    logger(INFO, "Disabling asynchronous sending...");
+
+  /* the queue is recreated if its size changes */
+  stopAsyncSend();
+  this -> asyncSend = async;
+  this -> asyncQueueSize = queueSize;
+  if (async)
+    startAsyncSend();
+  pthread_mutex_unlock(&mutexBack);
+#endif
+}
+
+void ApMon::startAsyncSend() {
+#ifndef WIN32
+  // mutexBack is locked
+  try {
+    sendQueue = new SendQueue(asyncQueueSize);
+  } catch (runtime_error &err) {
+    logger(WARNING, err.what());
+    sendQueue = NULL;
+    return;
+  }
+
+  stopAsyncThread = false;
+  if (pthread_create(&asyncThread, NULL, &asyncSendTask, this) != 0) {
+    logger(WARNING, "[ startAsyncSend() ] Cannot create the sender thread");
+    delete sendQueue;
+    sendQueue = NULL;
+    return;
+  }
+  APMON_MEMORY_BARRIER();
+  asyncEnabled = true;
+#endif
+}
+
+void ApMon::stopAsyncSend() {
+#ifndef WIN32
+  // mutexBack is locked
+  if (sendQueue == NULL)
+    return;
+
+  /* don't accept new datagrams and wait for the threads which are adding
+     datagrams to the queue */
+  asyncEnabled = false;
+  APMON_MEMORY_BARRIER();
+  while (asyncProducers > 0)
+    sched_yield();
+
+  /* the sender thread stops when the queue is empty */
+  stopAsyncThread = true;
+  sendQueue -> notifyConsumer();
+  pthread_join(asyncThread, NULL);
+
+  delete sendQueue;
+  sendQueue = NULL;
+#endif
+}
+
+int ApMon::coalesceParameters(ApMonNames *names, int nParams, 
+			      char **paramNames, int *valueTypes, 
+			      char **paramValues, int timestamp) {
+  CoalesceBuffer *cb;
+  int i, len, prefixLen, paramsLen, n;
+  char *buf;
+  ApMonThreadContext *ctx;
+
+  ctx = getThreadContext();
+  if (ctx == NULL)
+    return RET_ERROR;
+
+  /* encode the parameters as a separate datagram body (without the
+     timestamp), then copy them after the ones from the group */
+  buf = ctx -> buf;
+  try {
+    len = encodeParams(buf, names, nParams, paramNames, valueTypes, 
+		       paramValues, -1);
+  } catch (runtime_error& err) {
+    len = RET_ERROR;
+  }
+  if (len < 0)
+    return len;
+  prefixLen = names -> encodedLen + xdrSize(XDR_INT32, NULL);
+  paramsLen = len - prefixLen;
+  memcpy(&n, buf + prefixLen - 4, 4);
+  n = ntohl(n);
+
+  lockSendMutex();
+  if (!coalesceEnabled) {
+    /* coalescing was disabled meanwhile */
+    pthread_mutex_unlock(&mutex);
+    return sendParamsDatagram(names, nParams, paramNames, valueTypes, 
+			      paramValues, timestamp);
+  }
+
+  /* find the group of the parameters */
+  cb = NULL;
+  for (i = 0; i < nCoalesceBufs; i++) {
+    if (coalesceBufs[i] -> timestamp == timestamp && 
+	strcmp(coalesceBufs[i] -> clusterName, names -> clusterName) == 0 &&
+	strcmp(coalesceBufs[i] -> nodeName, names -> nodeName) == 0) {
+      cb = coalesceBufs[i];
+      break;
+    }
+  }
+
+  /* send the group's datagram if the parameters don't fit in it */
+  if (cb != NULL && cb -> len + paramsLen + xdrSize(XDR_INT32, NULL) + 
+      MAX_HEADER_LENGTH > MAX_DGRAM_SIZE)
+    sendCoalesceBuffers(1, &cb);
+
+  if (cb == NULL) {
+    if (nCoalesceBufs == MAX_COALESCE_BUFFERS) {
+      /* reuse the buffer of the oldest group */
+      cb = coalesceBufs[0];
+      sendCoalesceBuffers(1, &cb);
+      memmove(coalesceBufs, coalesceBufs + 1, 
+	      (MAX_COALESCE_BUFFERS - 1) * sizeof(CoalesceBuffer *));
+      nCoalesceBufs--;
+      coalesceBufs[nCoalesceBufs] = cb;
+    }
+    cb = coalesceBufs[nCoalesceBufs];
+    free(cb -> clusterName);
+    free(cb -> nodeName);
+    cb -> clusterName = strdup(names -> clusterName);
+    cb -> nodeName = strdup(names -> nodeName);
+    if (cb -> clusterName == NULL || cb -> nodeName == NULL) {
+      pthread_mutex_unlock(&mutex);
+      return RET_ERROR;
+    }
+    cb -> timestamp = timestamp;
+    cb -> nParams = 0;
+    cb -> countPos = prefixLen - 4;
+    cb -> len = prefixLen;
+    memcpy(cb -> data, buf, prefixLen);
+    nCoalesceBufs++;
+  }
+
+  if (cb -> len + paramsLen + xdrSize(XDR_INT32, NULL) + MAX_HEADER_LENGTH
+      > MAX_DGRAM_SIZE) {
+    /* the parameters don't fit with the timestamp */
+    pthread_mutex_unlock(&mutex);
+    return RET_TOO_LARGE;
+  }
+  memcpy(cb -> data + cb -> len, buf + prefixLen, paramsLen);
+  cb -> len += paramsLen;
+  cb -> nParams += n;
+
+  pthread_mutex_unlock(&mutex);
+  return RET_SUCCESS;
+}
+
+void ApMon::sendCoalesceBuffers(int nBufs, CoalesceBuffer **bufs) {
+  char *bodies[MAX_COALESCE_BUFFERS];
+  int lens[MAX_COALESCE_BUFFERS], nParams[MAX_COALESCE_BUFFERS];
+  int results[MAX_COALESCE_BUFFERS * MAX_N_DESTINATIONS];
+  int i, j, n, tmp, crtSeq, priority;
+  ApMonRateBucket *buckets[MAX_COALESCE_BUFFERS];
+  CoalesceBuffer *cb;
+  char msg[200];
+  ApMonThreadContext *ctx;
+  ApMonDestTable *table;
+#ifndef WIN32
+  SendQueueSlot *slot;
+#endif
+
+  // mutex is locked
+  /* complete the datagrams: the number of parameters and the timestamp */
+  n = 0;
+  for (i = 0; i < nBufs; i++) {
+    cb = bufs[i];
+    if (cb -> nParams == 0)
+      continue;
+    buckets[n] = selectBucket(cb -> clusterName, &priority);
+    if (takeToken(buckets[n], priority)) {
+      tmp = htonl(cb -> nParams);
+      memcpy(cb -> data + cb -> countPos, &tmp, 4);
+      if (cb -> timestamp > 0) {
+	tmp = htonl(cb -> timestamp);
+	memcpy(cb -> data + cb -> len, &tmp, 4);
+	cb -> len += 4;
+      }
+      bodies[n] = cb -> data;
+      lens[n] = cb -> len;
+      nParams[n++] = cb -> nParams;
+    }
+  }
+
+  if (n > 0) {
+#ifndef WIN32
+    APMON_ATOMIC_ADD(&asyncProducers, 1);
+    if (asyncEnabled) {
+      for (i = 0; i < n; i++) {
+	if ((slot = claimSendSlot()) == NULL) {
+	  returnTokens(buckets[i], 1);
+	  continue;
+	}
+	memcpy(slot -> data, bodies[i], lens[i]);
+	sendQueue -> publish(slot, lens[i]);
+      }
+      sendQueue -> notifyConsumer();
+      n = 0;
+    }
+    APMON_ATOMIC_ADD(&asyncProducers, -1);
+#endif
+  }
+
+  /* mutexDest may be locked here by getDestTable(), because it is always 
+     locked after mutex */
+  if (n > 0 && (ctx = getThreadContext()) != NULL) {
+    table = getDestTable(ctx);
+    sendDatagrams(table, n, bodies, lens, results, &crtSeq);
+    for (i = 0; i < n && isLoggable(FINE); i++) {
+      for (j = 0; j < table -> nDestinations; j++) {
+	if (results[i * table -> nDestinations + j] == RET_ERROR)
+	  continue;
+	snprintf(msg, 199, "Datagram with size %d, instance id %d, sequence number %d, sent to %s, containing %d coalesced parameters", results[i * table -> nDestinations + j], instance_id, (crtSeq + i) % TWO_BILLION, table -> destinations[j].address, nParams[i]);
+	logger(FINE, msg);
+      }
+    }
+  }
+
+  /* empty the buffers, but keep their groups */
+  for (i = 0; i < nBufs; i++) {
+    bufs[i] -> nParams = 0;
+    bufs[i] -> len = bufs[i] -> countPos + 4;
+  }
+}
+
+void ApMon::flushParameters() {
+  lockSendMutex();
+  if (nCoalesceBufs > 0)
+    sendCoalesceBuffers(nCoalesceBufs, coalesceBufs);
+  nCoalesceBufs = 0;
+  pthread_mutex_unlock(&mutex);
+}
+
+void ApMon::setCoalescing(bool coalesce, long interval) {
+  char logmsg[100];
+  int i;
+
+  if (interval <= 0)
+    interval = COALESCE_INTERVAL;
+  if (coalesce) {
+    snprintf(logmsg, 99, "Enabling the coalescing of the parameters, time interval %ld s... ", interval);
+    logger(INFO, logmsg);
+  } else if (coalesceEnabled)
+    logger(INFO, "Disabling the coalescing of the parameters...");
+
+  pthread_mutex_lock(&mutex);
+  if (coalesce && !coalesceEnabled) {
+    for (i = 0; i < MAX_COALESCE_BUFFERS; i++) {
+      coalesceBufs[i] = (CoalesceBuffer *)malloc(sizeof(CoalesceBuffer));
+      if (coalesceBufs[i] == NULL)
+	break;
+      coalesceBufs[i] -> clusterName = NULL;
+      coalesceBufs[i] -> nodeName = NULL;
+    }
+    if (i < MAX_COALESCE_BUFFERS) {
+      logger(WARNING, "[ setCoalescing() ] Cannot allocate the coalescing buffers");
+      while (--i >= 0)
+	free(coalesceBufs[i]);
+      coalesce = false;
+    } else {
+      nCoalesceBufs = 0;
+      coalesceEnabled = true;
+    }
+  }
+  if (!coalesce && coalesceEnabled) {
+    /* send the buffered parameters */
+    if (nCoalesceBufs > 0)
+      sendCoalesceBuffers(nCoalesceBufs, coalesceBufs);
+    nCoalesceBufs = 0;
+    coalesceEnabled = false;
+    for (i = 0; i < MAX_COALESCE_BUFFERS; i++) {
+      free(coalesceBufs[i] -> clusterName);
+      free(coalesceBufs[i] -> nodeName);
+      free(coalesceBufs[i]);
+      coalesceBufs[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+
+  pthread_mutex_lock(&mutexBack);
+  this -> coalesce = coalesce;
+  this -> coalesceInterval = interval;
+  this -> coalesceChanged = true;
+  if (coalesce)
+    setBackgroundThread(true);
+  else {
+    // disable the background thread if it is not needed anymore
+    if (jobMonitoring == false && sysMonitoring == false && 
+	confCheck == false && aggregate == false && dgramLogFlush == false &&
+	selfStats == false)
+      setBackgroundThread(false);
+  }
+  pthread_mutex_unlock(&mutexBack);
+}
+
+void ApMon::setAggregation(bool aggregate, long interval) {
+  char logmsg[100];
+
+  if (interval <= 0)
+    interval = AGGREGATE_INTERVAL;
+  if (aggregate) {
+    snprintf(logmsg, 99, "Enabling the aggregation of the recorded values, time interval %ld s... ", interval);
+    logger(INFO, logmsg);
+  } else if (aggregateEnabled)
+    logger(INFO, "Disabling the aggregation of the recorded values...");
+
+  if (aggregate) {
+    /* the table for the values of the threads which exit */
+    pthread_mutex_lock(&mutexDest);
+    try {
+      if (retiredAgg == NULL)
+	retiredAgg = new AggregationTable(MAX_AGGREGATE_SERIES);
+      if (counterTable == NULL) {
+	counterTable = new CounterTable(MAX_AGGREGATE_SERIES);
+	lastCounterSample = getMonotonicTime();
+      }
+    } catch (runtime_error &err) {
+      logger(WARNING, err.what());
+      aggregate = false;
+    }
+    pthread_mutex_unlock(&mutexDest);
+  }
+
+  if (!aggregate && aggregateEnabled) {
+    /* send the summaries of the values recorded so far */
+    aggregateEnabled = false;
+    flushAggregates();
+  }
+  if (!aggregate) {
+    /* the counters start again from 0 */
+    pthread_mutex_lock(&mutexDest);
+    delete counterTable;
+    counterTable = NULL;
+    pthread_mutex_unlock(&mutexDest);
+  }
+  aggregateEnabled = aggregate;
+
+  pthread_mutex_lock(&mutexBack);
+  this -> aggregate = aggregate;
+  this -> aggregateInterval = interval;
+  this -> aggregateChanged = true;
+  if (aggregate)
+    setBackgroundThread(true);
+  else {
+    // disable the background thread if it is not needed anymore
+    if (jobMonitoring == false && sysMonitoring == false && 
+	confCheck == false && coalesce == false && dgramLogFlush == false &&
+	selfStats == false)
+      setBackgroundThread(false);
+  }
+  pthread_mutex_unlock(&mutexBack);
+}
+
+int ApMon::record(char *clusterName, char *nodeName, char *paramName, 
+		  double value) {
+  return recordValue(clusterName, nodeName, paramName, value, AGG_VALUES);
+}
+
+int ApMon::recordDistribution(char *clusterName, char *nodeName, 
+			      char *paramName, double value) {
+  return recordValue(clusterName, nodeName, paramName, value, 
+		     AGG_DISTRIBUTION);
+}
+
+int ApMon::counterAdd(char *clusterName, char *nodeName, char *paramName, 
+		      double delta) {
+  return recordValue(clusterName, nodeName, paramName, delta, 
+		     AGG_COUNTER_ADD);
+}
+
+int ApMon::counterSet(char *clusterName, char *nodeName, char *paramName, 
+		      double value) {
+  return recordValue(clusterName, nodeName, paramName, value, 
+		     AGG_COUNTER_SET);
+}
+
+int ApMon::recordValue(char *clusterName, char *nodeName, char *paramName, 
+		       double value, int kind) {
+  ApMonThreadContext *ctx;
+  ApMonNames *names;
+  AggregationTable *agg;
+
+  if (!aggregateEnabled || paramName == NULL)
+    return RET_ERROR;
+  ctx = getThreadContext();
+  if (ctx == NULL)
+    return RET_ERROR;
+  /* the names are not copied in the thread context, because a thread may
+     record series with different names in turn */
+  if (clusterName == NULL) {
+    names = (ctx -> names != NULL) ? ctx -> names : defaultNames;
+    if (names == NULL)
+      return RET_ERROR;
+    clusterName = names -> clusterName;
+    nodeName = names -> nodeName;
+  } else if (nodeName == NULL)
+    nodeName = this -> myHostname;
+
+  if (ctx -> agg == NULL) {
+    try {
+      agg = new AggregationTable(MAX_AGGREGATE_SERIES);
+    } catch (runtime_error &err) {
+      return RET_ERROR;
+    }
+    /* the table is read by the background thread */
+    APMON_MEMORY_BARRIER();
+    ctx -> agg = agg;
+  }
+  return ctx -> agg -> record(clusterName, nodeName, paramName, value, 
+			      getMonotonicTime(), kind);
+}
+
+int ApMon::setQuantiles(int nQuantiles, double *quantiles) {
+  int i;
+
+  if (nQuantiles < 1 || nQuantiles > MAX_QUANTILES || quantiles == NULL)
+    return RET_ERROR;
+  for (i = 0; i < nQuantiles; i++) {
+    if (!(quantiles[i] >= 0 && quantiles[i] <= 1))
+      return RET_ERROR;
+  }
+
+  pthread_mutex_lock(&mutexBack);
+  this -> nQuantiles = nQuantiles;
+  for (i = 0; i < nQuantiles; i++)
+    this -> quantiles[i] = quantiles[i];
+  pthread_mutex_unlock(&mutexBack);
+  return RET_SUCCESS;
+}
+
+void ApMon::flushAggregates() {
+  AggregationTable *merged;
+  ApMonThreadContext *ctx;
+
+  try {
+    merged = new AggregationTable(MAX_AGGREGATE_SERIES);
+  } catch (runtime_error &err) {
+    logger(WARNING, err.what());
+    return;
+  }
+
+  /* combine the values recorded by all the threads */
+  pthread_mutex_lock(&mutexDest);
+  for (ctx = threadContexts; ctx != NULL; ctx = ctx -> next) {
+    if (ctx -> agg != NULL)
+      ctx -> agg -> drainTo(merged);
+  }
+  if (retiredAgg != NULL)
+    retiredAgg -> drainTo(merged);
+  if (counterTable != NULL)
+    sampleCounters(merged);
+  pthread_mutex_unlock(&mutexDest);
+
+  if (merged -> getNumSeries() > 0)
+    sendAggregates(merged);
+  delete merged;
+}
+
+void ApMon::sampleCounters(AggregationTable *table) {
+  AggSeries **list, *s;
+  CounterSeries **counters, *c;
+  long long now;
+  double rate;
+  bool created;
+  int n, i;
+
+  now = getMonotonicTime();
+  /* the increments and the values recorded in the time interval */
+  list = (AggSeries **)malloc((table -> getNumSeries() + 1) * 
+			      sizeof(AggSeries *));
+  if (list == NULL) {
+    logger(WARNING, "[ sampleCounters() ] Cannot allocate memory for the counters");
+    return;
+  }
+  n = table -> getSeries(list);
+  for (i = 0; i < n; i++) {
+    s = list[i];
+    if (s -> kind != AGG_COUNTER_ADD && s -> kind != AGG_COUNTER_SET)
+      continue;
+    c = counterTable -> lookup(s -> clusterName, s -> nodeName, 
+			       s -> paramName, &created);
+    if (c != NULL) {
+      if (s -> kind == AGG_COUNTER_ADD) {
+	/* the counter started at the beginning of the time interval */
+	if (created)
+	  c -> counter.start(0, lastCounterSample);
+	c -> counter.add(s -> sum);
+      } else
+	c -> counter.set(s -> last);
+    }
+    /* the increments are not sent as a summary */
+    s -> count = 0;
+  }
+  free(list);
 
-  for (i = 0; i < confURLs.nConfURLs; i++) {
-      free(confURLs.vURLs[i]);
-      free(confURLs.lastModifURLs[i]);
+  /* the rates of all the counters */
+  counters = (CounterSeries **)malloc((counterTable -> getNumSeries() + 1) *
+				      sizeof(CounterSeries *));
+  if (counters == NULL) {
+    logger(WARNING, "[ sampleCounters() ] Cannot allocate memory for the counters");
+    return;
   }
+  n = counterTable -> getSeries(counters);
+  for (i = 0; i < n; i++) {
+    c = counters[i];
+    if (c -> counter.rate(now, &rate))
+      table -> record(c -> clusterName, c -> nodeName, c -> paramName, rate,
+		      now, AGG_RATE);
+  }
+  free(counters);
+  lastCounterSample = now;
 }
 
-int ApMon::sendParameters(char *clusterName, char *nodeName,
-	       int nParams, char **paramNames, int *valueTypes, 
-			 char **paramValues) {
- return sendTimedParameters(clusterName, nodeName, nParams, 
-			    paramNames, valueTypes, paramValues, -1);
-}
+static int compareSeriesNames(const void *p1, const void *p2) {
+  const AggSeries *s1 = *(AggSeries * const *)p1;
+  const AggSeries *s2 = *(AggSeries * const *)p2;
+  int ret;
 
-int ApMon::sendTimedParameters(char *clusterName, char *nodeName,
-	       int nParams, char **paramNames, int *valueTypes, 
-	       char **paramValues, int timestamp) {
-  int i;
-  int ret, ret1, ret2;
-  char msg[200], buf2[MAX_HEADER_LENGTH+4], newBuf[MAX_DGRAM_SIZE], crtAddr[128];
-  char *headerTmp;
-  char header[MAX_HEADER_LENGTH] = "v:";
-  strcat(header, APMON_VERSION);
-  strcat(header, "_cpp"); // to indicate this is the C++ version
-  strcat(header, "p:");
+  ret = strcmp(s1 -> clusterName, s2 -> clusterName);
+  if (ret == 0)
+    ret = strcmp(s1 -> nodeName, s2 -> nodeName);
+  return ret;
+}
 
-  pthread_mutex_lock(&mutex);
+void ApMon::sendAggregates(AggregationTable *table) {
+  static const char *plainSuffixes[] = {"_min", "_max", "_avg", "_count", 
+					"_last"};
+  static const char *rateSuffixes[] = {"_rate"};
+  const char *quantileSuffixes[MAX_QUANTILES + 2], **suffixes;
+  char quantileNames[MAX_QUANTILES][16];
+  double q[MAX_QUANTILES];
+  AggSeries **list, *s;
+  char **paramNames, **paramValues, *nameBuf;
+  int *valueTypes, *counts;
+  double *values, *v;
+  int nSeries, nq, first, i, j, k, nv, nSummary, nParams, nameLen, pos, ret;
+  char logmsg[200];
 
-  if(!shouldSend()) {
-     pthread_mutex_unlock(&mutex);
-     return RET_NOT_SENT;
-  }
-		
-  if (clusterName != NULL) { // don't keep the cached values for cluster name
-    // and node name
-    free(this -> clusterName);
-    this -> clusterName = strdup(clusterName);
-    
-    if (nodeName != NULL) {  /* the user provided a name */
-      free(this -> nodeName);
-      this -> nodeName = strdup(nodeName);
-    }
-    else { /* set the node name to the node's IP */
-      free(this -> nodeName);
-      this -> nodeName = strdup(this -> myHostname);
-    }  // else
-  } // if
-  
-  if (this -> clusterName == NULL || this -> nodeName == NULL) {
-    pthread_mutex_unlock(&mutex);
-    return -1;
+  /* the suffixes of the parameters with the quantiles */
+  pthread_mutex_lock(&mutexBack);
+  nq = nQuantiles;
+  for (k = 0; k < nq; k++)
+    q[k] = quantiles[k];
+  pthread_mutex_unlock(&mutexBack);
+  for (k = 0; k < nq; k++) {
+    snprintf(quantileNames[k], 16, "_p%g", q[k] * 100);
+    quantileSuffixes[k] = quantileNames[k];
   }
+  quantileSuffixes[nq] = "_max";
+  quantileSuffixes[nq + 1] = "_count";
+
+  nSeries = table -> getNumSeries();
+  list = (AggSeries **)malloc(nSeries * sizeof(AggSeries *));
+  paramNames = (char **)malloc((MAX_QUANTILES + 2) * nSeries * sizeof(char *));
+  paramValues = (char **)malloc((MAX_QUANTILES + 2) * nSeries * sizeof(char *));
+  valueTypes = (int *)malloc((MAX_QUANTILES + 2) * nSeries * sizeof(int));
+  values = (double *)malloc((MAX_QUANTILES + 2) * nSeries * sizeof(double));
+  counts = (int *)malloc(nSeries * sizeof(int));
+  if (list == NULL || paramNames == NULL || paramValues == NULL || 
+      valueTypes == NULL || values == NULL || counts == NULL) {
+    logger(WARNING, "[ sendAggregates() ] Cannot allocate memory for the summaries");
+    nSeries = 0;
+  } else
+    nSeries = table -> getSeries(list);
+  if (nSeries > 0)
+    qsort(list, nSeries, sizeof(AggSeries *), compareSeriesNames);
+
+  for (first = 0; first < nSeries; first = i) {
+    /* the series with the same cluster name and node name */
+    nameLen = 0;
+    for (i = first; i < nSeries && 
+	   compareSeriesNames(&list[i], &list[first]) == 0; i++)
+      nameLen += (MAX_QUANTILES + 2) * (strlen(list[i] -> paramName) + 16);
+    nameBuf = (char *)malloc(nameLen);
+    if (nameBuf == NULL) {
+      logger(WARNING, "[ sendAggregates() ] Cannot allocate memory for the summaries");
+      continue;
+    }
 
-  //sortParams(nParams, paramNames, valueTypes, paramValues);
+    nParams = 0;
+    pos = 0;
+    for (j = first; j < i; j++) {
+      s = list[j];
+      v = values + j * (MAX_QUANTILES + 2);
+      counts[j] = (int)s -> count;
+      if (s -> kind == AGG_RATE) {
+	/* the rate of a counter */
+	suffixes = rateSuffixes;
+	nSummary = 1;
+	v[0] = s -> last;
+      } else if (s -> buckets == NULL) {
+	/* min, max, avg, count, last */
+	suffixes = plainSuffixes;
+	nSummary = 5;
+	v[0] = s -> min;
+	v[1] = s -> max;
+	v[2] = s -> sum / s -> count;
+	v[3] = s -> last;
+      } else {
+	/* the quantiles, max, count */
+	suffixes = quantileSuffixes;
+	nSummary = nq + 2;
+	for (k = 0; k < nq; k++)
+	  v[k] = AggregationTable::quantile(s, q[k]);
+	v[nq] = s -> max;
+      }
 
-  /* try to encode the parameters */
-  try {
-    encodeParams(nParams, paramNames, valueTypes, paramValues, timestamp);
-  } catch (runtime_error& err) {
-    pthread_mutex_unlock(&mutex);
-    return -1;
+      nv = 0;
+      for (k = 0; k < nSummary; k++) {
+	paramNames[nParams] = nameBuf + pos;
+	pos += snprintf(nameBuf + pos, nameLen - pos, "%s%s", s -> paramName,
+			suffixes[k]) + 1;
+	if (strcmp(suffixes[k], "_count") == 0) {
+	  valueTypes[nParams] = XDR_INT32;
+	  paramValues[nParams] = (char *)&counts[j];
+	} else {
+	  valueTypes[nParams] = XDR_REAL64;
+	  paramValues[nParams] = (char *)&v[nv++];
+	}
+	nParams++;
+      }
+    }
+
+    /* the parameters are split among as few datagrams as possible */
+    ret = sendParameters(list[first] -> clusterName, list[first] -> nodeName,
+			 nParams, paramNames, valueTypes, paramValues);
+    if (ret == RET_ERROR) {
+      snprintf(logmsg, 199, "[ sendAggregates() ] Error sending the summaries for cluster %s, node %s", list[first] -> clusterName, list[first] -> nodeName);
+      logger(WARNING, logmsg);
+    }
+    free(nameBuf);
   }
 
-  headerTmp = (char *)malloc(MAX_HEADER_LENGTH * sizeof(char)); 
-  /* for each destination */
-  for (i = 0; i < nDestinations; i++) {
-    XDR xdrs;
-    struct sockaddr_in destAddr;
+  free(list);
+  free(paramNames);
+  free(paramValues);
+  free(valueTypes);
+  free(values);
+  free(counts);
+}
 
-    /* initialize the destination address */
-    memset(&destAddr, 0, sizeof(destAddr));
-    destAddr.sin_family = AF_INET;
-    destAddr.sin_port = htons(destPorts[i]);
-#ifndef WIN32
-    inet_pton(AF_INET, destAddresses[i], &destAddr.sin_addr);
+int ApMon::encodeHeader(char *passwd, char *hbuf) {
+  int len;
+  char headerTmp[MAX_HEADER_LENGTH];
+
+  /* the header contains the version (with "_cpp" to indicate this is the 
+     C++ version) and the password for the destination */
+  snprintf(headerTmp, MAX_HEADER_LENGTH, "v:%s_cppp:%s", APMON_VERSION, 
+	   passwd);
+
+  /* the room for the sequence number is reserved */
+  len = strlen(headerTmp);
+  XdrEncoder enc(hbuf, MAX_HEADER_LENGTH - 4);
+  if (!enc.fits(XdrEncoder::stringSize(len) + xdrSize(XDR_INT32, NULL)))
+    return RET_ERROR;
+
+  /* encode the header */
+  enc.putString(headerTmp, len);
+  /* add the instance ID */
+  enc.putInt(instance_id);
+  return enc.length();
+}
+
+#ifdef APMON_HAVE_SENDMMSG
+typedef struct mmsghdr apmon_msghdr_t;
 #else
-    int dummy = sizeof(destAddr);
-    snprintf(crtAddr, 127, "%s:%d", destAddresses[i], destPorts[i]);
-    ret = WSAStringToAddress(crtAddr, AF_INET, NULL, (struct sockaddr *) &destAddr, &dummy);
-    if(ret){
-      ret = WSAGetLastError();
-      snprintf(msg, 199, "[ sendTimedParameters() ] Error packing address %s, code %d ", crtAddr, ret);
-      return -1;
-    }
+/** Same layout as struct mmsghdr, for the systems that don't have sendmmsg(). */
+typedef struct { 
+  struct msghdr msg_hdr; 
+  unsigned int msg_len; 
+} apmon_msghdr_t;
 #endif
-    /* add the header (which is different for each destination) */
-   
-    strncpy(headerTmp, header, MAX_HEADER_LENGTH-1);
-    strncat(headerTmp, destPasswds[i], MAX_HEADER_LENGTH-strlen(headerTmp)-1);
 
-    /* initialize the XDR stream to encode the header */
-    xdrmem_create(&xdrs, buf2, MAX_HEADER_LENGTH, XDR_ENCODE); 
+#ifndef WIN32
+/**
+ * Passes a vector of datagrams to the kernel (with a single system call, 
+ * if sendmmsg() is available). For each datagram msgs[i], the number of bytes
+ * sent (or RET_ERROR) is stored in results[idx[i]]. If sendHist is not 
+ * NULL, the duration of each system call is recorded in it and added to
+ * *sendTime.
+ * @return The number of datagrams that could not be sent.
+ */
+static int sendVector(int sockfd, apmon_msghdr_t *msgs, int nMsgs, 
+		      int *idx, int *results, char **destNames,
+		      LatencyHistogram *sendHist, long long *sendTime) {
+  int i, ret, done = 0, nErrors = 0;
+  long long start = 0;
+  char msg[200];
 
-    /* encode the header */
-    ret = xdr_string(&xdrs, &(headerTmp), strlen(headerTmp) + 1);
-    /* add the instance ID and the sequence number */
-    ret1 = xdr_int(&xdrs, &(instance_id));
-    ret2 = xdr_int(&xdrs, &(seq_nr));
+  while (done < nMsgs) {
+    if (sendHist != NULL)
+      start = LatencyHistogram::now();
+#ifdef APMON_HAVE_SENDMMSG
+    ret = sendmmsg(sockfd, msgs + done, nMsgs - done, 0);
+#else
+    ret = sendmsg(sockfd, &(msgs[done].msg_hdr), 0);
+#endif
+    if (sendHist != NULL) {
+      start = LatencyHistogram::now() - start;
+      sendHist -> record(start);
+      *sendTime += start;
+    }
 
-    if (!ret || !ret1 || !ret2) {
-        free(headerTmp);
-        pthread_mutex_unlock(&mutex);
-        return -1;
+#ifdef APMON_HAVE_SENDMMSG
+    if (ret > 0) {
+      for (i = done; i < done + ret; i++)
+	results[idx[i]] = msgs[i].msg_len;
+      done += ret;
+      continue;
+    }
+#else
+    if (ret >= 0) {
+      results[idx[done++]] = ret;
+      continue;
     }
+#endif
+    /* the first datagram of the remaining ones could not be sent; skip it
+       and go on with the others (on a connected socket, ECONNREFUSED
+       means that the destination answered with ICMP port unreachable) */
+    snprintf(msg, 199, "[ sendDatagrams() ] Error sending data to destination %s: %s", destNames[done], strerror(errno));
+    logger(WARNING, msg);
+    results[idx[done++]] = RET_ERROR;
+    nErrors++;
+  }
+  return nErrors;
+}
+#endif
 
-    /* concatenate the header and the rest of the datagram */
-    int buf2Length = xdrSize(XDR_STRING, headerTmp) + 2 * xdrSize(XDR_INT32, NULL);
-    memcpy(newBuf, buf2, buf2Length);
-    memcpy(newBuf + buf2Length, buf, dgramSize);
+int ApMon::sendDatagrams(ApMonDestTable *table, int nDgrams, char **bodies,
+			 int *bodyLens, int *results, int *firstSeq) {
+  uint32_t seqNrs[MAX_SEND_VECTOR];
+  int i, j, k, nMsgs = 0, nErrors = 0, crtSeq, nextSeq;
+  int nDest = table -> nDestinations;
+  long nSent = 0;
+  long long nBytes = 0, start = 0, sendTime = 0;
+  unsigned long destMask;
+  ApMonDestination *dest;
+  ApMonThreadContext *ctx;
+  LatencyHistogram *lat = NULL, *sendHist = NULL;
+#ifndef WIN32
+  char *destNames[MAX_SEND_VECTOR];
+  int idx[MAX_SEND_VECTOR];
+  struct iovec iovs[MAX_SEND_VECTOR][3];
+  apmon_msghdr_t msgs[MAX_SEND_VECTOR];
+  int fd, crtSockfd = -1;
+#else
+  char logmsg[200], header[MAX_HEADER_LENGTH + 4];
+  long long sendStart;
+#endif
 
-    /* send the buffer */
-    ret = sendto(sockfd, newBuf, dgramSize + buf2Length, 0, 
-		 (struct sockaddr *)&destAddr, sizeof(destAddr));
-    if (ret == RET_ERROR) {
-      free(headerTmp);
-      pthread_mutex_unlock(&mutex);
+  ctx = getThreadContext();
+  if (latencyEnabled && ctx != NULL && (lat = getThreadLatency(ctx)) != NULL) {
+    sendHist = &lat[LATENCY_SEND];
+    start = LatencyHistogram::now();
+  }
 
-      /*re-initialize the socket */
+  /* reserve the sequence numbers of the datagrams */
+  do {
+    crtSeq = seq_nr;
+    nextSeq = (crtSeq + nDgrams) % TWO_BILLION;
+  } while (!APMON_ATOMIC_CAS(&seq_nr, crtSeq, nextSeq));
+  if (firstSeq != NULL)
+    *firstSeq = crtSeq;
+
+  /* build a message for each destination and each datagram; the vector is
+     passed to the kernel when it is full or when the socket changes (all
+     the messages go through the shared socket, unless connected sockets 
+     are used) */
+  for (j = 0; j < nDest; j++) {
+    dest = &(table -> destinations[j]);
+    for (i = 0; i < nDgrams; i++) {
+      k = i * nDest + j;
+      if (dest -> headerLen == RET_ERROR) {
+	results[k] = RET_ERROR;
+	nErrors++;
+	continue;
+      }
 #ifndef WIN32
-      close(sockfd);
-#else
-      closesocket(sockfd);
+      fd = (dest -> sockfd >= 0) ? dest -> sockfd : sockfd;
+      if (nMsgs > 0 && (fd != crtSockfd || nMsgs == MAX_SEND_VECTOR)) {
+	nErrors += sendVector(crtSockfd, msgs, nMsgs, idx, results, destNames,
+			      sendHist, &sendTime);
+	nMsgs = 0;
+      }
+      crtSockfd = fd;
 #endif
-      initSocket();
 
-      /* throw exception because the datagram was not sent */
-      snprintf(msg, 199, "[ sendTimedParameters() ] Error sending data to destination %s ", destAddresses[i]);
-      return -1;
+      /* the cached header is followed by the sequence number (XDR-encoded,
+	 i.e., in network byte order) */
+      seqNrs[nMsgs] = htonl((crtSeq + i) % TWO_BILLION);
+#ifndef WIN32
+      idx[nMsgs] = k;
+      destNames[nMsgs] = dest -> address;
+      iovs[nMsgs][0].iov_base = dest -> header;
+      iovs[nMsgs][0].iov_len = dest -> headerLen;
+      iovs[nMsgs][1].iov_base = &seqNrs[nMsgs];
+      iovs[nMsgs][1].iov_len = sizeof(seqNrs[nMsgs]);
+      iovs[nMsgs][2].iov_base = bodies[i];
+      iovs[nMsgs][2].iov_len = bodyLens[i];
+      memset(&msgs[nMsgs], 0, sizeof(msgs[nMsgs]));
+      if (dest -> sockfd < 0) {
+	msgs[nMsgs].msg_hdr.msg_name = &(dest -> addr);
+	msgs[nMsgs].msg_hdr.msg_namelen = sizeof(dest -> addr);
+      }
+      msgs[nMsgs].msg_hdr.msg_iov = iovs[nMsgs];
+      msgs[nMsgs].msg_hdr.msg_iovlen = 3;
+      nMsgs++;
+#else
+      memcpy(header, dest -> header, dest -> headerLen);
+      memcpy(header + dest -> headerLen, &seqNrs[0], sizeof(seqNrs[0]));
+      sendStart = (sendHist != NULL) ? LatencyHistogram::now() : 0;
+      results[k] = sendDatagram(&(dest -> addr), header, 
+				dest -> headerLen + sizeof(seqNrs[0]), 
+				bodies[i], bodyLens[i]);
+      if (sendHist != NULL) {
+	sendStart = LatencyHistogram::now() - sendStart;
+	sendHist -> record(sendStart);
+	sendTime += sendStart;
+      }
+      if (results[k] == RET_ERROR) {
+	snprintf(logmsg, 199, "[ sendDatagrams() ] Error sending data to destination %s", dest -> address);
+	logger(WARNING, logmsg);
+	nErrors++;
+      }
+#endif
     }
-    else {
-      snprintf(msg, 199, "Datagram with size %d, instance id %d, sequence number %d, sent to %s, containing parameters:", ret, instance_id, seq_nr, destAddresses[i]);
-      logger(FINE, msg);
-      logParameters(FINE, nParams, paramNames, valueTypes, paramValues);
+  }
+#ifndef WIN32
+  /* the shared socket is not re-initialized after errors: other threads
+     may be using it, and a failed send doesn't affect an UDP socket */
+  if (nMsgs > 0)
+    nErrors += sendVector(crtSockfd, msgs, nMsgs, idx, results, destNames,
+			  sendHist, &sendTime);
+#endif
+
+  /* the time spent building the messages is the time of the batch minus 
+     the time of the system calls */
+  if (lat != NULL)
+    lat[LATENCY_HEADER].record(LatencyHistogram::now() - start - sendTime);
+
+  /* the counters of the thread are updated without atomic operations; the
+     errors, which are rare, are counted in the destination table */
+  for (k = 0; k < nDgrams * nDest; k++) {
+    if (results[k] != RET_ERROR) {
+      nSent++;
+      nBytes += results[k];
+    } else
+      APMON_ATOMIC_ADD(&(table -> destinations[k % nDest].nErrors), 1);
+  }
+  if (ctx != NULL) {
+    ctx -> stats.dgramsSent += nSent;
+    ctx -> stats.bytesSent += nBytes;
+  }
+
+  /* the bodies are only copied in the log; they are decoded when the log
+     is written */
+  if (dgramLogSink != DGRAM_LOG_OFF) {
+    for (i = 0; i < nDgrams; i++) {
+      destMask = 0;
+      for (j = 0; j < nDest; j++) {
+	if (results[i * nDest + j] != RET_ERROR)
+	  destMask |= 1UL << j;
+      }
+      dgramLog -> add((crtSeq + i) % TWO_BILLION, destMask, destGeneration,
+		      bodies[i], bodyLens[i]);
     }
-    xdr_destroy(&xdrs);
-    
   }
 
-  seq_nr = (seq_nr + 1) % TWO_BILLION;
-  free(headerTmp);
-  pthread_mutex_unlock(&mutex);
-  return RET_SUCCESS;
+  return (nErrors > 0) ? RET_ERROR : RET_SUCCESS;
 }
 
+int ApMon::sendDatagram(struct sockaddr_in *destAddr, char *header, 
+			int headerLen, char *body, int bodyLen) {
+#ifndef WIN32
+  struct iovec iov[2];
+  struct msghdr msgh;
+
+  /* scatter-gather: the kernel assembles the datagram from the two parts */
+  iov[0].iov_base = header;
+  iov[0].iov_len = headerLen;
+  iov[1].iov_base = body;
+  iov[1].iov_len = bodyLen;
+
+  memset(&msgh, 0, sizeof(msgh));
+  msgh.msg_name = destAddr;
+  msgh.msg_namelen = sizeof(*destAddr);
+  msgh.msg_iov = iov;
+  msgh.msg_iovlen = 2;
+
+  return sendmsg(sockfd, &msgh, 0);
+#else
+  char newBuf[MAX_DGRAM_SIZE];
+
+  /* concatenate the header and the rest of the datagram */
+  memcpy(newBuf, header, headerLen);
+  memcpy(newBuf + headerLen, body, bodyLen);
+  return sendto(sockfd, newBuf, headerLen + bodyLen, 0, 
+		(struct sockaddr *)destAddr, sizeof(*destAddr));
+#endif
+}
 
 int ApMon::sendParameter(char *clusterName, char *nodeName,
 			char *paramName, int valueType, char *paramValue) {
@@ -793,110 +3492,138 @@ int ApMon::sendParameter(char *clusterName, char *nodeName,
 		    paramValue);
 }
 
-void ApMon::encodeParams(int nParams, char **paramNames, int *valueTypes, 
-			char **paramValues, int timestamp) {
-  XDR xdrs; /* XDR handle. */
-  int i, effectiveNParams;
-
-  /* count the number of parameters actually sent in the datagram
-     (the parameters with a NULL name and the string parameters
-     with a NULL value are skipped)
-  */
-  effectiveNParams = nParams;
-  for (i = 0; i < nParams; i++) {
-      if (paramNames[i] == NULL || (valueTypes[i] == XDR_STRING && 
-				    paramValues[i] == NULL)) {
-	effectiveNParams--;
-      }
-  }
-  if (effectiveNParams == 0)
-    return;
+int ApMon::encodeParams(char *outBuf, ApMonNames *names, int nParams, 
+			char **paramNames, int *valueTypes, char **paramValues,
+			int timestamp) {
+  int len;
+  long long start;
+
+  start = startEncodeTiming();
+  len = encodeParamsBody(outBuf, names, nParams, paramNames, valueTypes,
+			 paramValues, timestamp);
+  if (start > 0)
+    recordEncoding(getThreadContext(), start);
+  return len;
+}
 
-  /*** estimate the length of the send buffer ***/
+long long ApMon::startEncodeTiming() {
+  if (!selfStatsEnabled && !latencyEnabled)
+    return 0;
+  return LatencyHistogram::now();
+}
 
-  /* add the length of the cluster name & node name */
-  dgramSize =  xdrSize(XDR_STRING, clusterName) + 
-      xdrSize(XDR_STRING, nodeName) + xdrSize(XDR_INT32, NULL);
-  /* add the lengths for the parameters (name + size + value) */
-  for (i = 0; i < nParams; i++) {
-    dgramSize += xdrSize(XDR_STRING, paramNames[i]) +  xdrSize(XDR_INT32, NULL) +
-      + xdrSize(valueTypes[i], paramValues[i]);
-  }
+void ApMon::recordEncoding(ApMonThreadContext *ctx, long long start) {
+  long long duration;
 
-  /* check that the maximum datagram size is not exceeded */
-  if (dgramSize + MAX_HEADER_LENGTH > MAX_DGRAM_SIZE) 
+  if (ctx == NULL || start <= 0)
     return;
+  duration = LatencyHistogram::now() - start;
+  if (selfStatsEnabled) {
+    ctx -> stats.dgramsEncoded++;
+    ctx -> stats.encodeTime += duration;
+  }
+  if (latencyEnabled)
+    recordLatency(ctx, LATENCY_ENCODE, duration);
+}
 
-  /* initialize the XDR stream */
-  xdrmem_create(&xdrs, buf, MAX_DGRAM_SIZE, XDR_ENCODE); 
-
-  try {
-    /* encode the cluster name, the node name and the number of parameters */
-    if (!xdr_string(&xdrs, &(clusterName), strlen(clusterName) + 1))
-	return;
+int ApMon::sendTypedEncoded(ApMonThreadContext *ctx, ApMonNames *names, 
+			    int len, int nParams, long long start) {
+  int ret;
 
-    if (!xdr_string(&xdrs, &(nodeName), strlen(nodeName) + 1))
-	return;
-    
-    if (!xdr_int(&xdrs, &(effectiveNParams)))
-	return;
+  recordEncoding(ctx, start);
+  ret = sendEncodedParams(ctx, names, len, nParams, NULL, NULL, NULL);
+  if (start > 0 && latencyEnabled)
+    recordLatency(ctx, LATENCY_TOTAL, LatencyHistogram::now() - start);
+  return ret;
+}
 
-    /* encode the parameters */
-    for (i = 0; i < nParams; i++) {
-      if (paramNames[i] == NULL || (valueTypes[i] == XDR_STRING && 
-				    paramValues[i] == NULL)) {
-	logger(WARNING, "NULL parameter name or value - skipping parameter...");
-	continue;
-      }
+int ApMon::encodeParamsBody(char *outBuf, ApMonNames *names, int nParams, 
+			    char **paramNames, int *valueTypes, 
+			    char **paramValues, int timestamp) {
+  int i, n, countPos, nameLen, valueLen = 0, valueSize;
+  /* the body must leave room for the header */
+  XdrEncoder enc(outBuf, MAX_DGRAM_SIZE - MAX_HEADER_LENGTH);
+
+  /* the datagram is encoded in a single pass: the size is checked as the
+     parameters are added, and each string is scanned only once */
+
+  /* the cluster name and the node name are already encoded; the number 
+     of parameters is filled in at the end */
+  if (!enc.fits(names -> encodedLen + 4))
+    return RET_TOO_LARGE;
+  enc.putBytes(names -> encoded, names -> encodedLen);
+  countPos = enc.length();
+  enc.putInt(0);
+
+  /* encode the parameters (the parameters with a NULL name and the string
+     parameters with a NULL value are skipped) */
+  n = 0;
+  for (i = 0; i < nParams; i++) {
+    if (paramNames[i] == NULL || (valueTypes[i] == XDR_STRING && 
+				  paramValues[i] == NULL)) {
+      logger(WARNING, "NULL parameter name or value - skipping parameter...");
+      continue;
+    }
 
-      /* parameter name */
-      if (!xdr_string(&xdrs, &(paramNames[i]), strlen(paramNames[i]) + 1))
-	return;
-    
-      /* parameter value type */
-      if (!xdr_int(&xdrs, &(valueTypes[i])))  
-	return;
-
-      /* parameter value */
-      switch (valueTypes[i]) {
-      case XDR_STRING:
-	if (!xdr_string(&xdrs, &(paramValues[i]), strlen(paramValues[i]) + 1))
-	    return;
-	break;
-	//INT16 is not supported
-	/*    case XDR_INT16:  
-	      if (!xdr_short(&xdrs, (short *)(paramValues[i])))
-	      return RET_ERROR;
-	      break;
-	*/    case XDR_INT32:
-		if (!xdr_int(&xdrs, (int *)(paramValues[i])))  
-		    return;
-		break;
-      case XDR_REAL32:
-	if (!xdr_float(&xdrs, (float *)(paramValues[i])))
-	    return;
-	break;
-      case XDR_REAL64:
-	if (!xdr_double(&xdrs, (double *)(paramValues[i])))
-	    return;
-	break;
-      default:
-	    return;
-      }
+    switch (valueTypes[i]) {
+    case XDR_STRING:
+      valueLen = strlen(paramValues[i]);
+      valueSize = XdrEncoder::stringSize(valueLen);
+      break;
+      //INT16 is not supported
+    case XDR_INT32:
+    case XDR_REAL32:
+      valueSize = 4;
+      break;
+    case XDR_REAL64:
+      valueSize = 8;
+      break;
+    default:
+      return RET_ERROR;
     }
+
+    nameLen = strlen(paramNames[i]);
+    if (!enc.fits(XdrEncoder::stringSize(nameLen) + 4 + valueSize))
+      return RET_TOO_LARGE;
+
+    /* parameter name */
+    enc.putString(paramNames[i], nameLen);
+    /* parameter value type */
+    enc.putInt(valueTypes[i]);
+    /* parameter value */
+    if (valueTypes[i] == XDR_STRING)
+      enc.putString(paramValues[i], valueLen);
+    else
+      encodeValue(enc, valueTypes[i], paramValues[i]);
+    n++;
+  }
+  if (n == 0)
+    return RET_ERROR;
    
-    /* encode the timestamp if necessary */
-    if (timestamp > 0) {
-      if (!xdr_int(&xdrs, &timestamp))  
-	return;
-      dgramSize += xdrSize(XDR_INT32, NULL);
-    }
-  } catch (runtime_error& err) {
-    xdr_destroy(&xdrs);
-    return;
+  /* encode the timestamp if necessary */
+  if (timestamp > 0) {
+    if (!enc.fits(4))
+      return RET_TOO_LARGE;
+    enc.putInt(timestamp);
   }
 
-  xdr_destroy(&xdrs);
+  enc.putIntAt(countPos, n);
+  return enc.length();
+}
+
+/** The current time for the background thread. time() may lag behind 
+ * the clock of pthread_cond_timedwait() by a clock tick, in which case an
+ * operation with a short time interval would be scheduled again before 
+ * the moment when it was performed. */
+static time_t bkCurrentTime() {
+#ifndef WIN32
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec;
+#else
+  return time(NULL);
+#endif
 }
 
 #ifndef WIN32
@@ -915,13 +3642,15 @@ DWORD WINAPI bkTask(void *param) {
   int generalInfoCount;
   time_t crtTime, timeRemained;
   time_t nextRecheck = 0, nextJobInfoSend = 0, nextSysInfoSend = 0;
+  time_t nextCoalesceFlush = 0, nextAggregateFlush = 0;
+  time_t nextDgramLogFlush = 0, nextSelfStatsSend = 0;
   ApMon *apm = (ApMon *)param;
   char logmsg[200];
 
   logger(INFO, "[Starting background thread...]");
   apm -> bkThreadStarted = true;
 
-  crtTime = time(NULL);
+  crtTime = bkCurrentTime();
 
   pthread_mutex_lock(&(apm -> mutexBack));
   if (apm -> confCheck) {
@@ -937,6 +3666,14 @@ DWORD WINAPI bkTask(void *param) {
     nextJobInfoSend = crtTime + apm -> jobMonitorInterval;
   if (apm -> sysMonitoring)
     nextSysInfoSend = crtTime + apm -> sysMonitorInterval;
+  if (apm -> coalesce)
+    nextCoalesceFlush = crtTime + apm -> coalesceInterval;
+  if (apm -> aggregate)
+    nextAggregateFlush = crtTime + apm -> aggregateInterval;
+  if (apm -> dgramLogFlush)
+    nextDgramLogFlush = crtTime + DGRAM_LOG_INTERVAL;
+  if (apm -> selfStats)
+    nextSelfStatsSend = crtTime + apm -> selfStatsInterval;
   pthread_mutex_unlock(&(apm -> mutexBack));
   
   timeRemained = -1;
@@ -951,13 +3688,15 @@ DWORD WINAPI bkTask(void *param) {
     pthread_mutex_unlock(&apm -> mutexBack);
 
     /*
-    crtTime = time(NULL);
+    crtTime = bkCurrentTime();
     snprintf(logmsg, 99, "### 2 crt %ld recheck %ld sys %ld ",crtTime,  nextRecheck, 
         nextSysInfoSend);
     logger(FINE, logmsg);
     */
     
     /* determine the next operation that must be performed */
+    nextOp = -1;
+    timeRemained = -1;
     if (nextRecheck > 0 && (nextJobInfoSend <= 0 || 
 			    nextRecheck <= nextJobInfoSend)) {
       if (nextSysInfoSend <= 0 || nextRecheck <= nextSysInfoSend) {
@@ -978,6 +3717,30 @@ DWORD WINAPI bkTask(void *param) {
       }
     }
 
+    if (nextCoalesceFlush > 0 && (timeRemained == -1 || 
+				  nextCoalesceFlush - crtTime < timeRemained)) {
+      nextOp = COALESCE_FLUSH;
+      timeRemained = (nextCoalesceFlush - crtTime > 0) ? (nextCoalesceFlush - crtTime) : 0;
+    }
+
+    if (nextAggregateFlush > 0 && (timeRemained == -1 || 
+				   nextAggregateFlush - crtTime < timeRemained)) {
+      nextOp = AGGREGATE_FLUSH;
+      timeRemained = (nextAggregateFlush - crtTime > 0) ? (nextAggregateFlush - crtTime) : 0;
+    }
+
+    if (nextDgramLogFlush > 0 && (timeRemained == -1 || 
+				  nextDgramLogFlush - crtTime < timeRemained)) {
+      nextOp = DGRAM_LOG_FLUSH;
+      timeRemained = (nextDgramLogFlush - crtTime > 0) ? (nextDgramLogFlush - crtTime) : 0;
+    }
+
+    if (nextSelfStatsSend > 0 && (timeRemained == -1 || 
+				  nextSelfStatsSend - crtTime < timeRemained)) {
+      nextOp = SELF_STATS_SEND;
+      timeRemained = (nextSelfStatsSend - crtTime > 0) ? (nextSelfStatsSend - crtTime) : 0;
+    }
+
     if (timeRemained == -1) {
 	logger(INFO, "Background thread has no operation to perform...");
 	timeRemained = RECHECK_INTERVAL;
@@ -996,7 +3759,9 @@ DWORD WINAPI bkTask(void *param) {
     pthread_mutex_lock(&(apm -> mutexCond));
     /* check for changes in the settings */
     haveChange = false;
-    if (apm -> jobMonChanged || apm -> sysMonChanged || apm -> recheckChanged)
+    if (apm -> jobMonChanged || apm -> sysMonChanged || apm -> recheckChanged
+	|| apm -> coalesceChanged || apm -> aggregateChanged 
+	|| apm -> dgramLogChanged || apm -> selfStatsChanged)
       haveChange = true;
     if (apm -> jobMonChanged) {
       if (apm -> jobMonitoring) 
@@ -1020,6 +3785,34 @@ DWORD WINAPI bkTask(void *param) {
 	nextRecheck = -1;
       apm -> recheckChanged = false;
     }
+    if (apm -> coalesceChanged) {
+      if (apm -> coalesce)
+	nextCoalesceFlush = crtTime + apm -> coalesceInterval;
+      else
+	nextCoalesceFlush = -1;
+      apm -> coalesceChanged = false;
+    }
+    if (apm -> aggregateChanged) {
+      if (apm -> aggregate)
+	nextAggregateFlush = crtTime + apm -> aggregateInterval;
+      else
+	nextAggregateFlush = -1;
+      apm -> aggregateChanged = false;
+    }
+    if (apm -> dgramLogChanged) {
+      if (apm -> dgramLogFlush)
+	nextDgramLogFlush = crtTime + DGRAM_LOG_INTERVAL;
+      else
+	nextDgramLogFlush = -1;
+      apm -> dgramLogChanged = false;
+    }
+    if (apm -> selfStatsChanged) {
+      if (apm -> selfStats)
+	nextSelfStatsSend = crtTime + apm -> selfStatsInterval;
+      else
+	nextSelfStatsSend = -1;
+      apm -> selfStatsChanged = false;
+    }
     pthread_mutex_unlock(&(apm -> mutexBack));
 
     if (haveChange) {
@@ -1041,7 +3834,7 @@ DWORD WINAPI bkTask(void *param) {
       /* now perform the operation */
       if (nextOp == JOB_INFO_SEND) {
 	apm -> sendJobInfo();
-	crtTime = time(NULL);
+	crtTime = bkCurrentTime();
 	nextJobInfoSend = crtTime + apm -> getJobMonitorInterval();
       }
       
@@ -1052,10 +3845,46 @@ DWORD WINAPI bkTask(void *param) {
 	    apm -> sendGeneralInfo();
 	  generalInfoCount = (generalInfoCount + 1) % apm -> genMonitorIntervals;
 	}
-	crtTime = time(NULL);
+	crtTime = bkCurrentTime();
 	nextSysInfoSend = crtTime + apm -> getSysMonitorInterval();
       }
 
+      if (nextOp == COALESCE_FLUSH) {
+	apm -> flushParameters();
+	crtTime = bkCurrentTime();
+	pthread_mutex_lock(&(apm -> mutexBack));
+	if (apm -> coalesce)
+	  nextCoalesceFlush = crtTime + apm -> coalesceInterval;
+	pthread_mutex_unlock(&(apm -> mutexBack));
+      }
+
+      if (nextOp == AGGREGATE_FLUSH) {
+	apm -> flushAggregates();
+	crtTime = bkCurrentTime();
+	pthread_mutex_lock(&(apm -> mutexBack));
+	if (apm -> aggregate)
+	  nextAggregateFlush = crtTime + apm -> aggregateInterval;
+	pthread_mutex_unlock(&(apm -> mutexBack));
+      }
+
+      if (nextOp == DGRAM_LOG_FLUSH) {
+	apm -> flushDatagramLog();
+	crtTime = bkCurrentTime();
+	pthread_mutex_lock(&(apm -> mutexBack));
+	if (apm -> dgramLogFlush)
+	  nextDgramLogFlush = crtTime + DGRAM_LOG_INTERVAL;
+	pthread_mutex_unlock(&(apm -> mutexBack));
+      }
+
+      if (nextOp == SELF_STATS_SEND) {
+	apm -> sendSelfStats();
+	crtTime = bkCurrentTime();
+	pthread_mutex_lock(&(apm -> mutexBack));
+	if (apm -> selfStats)
+	  nextSelfStatsSend = crtTime + apm -> selfStatsInterval;
+	pthread_mutex_unlock(&(apm -> mutexBack));
+      }
+
       if (nextOp == RECHECK_CONF) {
 	resourceChanged = false;
 	try {
@@ -1097,7 +3926,7 @@ DWORD WINAPI bkTask(void *param) {
 	  logger(WARNING, "Increasing the time interval for reloading the configuration...");
 	  apm -> setCrtRecheckInterval(apm -> getRecheckInterval() * 5);
 	}
-	crtTime = time(NULL);
+	crtTime = bkCurrentTime();
 	nextRecheck = crtTime + apm -> getCrtRecheckInterval();
 	//sleep(apm -> getCrtRecheckInterval());
       }
@@ -1138,7 +3967,9 @@ void ApMon::setConfRecheck(bool confCheck, long interval) {
     setBackgroundThread(true);
   }
   else {
-    if (jobMonitoring == false && sysMonitoring == false)
+    if (jobMonitoring == false && sysMonitoring == false && 
+	coalesce == false && aggregate == false && dgramLogFlush == false &&
+	selfStats == false)
       setBackgroundThread(false);
   }
   pthread_mutex_unlock(&mutexBack);
@@ -1179,7 +4010,9 @@ void ApMon::setJobMonitoring(bool bJobMonitoring, long interval) {
     setBackgroundThread(true);
   } else {
     // disable the background thread if it is not needed anymore
-    if (this -> sysMonitoring == false && this -> confCheck == false)
+    if (this -> sysMonitoring == false && this -> confCheck == false &&
+	this -> coalesce == false && this -> aggregate == false &&
+	this -> dgramLogFlush == false && this -> selfStats == false)
       setBackgroundThread(false);
   }
   pthread_mutex_unlock(&mutexBack);
@@ -1204,7 +4037,9 @@ void ApMon::setSysMonitoring(bool bSysMonitoring, long interval) {
     setBackgroundThread(true);
   }  else {
     // disable the background thread if it is not needed anymore
-    if (this -> jobMonitoring == false && this -> confCheck == false)
+    if (this -> jobMonitoring == false && this -> confCheck == false &&
+	this -> coalesce == false && this -> aggregate == false &&
+	this -> dgramLogFlush == false && this -> selfStats == false)
       setBackgroundThread(false);
   }
   pthread_mutex_unlock(&mutexBack);
@@ -1341,8 +4176,29 @@ void ApMon::setLogLevel(char *newLevel_s) {
     logger(0, NULL, newLevel);
 }
 
+int ApMon::setLogFile(char *path) {
+  char logmsg[MAX_STRING_LEN];
+
+  if (apmon_utils::setLogFile(path) != RET_SUCCESS) {
+    snprintf(logmsg, MAX_STRING_LEN - 1, "[ setLogFile() ] Cannot open the log file %s", path);
+    logger(WARNING, logmsg);
+    return RET_ERROR;
+  }
+  return RET_SUCCESS;
+}
+
+int ApMon::setAsyncLogging(bool enable) {
+  if (apmon_utils::setAsyncLogging(enable) != RET_SUCCESS) {
+    logger(WARNING, "[ setAsyncLogging() ] Cannot enable the asynchronous logging");
+    return RET_ERROR;
+  }
+  return RET_SUCCESS;
+}
+
 	
 void ApMon::setMaxMsgRate(int maxRate) {
+  if (maxRate > MAX_MSG_RATE_LIMIT)
+    maxRate = MAX_MSG_RATE_LIMIT;
   if (maxRate > 0)
     this -> maxMsgRate  = maxRate;
 }
@@ -1456,48 +4312,240 @@ void ApMon::parseConf(FILE *fp, int *nDestinations, char **destAddresses,
   free(line);
 }
 
-bool ApMon::shouldSend() {
+/** The share of the burst (in quarters) which can be used by each 
+    priority class, so that the lower classes are dropped first when the
+    bucket is close to being empty. */
+static const int priorityShare[N_PRIORITIES] = {4, 3, 2};
+
+int ApMon::takeTokens(ApMonRateBucket *bucket, int priority, int n) {
+  long long now, refill, base, newRefill, interval, limit, room, burst;
+  int rate, granted;
+
+  rate = bucketRate(bucket);
+  if (rate <= 0)
+    return n;
+  burst = bucket -> burst > 0 ? bucket -> burst : rate;
+  if (priority < 0 || priority >= N_PRIORITIES)
+    priority = PRIORITY_NORMAL;
+  burst = burst * priorityShare[priority] / 4;
+  if (burst < 1)
+    burst = 1;
+  interval = 1000000000LL / rate;
+  limit = burst * interval;
+
+  /* each datagram moves the refill time forward by one interval; the
+     bucket is empty (for this priority) when the refill time is more 
+     than burst intervals ahead of the current time */
+  now = getMonotonicTime();
+  do {
+    refill = bucket -> refillTime;
+    base = (refill > now) ? refill : now;
+    room = (limit - (base - now)) / interval;
+    granted = (room < n) ? (int)room : n;
+    if (granted <= 0) {
+      APMON_ATOMIC_ADD(&(bucket -> nDropped), n);
+      return 0;
+    }
+    newRefill = base + granted * interval;
+  } while (!APMON_ATOMIC_CAS64(&(bucket -> refillTime), refill, newRefill));
 
-  long now = time(NULL);
-  bool doSend;
-  char msg[200];
+  APMON_ATOMIC_ADD(&(bucket -> nSent), granted);
+  if (granted < n)
+    APMON_ATOMIC_ADD(&(bucket -> nDropped), n - granted);
+  return granted;
+}
+
+int ApMon::bucketRate(ApMonRateBucket *bucket) {
+  int rate;
+
+  rate = bucket -> maxRate > 0 ? bucket -> maxRate : this -> maxMsgRate;
+  /* a larger rate would make the interval between two tokens 0 */
+  return (rate > MAX_MSG_RATE_LIMIT) ? MAX_MSG_RATE_LIMIT : rate;
+}
+
+void ApMon::returnTokens(ApMonRateBucket *bucket, int n) {
+  long long refill, interval;
+  int rate;
+
+  rate = bucketRate(bucket);
+  if (rate <= 0)
+    return;
+  interval = 1000000000LL / rate;
+
+  /* move the refill time back, as if the tokens were not taken */
+  do {
+    refill = bucket -> refillTime;
+  } while (!APMON_ATOMIC_CAS64(&(bucket -> refillTime), refill, 
+			       refill - n * interval));
+  APMON_ATOMIC_ADD(&(bucket -> nSent), -n);
+}
+
+bool ApMon::shouldSend(ApMonNames *names) {
+  ApMonRateBucket *bucket;
+  int priority;
+
+  bucket = selectBucket(names, &priority);
+  return takeToken(bucket, priority);
+}
 
-  //printf("now %ld crtTime %ld\n", now, crtTime);
+ApMonRateBucket *ApMon::selectBucket(ApMonNames *names, int *priority) {
+  ApMonRateBucket *group = getRateGroup(names);
+  ApMonRateBucket *bucket = &defaultBucket;
 
-  if (now != crtTime){
-    /** new time, update previous counters; */
-    prvSent = hWeight * prvSent + (1.0 - hWeight) * crtSent / (now - crtTime);
-    prvTime = crtTime;
-    snprintf(msg, 199, "previously sent: %ld dropped: %ld", crtSent, crtDrop);
-    logger(DEBUG, msg);
-    /** reset current counter */
-    crtTime = now;
-    crtSent = 0;
-    crtDrop = 0;
-    //printf("\n");
+  *priority = -1;
+  if (group != NULL) {
+    if (group -> ownLimit)
+      bucket = group;
+    *priority = group -> priority;
   }
-		
-  /** compute the history */
-  int valSent = (int)(prvSent * hWeight + crtSent * (1.0 - hWeight));
+  if (names != NULL && names -> priority >= 0)
+    *priority = names -> priority;
+  if (*priority < 0)
+    *priority = getThreadPriority();
+  return bucket;
+}
 
-  doSend = true;
-  /** when we should start dropping messages */
-  int level = this -> maxMsgRate - this -> maxMsgRate / 10;
+bool ApMon::shouldSend(const char *clusterName) {
+  ApMonRateBucket *bucket;
+  int priority;
 
- 
-  if (valSent > (this -> maxMsgRate - level)) {
-    //int max10 = this -> maxMsgRate / 10;
-    int rnd  = rand() % (this -> maxMsgRate / 10);
-    doSend = (rnd <  (this -> maxMsgRate - valSent));
-  }
-  /** counting sent and dropped messages */
-  if (doSend) {
-    crtSent++;
-    //printf("#");
-  } else {
-    crtDrop++;
-    //printf(".");
+  bucket = selectBucket(clusterName, &priority);
+  return takeToken(bucket, priority);
+}
+
+ApMonRateBucket *ApMon::selectBucket(const char *clusterName, 
+				     int *priority) {
+  ApMonRateBucket *bucket = &defaultBucket;
+  int i;
+
+  *priority = -1;
+  if (nRateGroups > 0 && clusterName != NULL && 
+      (i = findRateGroup(clusterName)) >= 0) {
+    if (rateGroups[i].ownLimit)
+      bucket = &rateGroups[i];
+    *priority = rateGroups[i].priority;
   }
-  
-  return doSend;
+  if (*priority < 0)
+    *priority = getThreadPriority();
+  return bucket;
+}
+
+int ApMon::getThreadPriority() {
+  ApMonThreadContext *ctx = getThreadContext();
+
+  return ctx != NULL ? ctx -> priority : PRIORITY_NORMAL;
+}
+
+int ApMon::setThreadPriority(int priority) {
+  ApMonThreadContext *ctx = getThreadContext();
+  int prev;
+
+  if (ctx == NULL)
+    return RET_ERROR;
+  prev = ctx -> priority;
+  ctx -> priority = priority;
+  return prev;
+}
+
+int ApMon::findRateGroup(const char *clusterName) {
+  int i, n = nRateGroups;
+
+  APMON_MEMORY_BARRIER();
+  for (i = 0; i < n; i++)
+    if (strcmp(rateGroups[i].clusterName, clusterName) == 0)
+      return i;
+  return -1;
+}
+
+ApMonRateBucket *ApMon::getRateGroup(ApMonNames *names) {
+  int n = nRateGroups;
+
+  if (n == 0 || names == NULL)
+    return NULL;
+  /* the group is looked up again only when new groups are added */
+  if (names -> rateGroupsSeen != n) {
+    names -> rateGroup = findRateGroup(names -> clusterName);
+    APMON_MEMORY_BARRIER();
+    names -> rateGroupsSeen = n;
+  }
+  if (names -> rateGroup < 0)
+    return NULL;
+  return &rateGroups[names -> rateGroup];
+}
+
+int ApMon::addRateGroup(const char *clusterName) {
+  ApMonRateBucket *bucket;
+  int i;
+
+  // mutex is locked
+  i = findRateGroup(clusterName);
+  if (i >= 0)
+    return i;
+  if (nRateGroups == MAX_RATE_GROUPS) {
+    logger(WARNING, "Too many clusters with their own message rate or priority");
+    return RET_ERROR;
+  }
+  bucket = &rateGroups[nRateGroups];
+  bucket -> clusterName = strdup(clusterName);
+  if (bucket -> clusterName == NULL)
+    return RET_ERROR;
+  bucket -> maxRate = 0;
+  bucket -> burst = 0;
+  bucket -> ownLimit = false;
+  bucket -> priority = -1;
+  bucket -> refillTime = 0;
+  bucket -> nSent = bucket -> nDropped = 0;
+  /* the new group is visible to the senders only after it is complete */
+  APMON_MEMORY_BARRIER();
+  return nRateGroups++;
+}
+
+int ApMon::setClusterMsgRate(char *clusterName, int maxRate, int burst) {
+  int i;
+
+  if (clusterName == NULL)
+    return RET_ERROR;
+
+  pthread_mutex_lock(&mutex);
+  i = addRateGroup(clusterName);
+  if (i >= 0) {
+    if (maxRate > MAX_MSG_RATE_LIMIT)
+      maxRate = MAX_MSG_RATE_LIMIT;
+    rateGroups[i].maxRate = maxRate > 0 ? maxRate : 0;
+    rateGroups[i].burst = burst > 0 ? burst : 0;
+    rateGroups[i].ownLimit = true;
+  }
+  pthread_mutex_unlock(&mutex);
+  return i >= 0 ? RET_SUCCESS : RET_ERROR;
+}
+
+int ApMon::setClusterPriority(char *clusterName, int priority) {
+  int i;
+
+  if (clusterName == NULL || priority < 0 || priority >= N_PRIORITIES)
+    return RET_ERROR;
+
+  pthread_mutex_lock(&mutex);
+  i = addRateGroup(clusterName);
+  if (i >= 0)
+    rateGroups[i].priority = priority;
+  pthread_mutex_unlock(&mutex);
+  return i >= 0 ? RET_SUCCESS : RET_ERROR;
+}
+
+int ApMon::getMsgRateCounters(char *clusterName, long *nSent, 
+			      long *nDropped) {
+  ApMonRateBucket *bucket = &defaultBucket;
+  int i;
+
+  if (clusterName != NULL) {
+    if ((i = findRateGroup(clusterName)) < 0 || !rateGroups[i].ownLimit)
+      return RET_ERROR;
+    bucket = &rateGroups[i];
+  }
+  if (nSent != NULL)
+    *nSent = bucket -> nSent;
+  if (nDropped != NULL)
+    *nDropped = bucket -> nDropped;
+  return RET_SUCCESS;
 }
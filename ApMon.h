@@ -92,6 +92,8 @@
 #include <ctype.h>
 #include <time.h>
 #include "xdr.h"
+#include "xdr_encoder.h"
+#include "counter.h"
 
 #ifdef WIN32
 #include <Winsock2.h>
@@ -100,6 +102,7 @@
 
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <sys/time.h>
@@ -128,6 +131,11 @@
 #include <linux/param.h>
 #endif
 
+/* Linux can pass a vector of datagrams to the kernel with a single call */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define APMON_HAVE_SENDMMSG
+#endif
+
 #endif  // ~WIN32
 
 using namespace std;
@@ -147,10 +155,20 @@ using namespace std;
 #define PROCUTILS_ERROR -2
 #define RET_NOT_SENT -3 /**< A datagram was not sent because the number of
 			   datagrams that can be sent per second is limited. */
+#define RET_TOO_LARGE -4 /**< The parameters don't fit in a single datagram
+			    (they are split among several datagrams). */
 
 #define MAX_N_DESTINATIONS 30  /**< Maximum number of destinations hosts to 
 				  which we send the parameters. */
 
+/** Maximum number of datagrams passed to the kernel with a single system 
+    call (when sendmmsg() is available). */
+#define MAX_SEND_VECTOR 64
+
+/** The size of the buffer in which ApMon::sendRecords() encodes a batch of
+    datagrams. */
+#define BULK_BUFFER_SIZE (8 * MAX_DGRAM_SIZE)
+
 #define DEFAULT_PORT 8884 /**< The default port on which MonALISa listens. */
 #define MAX_HEADER_LENGTH 40  /**< Maximum header length. */
 
@@ -187,6 +205,90 @@ using namespace std;
 
 /** The maxim number of mesages per second that will be sent to MonALISA */
 #define MAX_MSG_RATE 20
+/** The largest message rate which can be set (higher values are reduced 
+    to it, so that a token is worth at least 1 ns). */
+#define MAX_MSG_RATE_LIMIT 1000000000
+/** Maximum number of clusters which can have their own message rate 
+    limit or priority. */
+#define MAX_RATE_GROUPS 16
+
+/** Priority classes of the datagrams; when the maximum message rate is 
+    approached, the datagrams with lower priority are dropped first: */
+#define PRIORITY_CRITICAL 0 /**< e.g., job status changes */
+#define PRIORITY_NORMAL 1 /**< the default for the user's datagrams */
+#define PRIORITY_BULK 2 /**< e.g., the system monitoring datagrams */
+/** The number of priority classes. */
+#define N_PRIORITIES 3
+
+/** Policies for the datagrams sent when the asynchronous send queue is full: */
+#define ASYNC_DROP_NEWEST 0 /**< the new datagram is dropped */
+#define ASYNC_DROP_OLDEST 1 /**< the oldest datagram from the queue is dropped */
+#define ASYNC_BLOCK 2 /**< the caller waits until there is room in the queue */
+/** Default number of datagrams in the asynchronous send queue. */
+#define ASYNC_QUEUE_SIZE 256
+/** Maximum number of datagrams taken from the queue and sent at once. */
+#define ASYNC_SEND_BATCH 16
+
+/** Default time interval (in sec) after which the coalesced parameters 
+    are sent. */
+#define COALESCE_INTERVAL 1
+/** Maximum number of (cluster, node, timestamp) groups for which 
+    parameters are coalesced at the same time. */
+#define MAX_COALESCE_BUFFERS 16
+
+/** Default time interval (in sec) after which the summaries of the values
+    recorded with ApMon::record() are sent. */
+#define AGGREGATE_INTERVAL 60
+/** Maximum number of series recorded by a thread in a time interval. */
+#define MAX_AGGREGATE_SERIES 4096
+/** Maximum number of quantiles sent for the series recorded with 
+    ApMon::recordDistribution(). */
+#define MAX_QUANTILES 8
+
+/** Maximum number of parameter names with a deadband (see 
+    ApMon::setDeadband()). */
+#define MAX_DEADBAND_RULES 64
+/** Maximum number of (cluster, node, parameter) series for which the last
+    value sent is kept. */
+#define MAX_DEADBAND_SERIES 16384
+
+/** Where the datagrams sent are logged (see ApMon::setDatagramLog()): */
+#define DGRAM_LOG_OFF 0 /**< the datagrams are not logged */
+#define DGRAM_LOG_MEMORY 1 /**< the last datagrams are kept in memory */
+#define DGRAM_LOG_FILE 2 /**< the datagrams are also written in a file */
+/** The number of datagrams kept in the datagram log (a power of two). */
+#define DGRAM_LOG_RECORDS 4096
+/** The number of bytes of the datagram log in which the bodies of the 
+    datagrams are copied (a power of two). */
+#define DGRAM_LOG_ARENA_SIZE (1 << 20)
+/** Time interval (in sec) after which the logged datagrams are written in
+    the file. */
+#define DGRAM_LOG_INTERVAL 1
+
+/** Time interval (in sec) after which the statistics of ApMon itself are
+    sent (see ApMon::setSelfStats()). */
+#define SELF_STATS_INTERVAL 60
+/** The cluster name of the datagrams with the statistics of ApMon. */
+#define SELF_STATS_CLUSTER "ApMon_Self"
+/** The data collectors of the background thread for which the running 
+    time is measured (indices in ApMonStats::collectorRuns and 
+    ApMonStats::collectorTime): */
+#define COLLECTOR_SYS_INFO 0 /**< updateSysInfo() */
+#define COLLECTOR_JOB_INFO 1 /**< updateJobInfo() */
+#define COLLECTOR_GEN_INFO 2 /**< updateGeneralInfo() */
+#define N_COLLECTORS 3
+/** Maximum length of a destination address ("ip:port") in ApMonStats. */
+#define MAX_ADDRESS_LEN 32
+
+/** The stages of sending a datagram for which the latency histograms are
+    kept (see ApMon::setLatencyHistograms()): */
+#define LATENCY_LOCK 0 /**< acquiring the object's lock (where it is taken) */
+#define LATENCY_ENCODE 1 /**< encoding the body with encodeParams() */
+#define LATENCY_HEADER 2 /**< building the messages (headers and sequence
+			    numbers) of a batch, without the system calls */
+#define LATENCY_SEND 3 /**< each system call which sends datagrams */
+#define LATENCY_TOTAL 4 /**< a whole sendTimedParameters() call */
+#define N_LATENCY_STAGES 5
 
 #define NLETTERS 26
 
@@ -220,6 +322,407 @@ typedef struct MonitoredJob {
   char nodeName[50];
 } MonitoredJob;
 
+/**
+ * Data structure which holds a destination host, resolved when the 
+ * configuration is loaded (so that the address doesn't have to be parsed
+ * again for each datagram).
+ */
+typedef struct ApMonDestination {
+  /** The address of the destination host, ready to be passed to the kernel. */
+  struct sockaddr_in addr;
+  /** UDP socket connected to the destination host, or -1 if the datagrams 
+   * are sent through the shared (unconnected) socket. */
+#ifndef WIN32
+  int sockfd;
+#else
+  SOCKET sockfd;
+#endif
+  /** The XDR-encoded header for this destination, without the sequence 
+   * number (the ApMon version, the password and the instance ID). */
+  char header[MAX_HEADER_LENGTH + 4];
+  /** The length of the encoded header, or RET_ERROR if it couldn't be 
+   * encoded. */
+  int headerLen;
+  /** The IP address of the destination host, as a string (for logging). */
+  char *address;
+  /** The number of datagrams which could not be sent to the destination 
+   * (incremented atomically). */
+  volatile long nErrors;
+} ApMonDestination;
+
+/**
+ * Snapshot of the destination hosts, used by the threads which send 
+ * datagrams without locking. A table is not modified after it is published;
+ * when the configuration changes, a new table replaces it and the old one
+ * is freed (and its sockets are closed) when the last thread which uses it
+ * releases it.
+ */
+typedef struct ApMonDestTable {
+  /** The number of destination hosts. */
+  int nDestinations;
+  /** The resolved destination hosts. */
+  ApMonDestination *destinations;
+  /** The number of references to the table (the ApMon object and the 
+   * threads which use it). */
+  volatile long refs;
+} ApMonDestTable;
+
+class ApMon;
+
+/**
+ * Token bucket which limits the number of datagrams sent per second for a
+ * group of parameters. The bucket is kept as the time when all the tokens 
+ * taken from it are refilled ("virtual scheduling"), so that a token is 
+ * taken with a single compare-and-swap, without locking. The datagrams 
+ * with lower priority may use only a part of the bucket.
+ */
+typedef struct ApMonRateBucket {
+  /** The cluster name of the group (NULL for the default group). */
+  char *clusterName;
+  /** True if the cluster has its own limit; otherwise, the group only 
+   * holds the priority of the cluster and the datagrams are counted in 
+   * the default bucket. */
+  volatile bool ownLimit;
+  /** The priority class of the datagrams of the cluster (-1 if it was not
+   * set). */
+  volatile int priority;
+  /** The maximum number of datagrams per second; if it is 0, the rate
+   * set with setMaxMsgRate() is used. */
+  volatile int maxRate;
+  /** The maximum number of datagrams which can be sent in a burst; if it
+   * is 0, the maximum rate is used (one second worth of datagrams). */
+  volatile int burst;
+  /** The time (in ns, on the monotonic clock) when all the tokens taken 
+   * from the bucket are refilled. */
+  volatile long long refillTime;
+  /** The number of datagrams sent. */
+  volatile long nSent;
+  /** The number of datagrams dropped because the bucket was empty. */
+  volatile long nDropped;
+} ApMonRateBucket;
+
+/**
+ * A cluster name and a node name, together with their XDR encoding (which
+ * is copied at the beginning of the datagram bodies). The handles returned
+ * by ApMon::registerNames() can be used to send datagrams without copying 
+ * and encoding the names each time.
+ */
+typedef struct ApMonNames {
+  /** The cluster name. */
+  char *clusterName;
+  /** The node name. */
+  char *nodeName;
+  /** The XDR-encoded cluster name and node name. */
+  char *encoded;
+  /** The length of the encoding. */
+  int encodedLen;
+  /** The index of the rate group of the cluster (-1 for the default 
+   * group). */
+  volatile int rateGroup;
+  /** The number of rate groups when rateGroup was looked up. */
+  volatile int rateGroupsSeen;
+  /** The priority class of the datagrams sent with these names (-1 if 
+   * it is given by the cluster or by the thread). */
+  int priority;
+  /** Link in the list of the names registered with an ApMon object. */
+  struct ApMonNames *next;
+} ApMonNames;
+
+/**
+ * A prepared set of parameters (the names and the types), created with
+ * ApMon::prepareParameters(). It holds a datagram body template in which
+ * everything except the values is already encoded.
+ */
+typedef struct ApMonSchema {
+  /** The cluster name and the node name. */
+  ApMonNames *names;
+  /** The number of parameters. */
+  int nParams;
+  /** The names of the parameters. */
+  char **paramNames;
+  /** The value types of the parameters. */
+  int *valueTypes;
+  /** The encoded body template: the names, the number of parameters and,
+   * for each parameter, its name, its type and room for its value (except
+   * for the string values, which don't have a fixed size). */
+  char *tmpl;
+  /** The length of the template. */
+  int tmplLen;
+  /** The offset of the encoded name of each parameter in the template. */
+  int *paramOffsets;
+  /** The offset of the value of each parameter in the template. */
+  int *valueOffsets;
+  /** True if some parameters have string values. */
+  bool hasStrings;
+  /** Link in the list of the schemas prepared by an ApMon object. */
+  struct ApMonSchema *next;
+} ApMonSchema;
+
+/**
+ * A set of parameters with its cluster name, node name and timestamp, sent
+ * with ApMon::sendRecords().
+ */
+typedef struct ApMonRecord {
+  /** The cluster name (if it is NULL, the names of the previous record are
+   * used). */
+  char *clusterName;
+  /** The node name (if it is NULL, the local hostname is used). */
+  char *nodeName;
+  /** The number of parameters. */
+  int nParams;
+  /** The names of the parameters. */
+  char **paramNames;
+  /** The value types of the parameters. */
+  int *valueTypes;
+  /** The values of the parameters. */
+  char **paramValues;
+  /** The timestamp (in seconds), or -1 if the datagram should not contain
+   * a timestamp. */
+  int timestamp;
+} ApMonRecord;
+
+/**
+ * The statistics of ApMon itself, returned by ApMon::getStats(). The
+ * counters are cumulative, since the ApMon object was created; the times
+ * are measured only while the statistics are enabled with 
+ * ApMon::setSelfStats().
+ */
+typedef struct ApMonStats {
+  /** The number of datagrams sent (a datagram sent to several destinations
+   * is counted once for each of them). */
+  long dgramsSent;
+  /** The number of bytes sent (the headers included). */
+  long long bytesSent;
+  /** The number of datagrams dropped because the maximum message rate was
+   * exceeded. */
+  long rateDropped;
+  /** The number of datagrams dropped because the asynchronous send queue
+   * was full. */
+  long queueDropped;
+  /** The number of destinations. */
+  int nDestinations;
+  /** The addresses of the destinations ("ip:port"). */
+  char destAddresses[MAX_N_DESTINATIONS][MAX_ADDRESS_LEN];
+  /** The number of datagrams which could not be sent to each destination
+   * (since the destinations were last loaded). */
+  long sendErrors[MAX_N_DESTINATIONS];
+  /** The number of datagram bodies encoded with encodeParams(). */
+  long dgramsEncoded;
+  /** The time spent encoding them (in ns). */
+  long long encodeTime;
+  /** The number of times a thread which sends parameters had to wait for 
+   * the object's lock (for the names, the prepared sets of parameters and
+   * the coalesced parameters). */
+  long lockWaits;
+  /** The time spent waiting for the lock (in ns). */
+  long long lockWaitTime;
+  /** The number of runs of each data collector of the background thread
+   * (indexed by COLLECTOR_SYS_INFO, COLLECTOR_JOB_INFO, 
+   * COLLECTOR_GEN_INFO). */
+  long collectorRuns[N_COLLECTORS];
+  /** The time spent in each data collector (in ns). */
+  long long collectorTime[N_COLLECTORS];
+} ApMonStats;
+
+/**
+ * The statistics kept by each thread which sends datagrams. Only the 
+ * thread updates them, without atomic operations; they are summed by
+ * ApMon::getStats().
+ */
+typedef struct ApMonThreadStats {
+  /** The number of datagrams sent (for each destination). */
+  long dgramsSent;
+  /** The number of bytes sent. */
+  long long bytesSent;
+  /** The number of datagram bodies encoded with encodeParams(). */
+  long dgramsEncoded;
+  /** The time spent encoding them (in ns). */
+  long long encodeTime;
+  /** The number of times the thread waited for the object's lock. */
+  long lockWaits;
+  /** The time spent waiting for the lock (in ns). */
+  long long lockWaitTime;
+} ApMonThreadStats;
+
+class AggregationTable;
+class DeadbandTable;
+struct DeadbandUpdate;
+class DatagramLog;
+class LatencyHistogram;
+
+/**
+ * Data kept by an ApMon object for each thread which sends datagrams, so
+ * that the threads don't share the encoding buffer, the names from the 
+ * previous datagram and the reference to the destination table.
+ */
+typedef struct ApMonThreadContext {
+  /** Buffer for the XDR encoding of the datagram body. */
+  char buf[MAX_DGRAM_SIZE];
+  /** The names from the previous datagram sent by the thread (NULL if the
+   * thread didn't give any names yet). */
+  ApMonNames *names;
+  /** The destination table used by the thread. */
+  ApMonDestTable *destTable;
+  /** The generation of destTable (compared with the generation of the 
+   * current table before sending). */
+  long destGeneration;
+  /** The priority class of the datagrams sent by the thread, if it is not
+   * set for their names or cluster. */
+  int priority;
+  /** The values recorded by the thread with ApMon::record() (NULL until
+   * the first value is recorded). */
+  AggregationTable *agg;
+  /** Buffer with BULK_BUFFER_SIZE bytes for the datagram bodies encoded by
+   * ApMon::sendRecords() (NULL until the function is first called). */
+  char *bulkBuf;
+  /** Arrays with room for keptCapacity parameters, in which the deadband
+   * filter puts the parameters which must be sent and their updates (NULL
+   * until the deadbands are first used). */
+  char **keptNames;
+  int *keptTypes;
+  char **keptValues;
+  struct DeadbandUpdate *deadbandUpdates;
+  int keptCapacity;
+  /** The statistics of the thread. */
+  ApMonThreadStats stats;
+  /** The latency histograms of the thread, one for each stage (NULL until
+   * the histograms are enabled). */
+  LatencyHistogram *latency;
+  /** The ApMon object which owns the context. */
+  ApMon *apm;
+  /** Links in the list of contexts of the ApMon object. */
+  struct ApMonThreadContext *prev, *next;
+} ApMonThreadContext;
+
+/**
+ * Data structure which holds the parameters coalesced for a (cluster, node,
+ * timestamp) group. The datagram body is built in place: the cluster name,
+ * the node name and a placeholder for the number of parameters are encoded
+ * when the group is created, and the parameters are appended after them.
+ */
+typedef struct CoalesceBuffer {
+  /** The cluster name of the group. */
+  char *clusterName;
+  /** The node name of the group. */
+  char *nodeName;
+  /** The timestamp of the group (-1 if the parameters are not timed). */
+  int timestamp;
+  /** The number of parameters in the buffer. */
+  int nParams;
+  /** The offset of the number of parameters in the buffer (the parameters
+   * start 4 bytes after it). */
+  int countPos;
+  /** The number of bytes used in the buffer. */
+  int len;
+  /** The encoded datagram body. */
+  char data[MAX_DGRAM_SIZE];
+} CoalesceBuffer;
+
+/* Atomic operations on the data shared by threads. */
+#ifndef WIN32
+#define APMON_ATOMIC_ADD(ptr, val) __sync_add_and_fetch(ptr, val)
+#define APMON_ATOMIC_CAS(ptr, oldval, newval) \
+  __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define APMON_ATOMIC_CAS64(ptr, oldval, newval) \
+  __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define APMON_MEMORY_BARRIER() __sync_synchronize()
+#else
+#define APMON_ATOMIC_ADD(ptr, val) \
+  (InterlockedExchangeAdd((LONG volatile *)(ptr), (val)) + (val))
+#define APMON_ATOMIC_CAS(ptr, oldval, newval) \
+  (InterlockedCompareExchange((LONG volatile *)(ptr), (newval), (oldval)) == (oldval))
+#define APMON_ATOMIC_CAS64(ptr, oldval, newval) \
+  (InterlockedCompareExchange64((LONGLONG volatile *)(ptr), (newval), (oldval)) == (oldval))
+#define APMON_MEMORY_BARRIER() MemoryBarrier()
+#endif
+
+class SendQueue;
+struct SendQueueSlot;
+
+#if __cplusplus >= 201103L
+/**
+ * A string value of a parameter sent with ApMon::send(), together with
+ * its length (so that the string is scanned only once).
+ */
+struct ApMonStringValue {
+  /** The string (parameters with NULL values are skipped). */
+  const char *str;
+  /** The length of the string. */
+  int len;
+};
+
+/**
+ * Maps the C++ type of a parameter value to its XDR type and encoding.
+ * Only the types for which there is a specialization can be sent.
+ */
+template <typename T> struct ApMonXdrTraits;
+
+template <> struct ApMonXdrTraits<int> {
+  static const int type = XDR_INT32;
+  static int size(int) { return 4; }
+  static void encode(XdrEncoder& enc, int value) { enc.putInt(value); }
+  static char *valuePtr(const int& value) { return (char *)&value; }
+};
+
+template <> struct ApMonXdrTraits<float> {
+  static const int type = XDR_REAL32;
+  static int size(float) { return 4; }
+  static void encode(XdrEncoder& enc, float value) { enc.putFloat(value); }
+  static char *valuePtr(const float& value) { return (char *)&value; }
+};
+
+template <> struct ApMonXdrTraits<double> {
+  static const int type = XDR_REAL64;
+  static int size(double) { return 8; }
+  static void encode(XdrEncoder& enc, double value) { enc.putDouble(value); }
+  static char *valuePtr(const double& value) { return (char *)&value; }
+};
+
+template <> struct ApMonXdrTraits<ApMonStringValue> {
+  static const int type = XDR_STRING;
+  static int size(const ApMonStringValue& value) {
+    return value.str == NULL ? RET_ERROR : XdrEncoder::stringSize(value.len);
+  }
+  static void encode(XdrEncoder& enc, const ApMonStringValue& value) {
+    enc.putString(value.str, value.len);
+  }
+  static char *valuePtr(const ApMonStringValue& value) {
+    return (char *)value.str;
+  }
+};
+
+/**
+ * A parameter sent with ApMon::send(), created with ApMon::param(). The 
+ * XDR type of the value is determined at compile time, from the C++ type
+ * of the value.
+ */
+template <typename T> struct ApMonParam {
+  /** The name of the parameter. */
+  const char *name;
+  /** The length of the name. */
+  int nameLen;
+  /** The value of the parameter. */
+  T value;
+
+  /** Returns the size of the encoded parameter, or RET_ERROR if the 
+   * parameter must be skipped (NULL name or value). */
+  int size() const {
+    int valueSize = ApMonXdrTraits<T>::size(value);
+
+    if (name == NULL || valueSize < 0)
+      return RET_ERROR;
+    return XdrEncoder::stringSize(nameLen) + 4 + valueSize;
+  }
+
+  /** Encodes the name, the type and the value of the parameter. */
+  void encode(XdrEncoder& enc) const {
+    enc.putString(name, nameLen);
+    enc.putInt(ApMonXdrTraits<T>::type);
+    ApMonXdrTraits<T>::encode(enc, value);
+  }
+};
+#endif
+
 #ifdef WIN32
 #define pthread_mutex_lock(mutex_ref) (WaitForSingleObject(*mutex_ref, INFINITE))
 #define pthread_mutex_unlock(mutex_ref) (ReleaseMutex(*mutex_ref))
@@ -251,8 +754,13 @@ typedef struct MonitoredJob {
  */
 class ApMon {
  protected:
-  char *clusterName; /**< The name of the monitored cluster. */
-  char *nodeName; /**< The name of the monitored node. */ 
+  /** The default cluster name and node name (used by a thread which 
+   * didn't give a cluster name yet). */
+  ApMonNames *defaultNames;
+  /** The names registered with registerNames() (protected by mutex). */
+  ApMonNames *registeredNames;
+  /** The schemas created with prepareParameters() (protected by mutex). */
+  ApMonSchema *preparedSchemas;
 
   /** The cluster name used when sending system monitoring datagrams. */
   char *sysMonCluster; 
@@ -263,9 +771,22 @@ class ApMon {
   char **destAddresses; /**< The IP addresses where the results will be sent.*/
   int *destPorts; /**< The ports where the destination hosts listen. */
   char **destPasswds; /**< Passwords for the MonALISA hosts. */ 
+  /** The current destination table (protected by mutexDest). */
+  ApMonDestTable *destTable;
+  /** Incremented each time a new destination table is published. */
+  volatile long destGeneration;
+  /** The list of the thread contexts (protected by mutexDest). */
+  ApMonThreadContext *threadContexts;
+#ifndef WIN32
+  /** The key for the context of the current thread. */
+  pthread_key_t ctxKey;
+#else
+  DWORD ctxKey;
+#endif
+  /** If this flag is true, a connected UDP socket is used for each 
+   * destination host. */
+  bool connectedSockets;
 
-  char *buf; /**< The buffer which holds the message data (encoded in XDR). */
-  int dgramSize; /**< The size of the data inside the datagram (header not included) */
 #ifndef WIN32
   int sockfd; /**< Socket descriptor */
 #else
@@ -302,8 +823,22 @@ class ApMon {
   /** Used to protect the general ApMon data structures. */
   pthread_mutex_t mutex;
 
+  /** Protects the publication of the destination table and the list of 
+      thread contexts (it is not locked when sending datagrams). If both 
+      mutex and mutexDest are needed, mutex is locked first. */
+  pthread_mutex_t mutexDest;
+
+  /** Thread which sends the datagrams from the asynchronous send queue. */
+  pthread_t asyncThread;
+
   /** Used to protect the variables needed by the background thread. */
   pthread_mutex_t mutexBack;
+
+  /** Protects the deadband table. */
+  pthread_mutex_t mutexDeadband;
+
+  /** Serializes the writing of the datagram log. */
+  pthread_mutex_t mutexDgramLog;
   
   /** Used for the condition variable confChangedCond. */
   pthread_mutex_t mutexCond;
@@ -314,7 +849,10 @@ class ApMon {
  public:
   HANDLE bkThread;
   HANDLE mutex;
+  HANDLE mutexDest;
   HANDLE mutexBack;
+  HANDLE mutexDeadband;
+  HANDLE mutexDgramLog;
   HANDLE mutexCond;
   HANDLE confChangedCond;
  protected:
@@ -416,8 +954,9 @@ class ApMon {
   bool sysInfo_first;
   /** The moment when the last system monitoring datagram was sent. */
   time_t lastSysInfoSend;
- /* The last recorded values for system parameters. */
-  double lastSysVals[MAX_SYS_PARAMS];
+ /* The counters from which the rates of the system parameters are
+    computed (the CPU times, the pages and swap traffic). */
+  RateCounter sysCounters[MAX_SYS_PARAMS];
   /* The current values for the system parameters */
   double currentSysVals[MAX_SYS_PARAMS];
   /* The success/error codes returned by the functions that calculate
@@ -451,13 +990,10 @@ class ApMon {
   char interfaceNames[100][20];
   /** The number of network interfaces. */
   int nInterfaces;
-  /** The total number of bytes sent through each interface, when the
-     previous system monitoring datagram was sent. */
-  double lastBytesSent[20];
-  double lastBytesReceived[20];
- /** The total number of network errors for each interface, when the
-     previous system monitoring datagram was sent. */
-  double lastNetErrs[20];
+  /** The counters with the total number of bytes sent and received 
+     through each interface. */
+  RateCounter netOutCounters[20];
+  RateCounter netInCounters[20];
   /** The current values for the net_in, net_out, net_errs parameters */
   double *currentNetIn, *currentNetOut, *currentNetErrs;
 
@@ -472,20 +1008,147 @@ class ApMon {
 
   /* don't allow a user to send more than MAX_MSG messages per second, in average */
   int maxMsgRate;
-  long prvTime;
-  double prvSent;
-  double prvDrop;
-  long crtTime;
-  long crtSent;
-  long crtDrop;
-  double hWeight;
+  /** The rate limiter for the clusters which don't have their own limit. */
+  ApMonRateBucket defaultBucket;
+  /** The rate limiters for the clusters with their own limit (the entries
+   * are only added, under mutex, and are never removed). */
+  ApMonRateBucket rateGroups[MAX_RATE_GROUPS];
+  /** The number of entries used in rateGroups. */
+  volatile int nRateGroups;
+
+  /** If this flag is true, the datagrams are sent asynchronously, from 
+   * a dedicated thread (asyncSendTask). */
+  bool asyncSend;
+  /** The number of datagrams in the asynchronous send queue. */
+  int asyncQueueSize;
+  /** What to do with the new datagrams when the send queue is full 
+   * (ASYNC_DROP_NEWEST, ASYNC_DROP_OLDEST or ASYNC_BLOCK). */
+  int asyncOverflowPolicy;
+  /** The queue with the datagrams encoded by the sendParameter() functions
+   * in asynchronous mode. */
+  SendQueue *sendQueue;
+  /** True while the sendParameter() functions may add datagrams to the 
+   * send queue. */
+  volatile bool asyncEnabled;
+  /** The number of threads which are adding datagrams to the queue. */
+  volatile long asyncProducers;
+  /** If this flag is true, the sender thread must stop after the queue
+   * is emptied. */
+  volatile bool stopAsyncThread;
+  /** The number of datagrams dropped because the send queue was full. */
+  volatile long asyncDropped;
+
+  /** If this flag is true, the parameters sent with the same cluster name,
+   * node name and timestamp are coalesced in a single datagram (this is 
+   * the requested setting, see also coalesceEnabled). */
+  bool coalesce;
+  /** The time interval (in sec) after which the coalesced parameters are 
+   * sent. */
+  long coalesceInterval;
+  /** Indicates a change in the coalescing settings (for the background
+   * thread). */
+  bool coalesceChanged;
+  /** True while the parameters are coalesced (protected by mutex). */
+  volatile bool coalesceEnabled;
+  /** The number of groups which currently have buffered parameters. */
+  int nCoalesceBufs;
+  /** The buffers for the coalesced groups; the first nCoalesceBufs are in
+   * use, the oldest group first. */
+  CoalesceBuffer *coalesceBufs[MAX_COALESCE_BUFFERS];
+
+  /** If this flag is true, the values recorded with record() are 
+   * aggregated and their summaries are sent periodically (this is the 
+   * requested setting, see also aggregateEnabled). */
+  bool aggregate;
+  /** The time interval (in sec) after which the summaries are sent. */
+  long aggregateInterval;
+  /** Indicates a change in the aggregation settings (for the background
+   * thread). */
+  bool aggregateChanged;
+  /** True while record() accepts values. */
+  volatile bool aggregateEnabled;
+  /** The values recorded by the threads which exited before the summaries
+   * were sent (protected by mutexDest). */
+  AggregationTable *retiredAgg;
+  /** The counters updated with counterAdd() and counterSet() (protected
+   * by mutexDest). */
+  CounterTable *counterTable;
+  /** The moment (on the monotonic clock) when the rates of the counters
+   * were last computed (protected by mutexDest). */
+  long long lastCounterSample;
+  /** The number of quantiles sent for the distributions. */
+  int nQuantiles;
+  /** The quantiles sent for the distributions (between 0 and 1). */
+  double quantiles[MAX_QUANTILES];
+
+  /** The deadband rules and the last values sent (NULL if no rule was
+   * set; protected by mutexDeadband). */
+  DeadbandTable *deadbandTable;
+  /** True while there are deadband rules. */
+  volatile bool deadbandEnabled;
+
+  /** The log of the datagrams sent (NULL if it was never enabled; it is 
+   * not freed until the object is destroyed, because the threads which 
+   * send datagrams use it without locks). */
+  DatagramLog *dgramLog;
+  /** Where the datagrams are logged (DGRAM_LOG_OFF, DGRAM_LOG_MEMORY or
+   * DGRAM_LOG_FILE). */
+  volatile int dgramLogSink;
+  /** The file in which the datagrams are written, for DGRAM_LOG_FILE 
+   * (protected by mutexDgramLog). */
+  FILE *dgramLogFile;
+  /** True if the background thread writes the datagram log in the file
+   * (protected by mutexBack). */
+  bool dgramLogFlush;
+  /** True if dgramLogFlush was changed (protected by mutexBack). */
+  bool dgramLogChanged;
+
+  /** If this flag is true, the statistics of ApMon are sent periodically
+   * (this is the requested setting, see also selfStatsEnabled). */
+  bool selfStats;
+  /** The time interval (in sec) after which the statistics are sent. */
+  long selfStatsInterval;
+  /** Indicates a change in the statistics settings (for the background
+   * thread). */
+  bool selfStatsChanged;
+  /** True while the encoding time and the waiting time for the lock are 
+   * measured. */
+  volatile bool selfStatsEnabled;
+  /** The statistics of the threads which exited (protected by 
+   * mutexDest). */
+  ApMonThreadStats retiredStats;
+  /** The number of runs of each data collector (protected by mutexDest). */
+  long collectorRuns[N_COLLECTORS];
+  /** The time spent in each data collector, in ns (protected by 
+   * mutexDest). */
+  long long collectorTime[N_COLLECTORS];
+
+  /** True while the latency histograms are kept. */
+  volatile bool latencyEnabled;
+  /** The latency histograms of the threads which exited, one for each 
+   * stage (protected by mutexDest). */
+  LatencyHistogram *retiredLatency;
+#ifndef WIN32
+  /** True while the latency histograms are written on SIGUSR1 (protected
+   * by mutexBack). */
+  bool latencyDump;
+  /** The file in which the histograms are written on SIGUSR1 (NULL for 
+   * the standard error; protected by mutexBack). */
+  char *latencyDumpPath;
+  /** The pipe through which the signal handler wakes up the thread which
+   * writes the histograms. */
+  int latencyPipe[2];
+  /** The thread which writes the histograms on SIGUSR1. */
+  pthread_t latencyDumpThread;
+#endif
 
   /** Random number that identifies this instance of ApMon. */
   int instance_id;
   /** Sequence number for the packets that are sent to MonALISA.
       MonALISA v 1.4.10 or newer is able to verify if there were 
-      lost packets. */
-  int seq_nr;
+      lost packets. It is incremented atomically by the threads which
+      send datagrams. */
+  volatile int seq_nr;
 
  private:
   /** Copy constructor */
@@ -532,7 +1195,8 @@ class ApMon {
   /**
    * Sends a parameter and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -551,7 +1215,8 @@ class ApMon {
    * Sends a parameter and its value to the MonALISA module, together with a 
    * timestamp.
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the
    * value was taken.
    * @param paramName The name of the parameter.
@@ -570,7 +1235,8 @@ class ApMon {
   /**
    * Sends an integer parameter and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -585,7 +1251,8 @@ class ApMon {
   /**
    * Sends a parameter of type float and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -600,7 +1267,8 @@ class ApMon {
   /**
    * Sends a parameter of type double and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL,we keep the same cluster and node name as in the previous datagram.
+   * NULL,we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -615,7 +1283,8 @@ class ApMon {
   /**
    * Sends a parameter of type string and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored. If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -631,7 +1300,8 @@ class ApMon {
   /**
    * Sends a parameter of type string and its value to the MonALISA module. 
    * @param clusterName The name of the cluster that is monitored.If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the 
    * value was taken.
    * @param paramName The name of the parameter.
@@ -648,7 +1318,8 @@ class ApMon {
    * Sends a set of parameters and their values to the MonALISA module, 
    * together with a timestamp.
    * @param clusterName The name of the cluster that is monitored.  If it is
-   * NULL, we keep the same cluster and node name as in the previous datagram.
+   * NULL, we keep the same cluster and node name as in the previous datagram
+   * sent by the current thread.
    * @param nodeName The name of the node from the cluster from which the
    * value was taken.
    * @param nParams The number of parameters to be sent.
@@ -664,6 +1335,203 @@ class ApMon {
 	       int nParams, char **paramNames, int *valueTypes, 
 	       char **paramValues, int timestamp);
 
+  /**
+   * Sends a set of parameters and their values to the MonALISA module, 
+   * together with a timestamp. If the parameters don't fit in a single 
+   * datagram, they are split among as few datagrams as possible, which
+   * have the same cluster name, node name and timestamp (a parameter 
+   * that doesn't fit in a datagram by itself is skipped).
+   * @param timestamp The timestamp (in seconds) associated with the data,
+   * or -1 if the datagrams should not contain a timestamp.
+   * @param nDgrams Output parameter (may be NULL), will contain the number
+   * of datagrams that were sent (in coalescing mode, the number of 
+   * datagrams in which the parameters were buffered).
+   * The other parameters are the same as for the function above.
+   * @return RET_SUCCESS (0) on success, RET_NOT_SENT (-3) if some of the 
+   * datagrams were not sent because the maximum number of messages per 
+   * second was exceeded, RET_ERROR (-1) on error.
+   */
+  int sendTimedParameters(char *clusterName, char *nodeName,
+	       int nParams, char **paramNames, int *valueTypes, 
+	       char **paramValues, int timestamp, int *nDgrams);
+
+  /**
+   * Registers a cluster name and a node name which will be used for 
+   * sending datagrams. The names are copied and encoded once, so sending
+   * with the returned handle is cheaper than giving the names each time.
+   * The handle is valid until the ApMon object is destroyed.
+   * @param clusterName The name of the cluster.
+   * @param nodeName The name of the node; if it is NULL, the local hostname
+   * is used.
+   * @param priority The priority class of the datagrams sent with the 
+   * handle (PRIORITY_CRITICAL, PRIORITY_NORMAL or PRIORITY_BULK); if it is
+   * -1, the priority of the cluster is used (see setClusterPriority()).
+   * @return The handle or NULL on error.
+   */
+  ApMonNames *registerNames(char *clusterName, char *nodeName, 
+			    int priority = -1);
+
+  /**
+   * Sends a set of parameters and their values to the MonALISA module, 
+   * with the cluster name and the node name given by a handle obtained
+   * with registerNames(). The other parameters and the return value are 
+   * the same as for the variant with names.
+   */
+  int sendParameters(ApMonNames *names, int nParams, char **paramNames, 
+		     int *valueTypes, char **paramValues);
+
+  /**
+   * Sends a set of parameters and their values to the MonALISA module, 
+   * together with a timestamp, with the cluster name and the node name 
+   * given by a handle obtained with registerNames().
+   */
+  int sendTimedParameters(ApMonNames *names, int nParams, char **paramNames,
+			  int *valueTypes, char **paramValues, int timestamp);
+
+  /**
+   * Same as the function above, but returns in nDgrams the number of 
+   * datagrams that were sent (see the variant with names).
+   */
+  int sendTimedParameters(ApMonNames *names, int nParams, char **paramNames,
+			  int *valueTypes, char **paramValues, int timestamp,
+			  int *nDgrams);
+
+  /**
+   * Sends several sets of parameters, possibly with different cluster and
+   * node names (e.g. the parameters forwarded for many nodes). The 
+   * datagrams are encoded in a batch, the tokens of the rate limit are 
+   * taken for the whole batch and the batch is passed to the kernel with
+   * a single system call (when sendmmsg() is available). The records are
+   * sent in order; the ones which don't fit in a datagram are split, as 
+   * with sendTimedParameters().
+   * @param nRecords The number of records.
+   * @param records The records.
+   * @param results If it is not NULL, it receives the result of each 
+   * record (the values returned by sendParameters()).
+   * @return RET_SUCCESS if all the records were sent, RET_NOT_SENT if 
+   * some of them were dropped because of the rate limit, or RET_ERROR if
+   * some of them could not be sent.
+   */
+  int sendRecords(int nRecords, ApMonRecord *records, int *results);
+
+  /**
+   * Prepares a set of parameters which are sent repeatedly with the same
+   * names and types: the datagram body is encoded once, so that only the
+   * values have to be encoded when the parameters are sent. The schema is 
+   * valid until the ApMon object is destroyed. A set of parameters which
+   * doesn't fit in a datagram (with its values) is accepted: it is sent
+   * without the template, split among several datagrams as with 
+   * sendTimedParameters().
+   * @param names The cluster name and the node name (a handle obtained 
+   * with registerNames()).
+   * @param nParams The number of parameters.
+   * @param paramNames Array with the parameter names.
+   * @param valueTypes Array with the value types (XDR_INT32, XDR_REAL32,
+   * XDR_REAL64 or XDR_STRING).
+   * @return The schema or NULL on error (invalid names or types, or no 
+   * memory).
+   */
+  ApMonSchema *prepareParameters(ApMonNames *names, int nParams, 
+				 char **paramNames, int *valueTypes);
+
+  /**
+   * Sends a set of values for the parameters of a schema created with 
+   * prepareParameters().
+   * @param schema The schema.
+   * @param paramValues Array with the parameter values, in the order of 
+   * the names from the schema.
+   * @return The same values as sendParameters().
+   */
+  int sendPreparedParameters(ApMonSchema *schema, char **paramValues);
+
+  /**
+   * Sends a set of values for the parameters of a schema created with 
+   * prepareParameters(), together with a timestamp.
+   */
+  int sendTimedPreparedParameters(ApMonSchema *schema, char **paramValues,
+				  int timestamp);
+
+#if __cplusplus >= 201103L
+  /**
+   * Creates a parameter for send(). The XDR type is chosen from the type
+   * of the value: XDR_INT32 for int, XDR_REAL32 for float, XDR_REAL64 for
+   * double and XDR_STRING for strings.
+   */
+  static ApMonParam<int> param(const char *name, int value) {
+    return ApMonParam<int>{name, nameLength(name), value};
+  }
+
+  static ApMonParam<float> param(const char *name, float value) {
+    return ApMonParam<float>{name, nameLength(name), value};
+  }
+
+  static ApMonParam<double> param(const char *name, double value) {
+    return ApMonParam<double>{name, nameLength(name), value};
+  }
+
+  static ApMonParam<ApMonStringValue> param(const char *name, 
+					    const char *value) {
+    return ApMonParam<ApMonStringValue>{name, nameLength(name), 
+	{value, value == NULL ? 0 : (int)strlen(value)}};
+  }
+
+  static ApMonParam<ApMonStringValue> param(const char *name, 
+					    const std::string& value) {
+    return ApMonParam<ApMonStringValue>{name, nameLength(name), 
+	{value.c_str(), (int)value.length()}};
+  }
+
+  /**
+   * Sends a set of parameters created with param(), e.g.
+   * send("MyCluster", NULL, ApMon::param("cpu", 1.5), 
+   * ApMon::param("jobs", 42)). When possible, the parameters are encoded 
+   * directly in the datagram, without building the arrays needed by 
+   * sendParameters(). The cluster name, the node name and the return value
+   * are the same as for sendParameters().
+   */
+  template <typename... T>
+  int send(const char *clusterName, const char *nodeName, 
+	   const ApMonParam<T>&... params) {
+    return sendTimed(clusterName, nodeName, -1, params...);
+  }
+
+  /**
+   * Same as the function above, but the parameters are sent together with
+   * a timestamp.
+   */
+  template <typename... T>
+  int sendTimed(const char *clusterName, const char *nodeName, 
+		int timestamp, const ApMonParam<T>&... params) {
+    ApMonThreadContext *ctx;
+    ApMonNames *names = NULL;
+
+    ctx = getThreadContext();
+    if (ctx != NULL)
+      names = resolveNames(ctx, (char *)clusterName, (char *)nodeName);
+    return sendTypedParameters(ctx, names, timestamp, params...);
+  }
+
+  /**
+   * Sends a set of parameters created with param(), with the cluster name
+   * and the node name given by a handle obtained with registerNames().
+   */
+  template <typename... T>
+  int send(ApMonNames *names, const ApMonParam<T>&... params) {
+    return sendTimed(names, -1, params...);
+  }
+
+  /**
+   * Same as the function above, but the parameters are sent together with
+   * a timestamp.
+   */
+  template <typename... T>
+  int sendTimed(ApMonNames *names, int timestamp, 
+		const ApMonParam<T>&... params) {
+    return sendTypedParameters(getThreadContext(), names, timestamp, 
+			       params...);
+  }
+#endif
+
   /**
    * Returns the value of the confCheck flag. If it is true, the 
    * configuration file and/or the URLs are periodically checked for
@@ -833,12 +1701,355 @@ class ApMon {
   */
   static void setLogLevel(char *newLevel_s);
 
+  /** Writes the ApMon log messages in the given file, opened in append 
+   * mode ("stdout" or NULL for the standard output, "stderr" for the 
+   * standard error). Returns RET_SUCCESS or RET_ERROR. */
+  static int setLogFile(char *path);
+
+  /**
+   * Enables or disables the asynchronous logging: the messages are put in
+   * a lock-free ring buffer and written to the output by a background 
+   * thread, so the threads which send parameters don't wait for the 
+   * output and don't serialize on its lock. The messages are dropped if
+   * the buffer is full. The messages with a level higher than the current
+   * logging level are discarded before any formatting, in both modes.
+   * Returns RET_SUCCESS or RET_ERROR (e.g. on Windows).
+   */
+  static int setAsyncLogging(bool enable);
+
   /**
    * This sets the maxim number of messages that are send to MonALISA in one second.
-   * Default, this number is 50.
+   * Default, this number is 50. The datagrams which exceed the rate (after
+   * a burst of at most maxRate datagrams) are dropped. The clusters which
+   * have their own limit (see setClusterMsgRate()) are not counted here.
+   * The values which are not positive are ignored, and the values above 
+   * MAX_MSG_RATE_LIMIT are reduced to it.
    */ 
   void setMaxMsgRate(int maxRate);
 
+  /**
+   * Gives a cluster its own limit for the number of messages sent per 
+   * second, instead of sharing the limit set with setMaxMsgRate() with 
+   * the other clusters.
+   * @param clusterName The name of the cluster.
+   * @param maxRate The maximum number of messages per second (if it is 0,
+   * the value set with setMaxMsgRate() is used, but the cluster still has
+   * its own budget).
+   * @param burst The maximum number of messages sent in a burst (if it is
+   * 0, maxRate is used).
+   * @return RET_SUCCESS or RET_ERROR if there are already MAX_RATE_GROUPS 
+   * clusters with their own limit.
+   */
+  int setClusterMsgRate(char *clusterName, int maxRate, int burst = 0);
+
+  /**
+   * Sets the priority class of the datagrams of a cluster. When the 
+   * maximum message rate is approached, the datagrams with the lowest 
+   * priority are dropped first: PRIORITY_BULK datagrams may use only half
+   * of the burst and PRIORITY_NORMAL datagrams three quarters of it, so 
+   * that there is always room for the PRIORITY_CRITICAL ones. By default,
+   * the user's datagrams have PRIORITY_NORMAL, the job monitoring datagrams
+   * PRIORITY_NORMAL and the system monitoring datagrams PRIORITY_BULK.
+   * @return RET_SUCCESS or RET_ERROR (invalid priority or too many 
+   * clusters with their own limit or priority).
+   */
+  int setClusterPriority(char *clusterName, int priority);
+
+  /**
+   * Returns the number of messages sent and dropped by the rate limiter 
+   * of a cluster.
+   * @param clusterName The name of a cluster with its own limit, or NULL
+   * for the clusters which share the limit set with setMaxMsgRate().
+   * @param nSent Output parameter, the number of messages sent.
+   * @param nDropped Output parameter, the number of messages dropped 
+   * because the maximum rate was exceeded.
+   * @return RET_SUCCESS or RET_ERROR if the cluster doesn't have its own 
+   * limit.
+   */
+  int getMsgRateCounters(char *clusterName, long *nSent, long *nDropped);
+
+  /**
+   * Enables/disables the use of a separate connected UDP socket for each 
+   * destination host. With connected sockets the kernel doesn't have to 
+   * look up the route for each datagram and the errors reported by the 
+   * destination hosts (e.g., ICMP port unreachable) are seen by ApMon, but
+   * a datagram is passed to the kernel with a system call per destination.
+   * By default the datagrams are sent through a single unconnected socket.
+   */
+  void setConnectedSockets(bool connected);
+
+  /** Returns true if a connected UDP socket is used for each destination. */
+  bool getConnectedSockets() { return connectedSockets; }
+
+  /**
+   * Enables/disables the asynchronous sending of the datagrams. In 
+   * asynchronous mode, the sendParameter() functions encode the datagram 
+   * in a bounded queue and return immediately; the datagrams are taken from
+   * the queue and sent in batches by a dedicated thread. When asynchronous
+   * sending is disabled, the datagrams left in the queue are sent first.
+   * Not supported on Windows.
+   * @param async If it is true, the asynchronous mode is enabled.
+   * @param queueSize The maximum number of datagrams in the queue. If it 
+   * is not positive, a default value will be used.
+   * @param overflowPolicy What to do when the queue is full: 
+   * ASYNC_DROP_NEWEST (the new datagram is dropped and the function returns
+   * RET_NOT_SENT), ASYNC_DROP_OLDEST (the oldest datagram from the queue is
+   * dropped) or ASYNC_BLOCK (the caller waits until there is room in the 
+   * queue).
+   */
+  void setAsyncSend(bool async, int queueSize, int overflowPolicy);
+
+  /** Enables/disables the asynchronous sending of the datagrams, with the
+   * default queue size; the new datagrams are dropped if the queue is full.
+   */
+  void setAsyncSend(bool async) {
+    setAsyncSend(async, ASYNC_QUEUE_SIZE, ASYNC_DROP_NEWEST);
+  }
+
+  /** Returns true if the datagrams are sent asynchronously. */
+  bool getAsyncSend() { return asyncEnabled; }
+
+  /** Returns the number of datagrams dropped because the asynchronous
+   * send queue was full. */
+  long getAsyncDropped() { return asyncDropped; }
+
+  /**
+   * Enables/disables the coalescing of the parameters. In coalescing mode,
+   * the parameters sent with the same cluster name, node name and 
+   * timestamp are buffered and packed in a single datagram, which is sent
+   * when it would exceed MAX_DGRAM_SIZE or when the flush interval 
+   * passes (the background thread sends the buffered parameters at each
+   * interval). When coalescing is disabled, the buffered parameters are
+   * sent immediately. 
+   * @param coalesce If it is true, the coalescing is enabled.
+   * @param interval The maximum time (in sec) for which a parameter is 
+   * buffered. If it is not positive, a default value will be used.
+   */
+  void setCoalescing(bool coalesce, long interval);
+
+  /** Enables/disables the coalescing of the parameters, with the default
+   * flush interval. */
+  void setCoalescing(bool coalesce) {
+    setCoalescing(coalesce, COALESCE_INTERVAL);
+  }
+
+  /** Returns true if the parameters are coalesced. */
+  bool getCoalescing() { return coalesceEnabled; }
+
+  /** Sends immediately the parameters buffered in coalescing mode. */
+  void flushParameters();
+
+  /**
+   * Enables/disables the aggregation of the values recorded with record().
+   * The values are accumulated in memory and, at each time interval, the 
+   * background thread sends a summary of each series: the parameters 
+   * <name>_min, <name>_max, <name>_avg, <name>_count and <name>_last,
+   * packed in as few datagrams as possible. When aggregation is disabled,
+   * the summaries of the values recorded so far are sent immediately.
+   * @param aggregate If it is true, the aggregation is enabled.
+   * @param interval The time interval (in sec) covered by a summary. If it
+   * is not positive, a default value will be used.
+   */
+  void setAggregation(bool aggregate, long interval);
+
+  /** Enables/disables the aggregation, with the default time interval. */
+  void setAggregation(bool aggregate) {
+    setAggregation(aggregate, AGGREGATE_INTERVAL);
+  }
+
+  /** Returns true if the values recorded with record() are aggregated. */
+  bool getAggregation() { return aggregateEnabled; }
+
+  /**
+   * Records a value of a parameter, which will be included in the summary
+   * sent at the end of the current time interval (see setAggregation()). 
+   * Each thread accumulates the values in its own table, so the call is 
+   * cheap and doesn't send anything.
+   * @param clusterName The name of the cluster. If it is NULL, the names
+   * from the previous datagram sent by the thread are used.
+   * @param nodeName The name of the node. If it is NULL, the local host 
+   * name is used.
+   * @param paramName The name of the parameter.
+   * @param value The value.
+   * @return RET_SUCCESS, or RET_ERROR if aggregation is not enabled or the
+   * value could not be recorded.
+   */
+  int record(char *clusterName, char *nodeName, char *paramName, 
+	     double value);
+
+  /**
+   * Records a value of a parameter whose distribution is needed. The 
+   * values are counted in a log-linear histogram (HDR style, with a 
+   * relative error of at most 1.6%) and the summary sent at the end of 
+   * the time interval contains the quantiles set with setQuantiles() 
+   * (by default <name>_p50, <name>_p90 and <name>_p99), <name>_max and 
+   * <name>_count. The parameters are the same as for record().
+   */
+  int recordDistribution(char *clusterName, char *nodeName, 
+			 char *paramName, double value);
+
+  /**
+   * Sets the quantiles sent for the values recorded with 
+   * recordDistribution().
+   * @param nQuantiles The number of quantiles (at most MAX_QUANTILES).
+   * @param quantiles The quantiles, between 0 and 1 (e.g. 0.99 is sent as
+   * the parameter <name>_p99).
+   * @return RET_SUCCESS or RET_ERROR if the quantiles are not valid.
+   */
+  int setQuantiles(int nQuantiles, double *quantiles);
+
+  /**
+   * Increments a counter (e.g. the number of requests served). The 
+   * background thread sends the rate of the counter, as the parameter 
+   * <name>_rate (the average increase per second), at the end of each
+   * time interval of the aggregation (see setAggregation()). The rate is
+   * sent for every counter, even if it was not incremented in the 
+   * interval. The parameters are the same as for record().
+   * @param delta The increment.
+   * @return RET_SUCCESS, or RET_ERROR if aggregation is not enabled or the
+   * increment could not be recorded.
+   */
+  int counterAdd(char *clusterName, char *nodeName, char *paramName, 
+		 double delta);
+
+  /**
+   * Sets the value of an absolute counter (e.g. the total number of bytes
+   * read from a device), whose rate is sent like for counterAdd(), 
+   * starting with the second time interval in which the counter is set.
+   * A decrease of the value is taken as the wrap of a 32-bit counter or 
+   * as a reset of the counter to 0 (see RateCounter).
+   */
+  int counterSet(char *clusterName, char *nodeName, char *paramName, 
+		 double value);
+
+  /** Sends immediately the summaries of the values recorded so far. */
+  void flushAggregates();
+
+  /**
+   * Sets a deadband for a parameter: a value of the parameter is sent only
+   * if it differs from the last value sent for the same cluster and node 
+   * by more than the deadband, or if the last value was sent more than
+   * maxSilence seconds ago. The string values are sent only when they
+   * change. The other values are not affected by this setting.
+   * @param paramName The name of the parameter, or "*" for all the 
+   * parameters which don't have their own deadband.
+   * @param deadband The deadband (0 to send only the values which change).
+   * If it is negative, the deadband of the parameter is removed.
+   * @param relative If it is true, the deadband is a percentage of the 
+   * last value sent.
+   * @param maxSilence The maximum time (in sec) for which the values are
+   * suppressed; if it is not positive, the values which don't change are
+   * never sent again.
+   * @return RET_SUCCESS or RET_ERROR if there are too many deadbands.
+   */
+  int setDeadband(char *paramName, double deadband, bool relative, 
+		  long maxSilence);
+
+  /**
+   * Enables or disables the log of the datagrams sent. The threads which
+   * send datagrams only copy the encoded bodies in a ring buffer, with 
+   * their sequence numbers and destinations; the datagrams are decoded to 
+   * text only when they are written. The last DGRAM_LOG_RECORDS datagrams
+   * are kept in memory (if there is room for their bodies) and can be 
+   * written with dumpDatagramLog().
+   * @param sink DGRAM_LOG_OFF, DGRAM_LOG_MEMORY or DGRAM_LOG_FILE (the
+   * datagrams are also written in a file every DGRAM_LOG_INTERVAL seconds,
+   * by the background thread).
+   * @param path The file, for DGRAM_LOG_FILE ("stderr" or NULL for the 
+   * standard error).
+   * @return RET_SUCCESS or RET_ERROR if the file cannot be opened.
+   */
+  int setDatagramLog(int sink, char *path = NULL);
+
+  /**
+   * Writes the datagrams which are in the datagram log.
+   * @param path The file, which is opened in append mode ("stderr" or 
+   * NULL for the standard error).
+   * @return The number of datagrams written or RET_ERROR.
+   */
+  int dumpDatagramLog(char *path = NULL);
+
+  /**
+   * Returns the statistics of ApMon itself: the datagrams sent and 
+   * dropped, the send errors of each destination, the time spent encoding
+   * the datagrams and waiting for the object's lock, and the running time
+   * of the data collectors of the background thread. The counters of the
+   * threads are read while they may be updated, so the values are 
+   * approximate while datagrams are being sent.
+   * @param stats Output parameter, the statistics.
+   * @return RET_SUCCESS.
+   */
+  int getStats(ApMonStats *stats);
+
+  /**
+   * Enables/disables the statistics of ApMon itself. While they are 
+   * enabled, the encoding time and the time spent waiting for the object's
+   * lock are measured (the other counters are always kept), and the 
+   * background thread sends the statistics in a datagram with the cluster
+   * name SELF_STATS_CLUSTER at each time interval.
+   * @param selfStats If it is true, the statistics are enabled.
+   * @param interval The time interval (in sec) after which the statistics
+   * are sent. If it is not positive, a default value will be used.
+   */
+  void setSelfStats(bool selfStats, long interval);
+
+  /** Enables/disables the statistics of ApMon itself, with the default 
+   * time interval. */
+  void setSelfStats(bool selfStats) {
+    setSelfStats(selfStats, SELF_STATS_INTERVAL);
+  }
+
+  /** Returns true if the statistics of ApMon itself are enabled. */
+  bool getSelfStats() { return selfStatsEnabled; }
+
+  /**
+   * Enables/disables the latency histograms for the stages of sending a
+   * datagram (LATENCY_LOCK, LATENCY_ENCODE, LATENCY_HEADER, LATENCY_SEND 
+   * and LATENCY_TOTAL). The durations are measured with 
+   * CLOCK_MONOTONIC_RAW, where it is available, and are counted in 
+   * per-thread histograms (see latency.h), so that the threads which send
+   * datagrams don't share any data. The histograms are kept when they are
+   * disabled and enabled again.
+   */
+  void setLatencyHistograms(bool enable);
+
+  /** Returns true if the latency histograms are kept. */
+  bool getLatencyHistograms() { return latencyEnabled; }
+
+  /**
+   * Returns the latency histogram of a stage, combined from the histograms
+   * of all the threads. The histograms of the threads are read while they
+   * may be updated, so the result is approximate while datagrams are 
+   * being sent.
+   * @param stage The stage (LATENCY_LOCK, LATENCY_ENCODE etc.).
+   * @param hist Output parameter, the histogram.
+   * @return RET_SUCCESS or RET_ERROR if the stage is not valid.
+   */
+  int getLatencyHistogram(int stage, LatencyHistogram *hist);
+
+  /**
+   * Writes a summary of each latency histogram (the number of durations, 
+   * the average, some quantiles and the maximum).
+   * @param path The file, which is opened in append mode ("stderr" or 
+   * NULL for the standard error).
+   * @return RET_SUCCESS or RET_ERROR.
+   */
+  int dumpLatencyHistograms(char *path = NULL);
+
+  /**
+   * Enables/disables the writing of the latency histograms when the 
+   * process receives SIGUSR1. The signal handler only wakes up a thread,
+   * which calls dumpLatencyHistograms(); the handler is installed for a 
+   * single ApMon object at a time and the previous handler is restored 
+   * when the dump is disabled. Not supported on Windows.
+   * @param enable If it is true, the histograms are written on SIGUSR1.
+   * @param path The file in which the histograms are written ("stderr" or
+   * NULL for the standard error).
+   * @return RET_SUCCESS or RET_ERROR if the signal handler could not be 
+   * installed.
+   */
+  int setLatencyDumpSignal(bool enable, char *path = NULL);
+
   /**
    * Displays an error message and exits with -1 as return value.
    * @param msg The message to be displayed.
@@ -941,11 +2152,383 @@ class ApMon {
 
  
   /**
-   * Encodes in the XDR format the data from a ApMon structure. Must be 
-   * called before sending the data over the newtork.
+   * Encodes in the XDR format the body of a datagram. Must be called 
+   * before sending the data over the newtork. It doesn't use any data 
+   * shared by the threads, so it can be called without locking.
+   * @param outBuf The buffer where the datagram body is encoded (with room
+   * for MAX_DGRAM_SIZE bytes).
+   * @param names The cluster name and the node name for the datagram 
+   * (their encoding is copied in the buffer).
+   * @return The length of the encoded body, RET_TOO_LARGE if the 
+   * parameters don't fit in a datagram (the buffer is then left partially
+   * encoded) or RET_ERROR.
    */ 
-  void encodeParams(int nParams, char **paramNames, int *valueTypes, 
-		 char **paramValues, int timestamp);
+  int encodeParams(char *outBuf, ApMonNames *names, int nParams, 
+		   char **paramNames, int *valueTypes, char **paramValues, 
+		   int timestamp);
+
+  /** Encodes the body of a datagram, like encodeParams(), without 
+   * measuring the encoding time. */
+  int encodeParamsBody(char *outBuf, ApMonNames *names, int nParams,
+		       char **paramNames, int *valueTypes, 
+		       char **paramValues, int timestamp);
+
+  /** Locks the mutex on the paths which send parameters; while the 
+   * statistics are enabled, the time spent waiting for it is measured. */
+  void lockSendMutex();
+
+  /** Adds the running time of a data collector (which started at the 
+   * given moment, on the monotonic clock) to the statistics. */
+  void addCollectorTime(int collector, long long start);
+
+  /** Sends a datagram with the statistics of ApMon itself. */
+  void sendSelfStats();
+
+  /** Returns the latency histograms of a thread, which are created if 
+   * needed (NULL if they could not be created). */
+  LatencyHistogram *getThreadLatency(ApMonThreadContext *ctx);
+
+  /** Records a duration in a latency histogram of the current thread. */
+  void recordLatency(ApMonThreadContext *ctx, int stage, long long duration);
+
+  /** Returns the moment when the encoding of a datagram starts, if it 
+   * must be measured for the statistics or the latency histograms, or 0
+   * otherwise. */
+  long long startEncodeTiming();
+
+  /** Counts the encoding of a datagram which started at the moment 
+   * returned by startEncodeTiming() in the statistics and the latency
+   * histograms of the thread. */
+  void recordEncoding(ApMonThreadContext *ctx, long long start);
+
+  /**
+   * Sends a datagram body encoded directly in ctx -> buf by the typed 
+   * send() functions, recording the encoding time and the whole time of
+   * the call as encodeParams() and sendTimedParameters() do.
+   * @param start The moment returned by startEncodeTiming() before the 
+   * encoding.
+   */
+  int sendTypedEncoded(ApMonThreadContext *ctx, ApMonNames *names, int len,
+		       int nParams, long long start);
+
+  /**
+   * Creates an ApMonNames structure with copies of the names and their
+   * XDR encoding.
+   * @return The structure (malloc'ed) or NULL on error.
+   */
+  ApMonNames *createNames(char *clusterName, char *nodeName);
+
+  /** Frees an ApMonNames structure created with createNames(). */
+  static void freeNames(ApMonNames *names);
+
+  /** Frees a schema created with prepareParameters(). */
+  static void freeSchema(ApMonSchema *schema);
+
+  /**
+   * Returns the size of the datagram body for a set of values of a schema
+   * (without the header).
+   * @return The size or RET_ERROR if there are no parameters to send.
+   */
+  int preparedSize(ApMonSchema *schema, char **paramValues, int timestamp);
+
+  /**
+   * Builds a datagram body from the template of a schema and a set of
+   * values. The caller must check with preparedSize() that the body fits
+   * in a datagram.
+   * @return The length of the body or RET_ERROR.
+   */
+  int encodePrepared(char *outBuf, ApMonSchema *schema, char **paramValues,
+		     int timestamp);
+
+  /**
+   * Sends an encoded datagram body from the buffer of the current thread
+   * to all the destinations, if the rate limit allows it. The parameters
+   * are only used for logging (paramNames may be NULL).
+   * @return RET_SUCCESS, RET_NOT_SENT or RET_ERROR.
+   */
+  int sendEncodedParams(ApMonThreadContext *ctx, ApMonNames *names, int len,
+			int nParams, char **paramNames, int *valueTypes, 
+			char **paramValues);
+
+  /**
+   * Returns true if a datagram body with the given size can be encoded 
+   * directly in the buffer of the current thread by send() (the 
+   * parameters are not coalesced or sent asynchronously, they fit in a 
+   * datagram and they don't have to be logged).
+   */
+  bool canEncodeDirectly(int size);
+
+#if __cplusplus >= 201103L
+  /** Returns the length of a parameter name (0 for NULL). */
+  static int nameLength(const char *name) {
+    return name == NULL ? 0 : (int)strlen(name);
+  }
+
+  /** Returns the size of a list of encoded parameters, or RET_ERROR if
+   * some of them must be skipped. */
+  static int paramsSize() { return 0; }
+
+  template <typename T, typename... P>
+  static int paramsSize(const ApMonParam<T>& first, const P&... rest) {
+    int size = first.size(), restSize = paramsSize(rest...);
+
+    if (size < 0 || restSize < 0)
+      return RET_ERROR;
+    return size + restSize;
+  }
+
+  /** Encodes a list of parameters. */
+  static void encodeParamList(XdrEncoder&) {}
+
+  template <typename T, typename... P>
+  static void encodeParamList(XdrEncoder& enc, const ApMonParam<T>& first, 
+			      const P&... rest) {
+    first.encode(enc);
+    encodeParamList(enc, rest...);
+  }
+
+  /**
+   * Sends a set of parameters created with param(). If possible, the 
+   * parameters are encoded directly in the buffer of the thread; 
+   * otherwise they are passed to sendTimedParameters(), which handles
+   * the skipped parameters, the coalescing, the asynchronous sending and
+   * the splitting among several datagrams.
+   */
+  template <typename... T>
+  int sendTypedParameters(ApMonThreadContext *ctx, ApMonNames *names, 
+			  int timestamp, const ApMonParam<T>&... params) {
+    static_assert(sizeof...(T) > 0, "at least one parameter must be sent");
+    int size;
+
+    if (ctx == NULL || names == NULL)
+      return RET_ERROR;
+
+    size = paramsSize(params...);
+    if (size >= 0) {
+      size += names -> encodedLen + 4 + (timestamp > 0 ? 4 : 0);
+      if (canEncodeDirectly(size)) {
+	long long start = startEncodeTiming();
+	XdrEncoder enc(ctx -> buf, MAX_DGRAM_SIZE);
+	enc.putBytes(names -> encoded, names -> encodedLen);
+	enc.putInt((int)sizeof...(T));
+	encodeParamList(enc, params...);
+	if (timestamp > 0)
+	  enc.putInt(timestamp);
+	return sendTypedEncoded(ctx, names, enc.length(), (int)sizeof...(T),
+				start);
+      }
+    }
+
+    char *paramNames[] = { (char *)params.name... };
+    int valueTypes[] = { ApMonXdrTraits<T>::type... };
+    char *paramValues[] = { ApMonXdrTraits<T>::valuePtr(params.value)... };
+    return sendTimedParameters(names, (int)sizeof...(T), paramNames, 
+			       valueTypes, paramValues, timestamp, NULL);
+  }
+#endif
+
+  /**
+   * Sends a set of parameters in a single datagram (or adds them to the
+   * asynchronous send queue or to a coalescing buffer).
+   * @return RET_SUCCESS, RET_NOT_SENT, RET_TOO_LARGE if the parameters 
+   * don't fit in a datagram, or RET_ERROR.
+   */
+  int sendParamsDatagram(ApMonNames *names, int nParams, 
+			 char **paramNames, int *valueTypes, 
+			 char **paramValues, int timestamp);
+
+  /**
+   * Splits a set of parameters which doesn't fit in a datagram among as
+   * few datagrams as possible (with a first-fit decreasing packing of the
+   * parameters by their encoded size) and sends the datagrams.
+   * @param nDgrams Output parameter (may be NULL), will contain the number
+   * of datagrams sent.
+   * @return RET_SUCCESS, RET_NOT_SENT if some datagrams were not sent 
+   * because of the rate limit, or RET_ERROR.
+   */
+  int sendSplitParameters(ApMonNames *crtNames, int nParams, 
+			  char **paramNames, int *valueTypes, 
+			  char **paramValues, int timestamp, int *nDgrams);
+
+  /**
+   * Determines the cluster name and the node name for the next datagram 
+   * of the current thread. If clusterName is NULL, the names from the 
+   * previous datagram of the thread are kept (or the default names are 
+   * used if the thread didn't give any names yet). If nodeName is NULL, 
+   * the local hostname is used. The names of the thread are copied and 
+   * encoded again only when they change.
+   * @param ctx The context of the current thread.
+   * @return The names to use or NULL on error.
+   */
+  ApMonNames *resolveNames(ApMonThreadContext *ctx, char *clusterName, 
+			   char *nodeName);
+
+  /**
+   * Returns the context of the current thread, which is created when the
+   * thread sends its first datagram.
+   * @return The context or NULL if it cannot be allocated.
+   */
+  ApMonThreadContext *getThreadContext();
+
+  /**
+   * Returns the destination table that the current thread must use. The
+   * thread keeps a reference to the table until a new table is published
+   * (the only shared data read here is destGeneration).
+   */
+  ApMonDestTable *getDestTable(ApMonThreadContext *ctx);
+
+  /** Replaces the current destination table with a new one. */
+  void publishDestTable(ApMonDestTable *table);
+
+  /** Drops a reference to a destination table; the table is freed when 
+   * there are no references left. */
+  void releaseDestTable(ApMonDestTable *table);
+
+  /** Frees a thread context which was removed from the list. */
+  void freeThreadContext(ApMonThreadContext *ctx);
+
+  /** Called when a thread which has a context exits. */
+  static void threadContextDestructor(void *param);
+
+  /**
+   * Encodes the parameters in a slot of the asynchronous send queue, from
+   * where they will be sent by the sender thread.
+   * @return RET_SUCCESS, RET_NOT_SENT if the datagram was dropped or 
+   * RET_ERROR.
+   */
+  int enqueueParameters(ApMonNames *names, int nParams, 
+			char **paramNames, int *valueTypes, 
+			char **paramValues, int timestamp);
+
+  /**
+   * Builds a datagram from a schema in a slot of the asynchronous send 
+   * queue.
+   * @return RET_SUCCESS, RET_NOT_SENT if the datagram was dropped or 
+   * RET_ERROR.
+   */
+  int enqueuePrepared(ApMonSchema *schema, char **paramValues, 
+		      int timestamp);
+
+  /**
+   * Takes a free slot from the asynchronous send queue, applying the 
+   * overflow policy if the queue is full.
+   * @return The slot or NULL if the datagram must be dropped.
+   */
+  SendQueueSlot *claimSendSlot();
+
+  /**
+   * Adds the parameters to the coalescing buffer of their (cluster, node,
+   * timestamp) group. The buffer is sent first if the parameters don't 
+   * fit in it.
+   * @return RET_SUCCESS or RET_ERROR.
+   */
+  int coalesceParameters(ApMonNames *names, int nParams, 
+			 char **paramNames, int *valueTypes, 
+			 char **paramValues, int timestamp);
+
+  /**
+   * Completes the datagrams from a set of coalescing buffers, sends them 
+   * (or adds them to the asynchronous send queue) and empties the buffers.
+   * Must be called with mutex locked.
+   */
+  void sendCoalesceBuffers(int nBufs, CoalesceBuffer **bufs);
+
+  /**
+   * Sends the summaries of the series from a table, grouping the series
+   * with the same cluster name and node name in the same datagrams.
+   */
+  void sendAggregates(AggregationTable *table);
+
+  /** Records a value in the table of the thread, for a series of the 
+   * given kind (AGG_VALUES, AGG_DISTRIBUTION etc.). */
+  int recordValue(char *clusterName, char *nodeName, char *paramName, 
+		  double value, int kind);
+
+  /** Updates the counters with the increments and the values from a 
+   * table, then adds to the table the rates of all the counters 
+   * (mutexDest is locked). */
+  void sampleCounters(AggregationTable *table);
+
+  /** Writes the datagrams from the log, in a file (mutexDgramLog is 
+   * locked).
+   * @param all If it is false, only the datagrams logged since the 
+   * previous call are written. */
+  int writeDatagramLog(FILE *f, bool all);
+
+  /** Writes in the file of the datagram log the datagrams logged since
+   * the last time. */
+  void flushDatagramLog();
+
+  /**
+   * Copies to the "kept" arrays of the thread context the parameters 
+   * which must be sent according to the deadbands, with their updates in
+   * ctx -> deadbandUpdates (which are committed with commitDeadband() 
+   * after the datagrams are sent).
+   * @return The number of parameters kept, or RET_ERROR if the arrays 
+   * cannot be allocated (in which case all the parameters must be sent).
+   */
+  int filterDeadband(ApMonThreadContext *ctx, ApMonNames *names, 
+		     int nParams, char **paramNames, int *valueTypes, 
+		     char **paramValues);
+
+  /** Records the values kept by the last filterDeadband() call of the 
+   * thread as the last values sent. */
+  void commitDeadband(ApMonThreadContext *ctx, int nKept);
+
+  /** Creates the send queue and starts the sender thread (mutexBack is
+   * locked). */
+  void startAsyncSend();
+
+  /** Waits for the datagrams from the send queue to be sent, then stops 
+   * the sender thread and frees the queue (mutexBack is locked). */
+  void stopAsyncSend();
+
+  /**
+   * Sends a datagram made of a header and a body to a destination host.
+   * The two parts are not concatenated in user space: on POSIX systems 
+   * they are passed to the kernel as a scatter-gather list with sendmsg(),
+   * so the body can be encoded once and shared by all the destinations.
+   * @param destAddr The address of the destination host.
+   * @param header The encoded header (which is specific to the destination).
+   * @param headerLen The length of the header, in bytes.
+   * @param body The encoded body of the datagram.
+   * @param bodyLen The length of the body, in bytes.
+   * @return The number of bytes sent or RET_ERROR.
+   */
+  int sendDatagram(struct sockaddr_in *destAddr, char *header, int headerLen,
+		   char *body, int bodyLen);
+
+  /**
+   * Encodes the part of the datagram header which doesn't change from a
+   * datagram to another: the ApMon version, the password for the 
+   * destination and the instance ID. The sequence number follows it.
+   * @param passwd The password for the destination.
+   * @param hbuf Output buffer, with room for MAX_HEADER_LENGTH + 4 bytes.
+   * @return The length of the encoded header or RET_ERROR.
+   */
+  int encodeHeader(char *passwd, char *hbuf);
+
+  /**
+   * Sends a set of encoded datagram bodies to all the destinations. Each
+   * datagram is made of the cached header of the destination, a sequence
+   * number (consecutive for the datagrams) and the body. Where available,
+   * all the (datagram, destination) pairs are passed to the kernel with a
+   * single sendmmsg() call (or with a call for every MAX_SEND_VECTOR
+   * pairs). The function doesn't lock anything: the sequence numbers are
+   * reserved atomically.
+   * @param table The destination table.
+   * @param nDgrams The number of datagrams.
+   * @param bodies The encoded bodies of the datagrams.
+   * @param bodyLens The lengths of the bodies.
+   * @param results Output array with nDgrams * nDestinations elements; 
+   * results[i * nDestinations + j] will hold the number of bytes sent 
+   * for datagram i to destination j, or RET_ERROR.
+   * @param firstSeq Output parameter (may be NULL), will contain the 
+   * sequence number of the first datagram.
+   * @return RET_SUCCESS if all the datagrams were sent, RET_ERROR otherwise.
+   */
+  int sendDatagrams(ApMonDestTable *table, int nDgrams, char **bodies, 
+		    int *bodyLens, int *results, int *firstSeq);
 
   /** Initializes the monitoring configurations and the names of the parameters
    * included in the monitoring datagrams.
@@ -1011,6 +2594,8 @@ class ApMon {
    */
 #ifndef WIN32
   friend void *bkTask(void *param);
+  friend void *asyncSendTask(void *param);
+  friend void *latencyDumpTask(void *param);
 #else
   friend DWORD WINAPI bkTask(void *param);
 #endif
@@ -1023,6 +2608,25 @@ class ApMon {
   /** Initializes the UDP socket used to send the datagrams. */
   void initSocket();
 
+  /**
+   * Resolves the destination addresses into a destination table and 
+   * encodes the headers for the destinations. If connectedSockets is true,
+   * a connected socket is opened for each destination. The destinations
+   * with invalid addresses are logged and left out of the table.
+   * @return The table (malloc'ed, with one reference) or NULL if it cannot
+   * be allocated.
+   */
+  ApMonDestTable *resolveDestinations(int nDest, char **addresses, 
+				      int *ports, char **passwds);
+
+  /** Opens a UDP socket connected to each destination from the table. If
+   * a socket cannot be opened, the datagrams for that destination will be
+   * sent through the shared socket. */
+  void openDestSockets(ApMonDestination *dests, int nDest);
+
+  /** Closes the connected sockets from a destination table. */
+  void closeDestSockets(ApMonDestination *dests, int nDest);
+
   /** Parses the contents of a configuration file. The destination addresses
       and ports are stored in the arrays given as parameters.
   */
@@ -1031,10 +2635,73 @@ class ApMon {
 
   /**
    * Decides if the current datagram should be sent (so that the maximum
-   * number of datagrams per second is respected in average).
-   * This decision is based on the number of messages previously sent.
+   * number of datagrams per second is respected), by taking a token from
+   * the bucket of its rate group. It doesn't need locking.
    */ 
-  bool shouldSend();
+  bool shouldSend(ApMonNames *names);
+
+  /** Same as the function above, for a datagram of the given cluster. */
+  bool shouldSend(const char *clusterName);
+
+  /** Takes a token from a bucket, for a datagram with the given priority
+   * class. Returns false if the datagram must be dropped. */
+  bool takeToken(ApMonRateBucket *bucket, int priority) {
+    return takeTokens(bucket, priority, 1) == 1;
+  }
+
+  /** Takes tokens from a bucket for n datagrams with the given priority 
+   * class, and returns the number of datagrams which can be sent (the 
+   * others must be dropped). */
+  int takeTokens(ApMonRateBucket *bucket, int priority, int n);
+
+  /** Gives back to a bucket the tokens taken for n datagrams which were 
+   * not sent after all (e.g. because the send queue was full). */
+  void returnTokens(ApMonRateBucket *bucket, int n);
+
+  /** Returns the maximum number of datagrams per second for a bucket 
+   * (at most MAX_MSG_RATE_LIMIT), or 0 if the rate is not limited. */
+  int bucketRate(ApMonRateBucket *bucket);
+
+  /** Returns the bucket from which the tokens are taken for a datagram 
+   * with the given names, and its priority class. */
+  ApMonRateBucket *selectBucket(ApMonNames *names, int *priority);
+
+  /** Same as the function above, for a datagram of the given cluster. */
+  ApMonRateBucket *selectBucket(const char *clusterName, int *priority);
+
+  /**
+   * Sends a batch of datagram bodies encoded by sendRecords(), after 
+   * taking the tokens for them.
+   * @param recordOf The index in records of the record of each datagram.
+   * @param buckets The bucket of each datagram.
+   * @param priorities The priority class of each datagram.
+   * @param results The results of the records, which are updated.
+   */
+  void sendRecordBatch(ApMonThreadContext *ctx, int nDgrams, char **bodies,
+		       int *bodyLens, int *recordOf, 
+		       ApMonRateBucket **buckets, int *priorities,
+		       ApMonRecord *records, int *results);
+
+  /** Returns the priority class of the datagrams sent by the current 
+   * thread (when it is not set for their names or cluster). */
+  int getThreadPriority();
+
+  /** Sets the priority class of the datagrams sent by the current thread
+   * (e.g., for the system monitoring datagrams) and returns the previous
+   * one. */
+  int setThreadPriority(int priority);
+
+  /** Returns the rate group for the datagrams with the given names, or 
+   * NULL if the cluster doesn't have its own limit or priority. */
+  ApMonRateBucket *getRateGroup(ApMonNames *names);
+
+  /** Returns the index of the rate group of a cluster, or -1 if the 
+   * cluster doesn't have its own limit or priority. */
+  int findRateGroup(const char *clusterName);
+
+  /** Returns the index of the rate group of a cluster, which is created 
+   * if it doesn't exist (must be called with mutex locked). */
+  int addRateGroup(const char *clusterName);
 
   friend class ProcUtils;
 };
@@ -1049,6 +2716,14 @@ void *bkTask(void *param); // throw(runtime_error);
 #else
 DWORD WINAPI bkTask(void *param);
 #endif
+
+#ifndef WIN32
+ /**
+  * Takes the datagrams from the asynchronous send queue and sends them 
+  * to the destinations, in batches (this is done in a separate thread).
+  */
+void *asyncSendTask(void *param);
+#endif
 #endif
 
 
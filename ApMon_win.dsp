@@ -91,6 +91,30 @@ SOURCE=.\ApMon.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\aggregator.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\deadband.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\counter.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\dgram_log.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\latency.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\dgram_decoder.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\examples\example_2.cpp
 # End Source File
 # Begin Source File
@@ -123,6 +147,34 @@ SOURCE=.\ApMon.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\aggregator.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\deadband.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\counter.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\dgram_log.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\latency.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\dgram_decoder.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\series_table.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\mon_constants.h
 # End Source File
 # Begin Source File
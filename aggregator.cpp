@@ -0,0 +1,247 @@
+/**
+ * \file aggregator.cpp
+ * This file contains the implementation of the AggregationTable class.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "aggregator.h"
+#include "utils.h"
+#include <math.h>
+
+#ifndef WIN32
+#include <sched.h>
+#endif
+
+/** The histogram bucket of a value. The bucket is obtained from the bits
+ * of the IEEE 754 representation: the exponent selects the power of two
+ * and the first AGG_SUB_BITS bits of the mantissa the bucket within it. */
+static int bucketOf(double value) {
+  unsigned long long bits;
+  int e;
+
+  if (!(value > 0))
+    return 0;
+  memcpy(&bits, &value, sizeof(bits));
+  /* value = 1.m * 2^e */
+  e = (int)((bits >> 52) & 0x7FF) - 1023;
+  if (e < AGG_MIN_EXP)
+    return 1;
+  if (e > AGG_MAX_EXP)
+    return AGG_HISTOGRAM_BUCKETS - 1;
+  return 1 + ((e - AGG_MIN_EXP) << AGG_SUB_BITS) + 
+    (int)((bits >> (52 - AGG_SUB_BITS)) & ((1 << AGG_SUB_BITS) - 1));
+}
+
+/** The value in the middle of a histogram bucket. */
+static double bucketValue(int bucket) {
+  int e, sub;
+
+  if (bucket == 0)
+    return 0;
+  e = ((bucket - 1) >> AGG_SUB_BITS) + AGG_MIN_EXP;
+  sub = (bucket - 1) & ((1 << AGG_SUB_BITS) - 1);
+  return ldexp(1 + (sub + 0.5) / (1 << AGG_SUB_BITS), e);
+}
+
+AggregationTable::AggregationTable(int maxSeries) : table(maxSeries) {
+  lockWord = 0;
+}
+
+AggregationTable::~AggregationTable() {
+  unsigned long i;
+  AggSeries *s;
+
+  for (i = 0; i < table.getCapacity(); i++) {
+    if ((s = table.getSlot(i)) != NULL)
+      free(s -> buckets);
+  }
+}
+
+void AggregationTable::lock() {
+  while (!APMON_ATOMIC_CAS(&lockWord, 0, 1)) {
+#ifndef WIN32
+    sched_yield();
+#else
+    SwitchToThread();
+#endif
+  }
+}
+
+void AggregationTable::unlock() {
+  APMON_MEMORY_BARRIER();
+  lockWord = 0;
+}
+
+AggSeries *AggregationTable::lookup(const char *clusterName, 
+				    const char *nodeName, 
+				    const char *paramName) {
+  AggSeries *s;
+  bool created;
+
+  s = table.lookup(clusterName, nodeName, paramName, &created);
+  if (created) {
+    s -> kind = AGG_VALUES;
+    s -> count = 0;
+    s -> lastTime = 0;
+    s -> buckets = NULL;
+  }
+  return s;
+}
+
+int AggregationTable::record(const char *clusterName, const char *nodeName,
+			     const char *paramName, double value, 
+			     long long time, int kind) {
+  AggSeries *s;
+
+  lock();
+  s = lookup(clusterName, nodeName, paramName);
+  if (s == NULL) {
+    unlock();
+    return RET_ERROR;
+  }
+  if (kind == AGG_DISTRIBUTION) {
+    if (s -> buckets == NULL) {
+      s -> buckets = (unsigned int *)calloc(AGG_HISTOGRAM_BUCKETS, 
+					    sizeof(unsigned int));
+      if (s -> buckets == NULL) {
+	unlock();
+	return RET_ERROR;
+      }
+    }
+    s -> buckets[bucketOf(value)]++;
+  }
+  if (s -> count == 0) {
+    s -> min = s -> max = s -> sum = value;
+  } else {
+    if (value < s -> min)
+      s -> min = value;
+    if (value > s -> max)
+      s -> max = value;
+    s -> sum += value;
+  }
+  s -> count++;
+  s -> kind = kind;
+  s -> last = value;
+  s -> lastTime = time;
+  unlock();
+  return RET_SUCCESS;
+}
+
+void AggregationTable::merge(AggSeries *s, AggSeries *other) {
+  if (s -> count == 0) {
+    s -> min = other -> min;
+    s -> max = other -> max;
+    s -> sum = other -> sum;
+  } else {
+    if (other -> min < s -> min)
+      s -> min = other -> min;
+    if (other -> max > s -> max)
+      s -> max = other -> max;
+    s -> sum += other -> sum;
+  }
+  s -> count += other -> count;
+  if (other -> lastTime >= s -> lastTime) {
+    s -> kind = other -> kind;
+    s -> last = other -> last;
+    s -> lastTime = other -> lastTime;
+  }
+}
+
+void AggregationTable::drainTo(AggregationTable *dest) {
+  unsigned long i, nIdle = 0;
+  int b;
+  AggSeries *s, *d;
+
+  lock();
+  for (i = 0; i < table.getCapacity(); i++) {
+    if ((s = table.getSlot(i)) == NULL)
+      continue;
+    if (s -> count == 0) {
+      nIdle++;
+      continue;
+    }
+    d = dest -> lookup(s -> clusterName, s -> nodeName, s -> paramName);
+    if (d != NULL && s -> buckets != NULL && d -> buckets == NULL)
+      d -> buckets = (unsigned int *)calloc(AGG_HISTOGRAM_BUCKETS, 
+					    sizeof(unsigned int));
+    if (d != NULL) {
+      merge(d, s);
+      if (s -> buckets != NULL && d -> buckets != NULL) {
+	for (b = 0; b < AGG_HISTOGRAM_BUCKETS; b++)
+	  d -> buckets[b] += s -> buckets[b];
+      }
+    }
+    if (s -> buckets != NULL)
+      memset(s -> buckets, 0, AGG_HISTOGRAM_BUCKETS * sizeof(unsigned int));
+    s -> count = 0;
+  }
+  /* free the idle series; if the arrays cannot be allocated, the series 
+     are kept until the next call */
+  if (nIdle > 0)
+    table.rehash(table.getCapacity(), dropIdle);
+  unlock();
+}
+
+int AggregationTable::getSeries(AggSeries **list) {
+  unsigned long i;
+  int n = 0;
+  AggSeries *s;
+
+  lock();
+  for (i = 0; i < table.getCapacity(); i++) {
+    if ((s = table.getSlot(i)) != NULL && s -> count > 0)
+      list[n++] = s;
+  }
+  unlock();
+  return n;
+}
+
+bool AggregationTable::dropIdle(AggSeries *s) {
+  if (s -> count > 0)
+    return false;
+  free(s -> buckets);
+  return true;
+}
+
+double AggregationTable::quantile(AggSeries *s, double q) {
+  double v;
+
+  v = bucketValue(apmon_utils::quantileBucket(s -> buckets, 
+					       AGG_HISTOGRAM_BUCKETS, 
+					       s -> count, q));
+  if (v < s -> min)
+    v = s -> min;
+  if (v > s -> max)
+    v = s -> max;
+  return v;
+}
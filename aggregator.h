@@ -0,0 +1,199 @@
+/**
+ * \file aggregator.h
+ * Declarations for the AggregationTable class, which accumulates the 
+ * values recorded with ApMon::record() and ApMon::recordDistribution() 
+ * until they are sent as summaries by the background thread.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_aggregator_h
+#define apmon_aggregator_h
+
+#include "ApMon.h"
+#include "series_table.h"
+
+/** log2 of the number of buckets of a histogram for each power of two 
+    (the relative error of the quantiles is at most 1 / 2^(AGG_SUB_BITS+1)). */
+#define AGG_SUB_BITS 5
+/** The smallest and the largest power of two covered by the histograms 
+    (the values outside this range are counted in the first or last 
+    bucket). */
+#define AGG_MIN_EXP -19
+#define AGG_MAX_EXP 44
+/** The number of buckets of a histogram (the first one is for the values 
+    which are not positive). */
+#define AGG_HISTOGRAM_BUCKETS \
+  (1 + ((AGG_MAX_EXP - AGG_MIN_EXP + 1) << AGG_SUB_BITS))
+
+/** The kinds of series: values recorded with ApMon::record(), with 
+    ApMon::recordDistribution() (which have a histogram), increments of a
+    counter (ApMon::counterAdd()), values of an absolute counter 
+    (ApMon::counterSet()) and the rates computed for the counters. */
+#define AGG_VALUES 0
+#define AGG_DISTRIBUTION 1
+#define AGG_COUNTER_ADD 2
+#define AGG_COUNTER_SET 3
+#define AGG_RATE 4
+
+/**
+ * The accumulators of a series of values, identified by the cluster name,
+ * the node name and the parameter name.
+ */
+typedef struct AggSeries {
+  /** The cluster name of the series. */
+  char *clusterName;
+  /** The node name of the series. */
+  char *nodeName;
+  /** The parameter name of the series. */
+  char *paramName;
+  /** The kind of the series (AGG_VALUES, AGG_DISTRIBUTION etc.), given by
+   * the last value recorded. */
+  int kind;
+  /** The number of values recorded in the current window (0 if the series
+   * is idle). */
+  long count;
+  /** The minimum value from the current window. */
+  double min;
+  /** The maximum value from the current window. */
+  double max;
+  /** The sum of the values from the current window. */
+  double sum;
+  /** The last value recorded. */
+  double last;
+  /** The moment (on the monotonic clock) when the last value was 
+   * recorded, used to choose the last value among several tables. */
+  long long lastTime;
+  /** The histogram of the values from the current window, with 
+   * AGG_HISTOGRAM_BUCKETS log-linear buckets (NULL if the quantiles of the
+   * series are not needed). */
+  unsigned int *buckets;
+} AggSeries;
+
+/**
+ * Hash table with the series recorded by a thread (each thread which calls
+ * ApMon::record() has its own table, so that the threads don't share cache
+ * lines). The series are kept in a SeriesTable. The table is protected by 
+ * a spin lock, which is contended only while the background thread drains 
+ * the table.
+ */
+class AggregationTable {
+ protected:
+  /** The series. */
+  SeriesTable<AggSeries> table;
+  /** The spin lock of the table (1 while it is held). */
+  volatile long lockWord;
+
+ private:
+  AggregationTable(const AggregationTable&);	// Not implemented
+  AggregationTable& operator=(const AggregationTable&);	// Not implemented
+
+ public:
+  /**
+   * Creates an empty table.
+   * @param maxSeries The maximum number of series which can be kept in
+   * the table.
+   */
+  AggregationTable(int maxSeries);
+
+  ~AggregationTable();
+
+  /** Returns the number of series from the table. */
+  int getNumSeries() { return table.getNumSeries(); }
+
+  /**
+   * Adds a value to a series, creating the series if needed.
+   * @param clusterName The cluster name of the series.
+   * @param nodeName The node name of the series.
+   * @param paramName The parameter name of the series.
+   * @param value The value.
+   * @param time The moment when the value was recorded, on the monotonic
+   * clock.
+   * @param kind The kind of the series. For AGG_DISTRIBUTION, the value
+   * is also added to the histogram of the series (which is created if 
+   * needed).
+   * @return RET_SUCCESS or RET_ERROR if the series could not be created
+   * (the table is full or there is not enough memory).
+   */
+  int record(const char *clusterName, const char *nodeName, 
+	     const char *paramName, double value, long long time,
+	     int kind);
+
+  /**
+   * Estimates a quantile of the values of a series from its histogram.
+   * @param s The series (it must have values and a histogram).
+   * @param q The quantile, between 0 and 1.
+   * @return The estimate, between the minimum and the maximum value.
+   */
+  static double quantile(AggSeries *s, double q);
+
+  /**
+   * Moves the accumulators of the series to another table (combining them
+   * with the ones from that table), then empties the series. The series 
+   * in which no value was recorded since the previous call are removed.
+   * The other table is not locked.
+   */
+  void drainTo(AggregationTable *dest);
+
+  /**
+   * Fills an array with the series which have values. The series remain
+   * owned by the table.
+   * @param list The array, with room for getNumSeries() elements.
+   * @return The number of series put in the array.
+   */
+  int getSeries(AggSeries **list);
+
+ protected:
+  /** Acquires the spin lock. */
+  void lock();
+
+  /** Releases the spin lock. */
+  void unlock();
+
+  /**
+   * Finds a series, creating it if it doesn't exist.
+   * @return The series or NULL if it could not be created.
+   */
+  AggSeries *lookup(const char *clusterName, const char *nodeName, 
+		    const char *paramName);
+
+  /** Combines the accumulators of a series with the ones of another 
+   * series which has the same key. */
+  void merge(AggSeries *s, AggSeries *other);
+
+  /** Frees the histogram of a series which doesn't have values (used to
+   * remove the idle series with SeriesTable::rehash()).
+   * @return true if the series is idle. */
+  static bool dropIdle(AggSeries *s);
+};
+
+#endif
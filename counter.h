@@ -0,0 +1,210 @@
+/**
+ * \file counter.h
+ * Declarations for the RateCounter class, which turns a monotonic counter
+ * into a rate, and for the CounterTable class, which keeps the counters
+ * updated with ApMon::counterAdd() and ApMon::counterSet().
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_counter_h
+#define apmon_counter_h
+
+#include <stdlib.h>
+#include "series_table.h"
+
+/** A counter whose value decreases by more than this amount, from a value
+    which fits in 32 bits, is considered to have wrapped around 2^32 
+    (otherwise it is considered to have been reset to 0). */
+#define COUNTER_WRAP_32 4294967296.0
+
+/**
+ * A monotonic counter (e.g. the number of bytes received by a network 
+ * interface), sampled periodically to obtain the increase and the rate 
+ * since the previous sample. A decrease of the value is interpreted either
+ * as the wrap of a 32-bit counter or as a reset of the counter, so that
+ * the increase is never negative. The times are given on the monotonic 
+ * clock (apmon_utils::getMonotonicTime()). The counter is not thread safe.
+ */
+class RateCounter {
+ protected:
+  /** The current value of the counter. */
+  double value;
+  /** The value of the counter at the previous sample. */
+  double prevValue;
+  /** The moment of the previous sample (-1 if there was no sample). */
+  long long prevTime;
+
+ public:
+  RateCounter() { reset(); }
+
+  /** Clears the value of the counter and its previous sample. */
+  void reset() { value = prevValue = 0; prevTime = -1; }
+
+  /** Increments the counter. */
+  void add(double delta) { value += delta; }
+
+  /** Sets the value of an absolute counter (e.g. read from /proc). */
+  void set(double value) { this -> value = value; }
+
+  /** Returns the current value of the counter. */
+  double get() { return value; }
+
+  /** Returns true if the counter has a previous sample. */
+  bool isStarted() { return prevTime >= 0; }
+
+  /**
+   * Sets the value of the counter and takes it as the previous sample 
+   * (e.g. a counter which started from 0 when the system booted).
+   * @param value The value.
+   * @param time The moment when the counter had the value.
+   */
+  void start(double value, long long time) {
+    this -> value = prevValue = value;
+    prevTime = time;
+  }
+
+  /**
+   * Takes a sample of the counter. 
+   * @param now The current moment.
+   * @param delta Output parameter, the increase of the counter since the 
+   * previous sample.
+   * @param elapsed Output parameter (it may be NULL), the time elapsed 
+   * since the previous sample, in seconds.
+   * @return false if there was no previous sample (the current value is 
+   * only taken as the previous sample).
+   */
+  bool sample(long long now, double *delta, double *elapsed) {
+    double d;
+
+    if (prevTime < 0) {
+      prevValue = value;
+      prevTime = now;
+      return false;
+    }
+    d = value - prevValue;
+    if (d < 0) {
+      if (prevValue < COUNTER_WRAP_32 && 
+	  prevValue - value > COUNTER_WRAP_32 / 2)
+	d = value + COUNTER_WRAP_32 - prevValue;
+      else
+	d = value;
+    }
+    *delta = d;
+    if (elapsed != NULL)
+      *elapsed = (now - prevTime) / 1e9;
+    prevValue = value;
+    prevTime = now;
+    return true;
+  }
+
+  /**
+   * Takes a sample of the counter and computes its rate.
+   * @param now The current moment.
+   * @param perSecond Output parameter, the average increase per second 
+   * since the previous sample.
+   * @return false if there was no previous sample or if no time passed 
+   * since it (in the latter case the sample is not taken).
+   */
+  bool rate(long long now, double *perSecond) {
+    double delta, elapsed;
+
+    if (prevTime >= 0 && now <= prevTime)
+      return false;
+    if (!sample(now, &delta, &elapsed))
+      return false;
+    *perSecond = delta / elapsed;
+    return true;
+  }
+};
+
+/**
+ * A counter identified by the cluster name, the node name and the 
+ * parameter name.
+ */
+typedef struct CounterSeries {
+  /** The cluster name of the counter. */
+  char *clusterName;
+  /** The node name of the counter. */
+  char *nodeName;
+  /** The parameter name of the counter. */
+  char *paramName;
+  /** The counter. */
+  RateCounter counter;
+} CounterSeries;
+
+/**
+ * Hash table with the counters updated with ApMon::counterAdd() and 
+ * ApMon::counterSet(), which keeps their values between the time intervals
+ * of the aggregation. The counters are kept in a SeriesTable, like the 
+ * series of AggregationTable, and the table is not thread safe.
+ */
+class CounterTable {
+ protected:
+  /** The counters. */
+  SeriesTable<CounterSeries> table;
+
+ private:
+  CounterTable(const CounterTable&);	// Not implemented
+  CounterTable& operator=(const CounterTable&);	// Not implemented
+
+ public:
+  /**
+   * Creates an empty table.
+   * @param maxSeries The maximum number of counters which can be kept in
+   * the table.
+   */
+  CounterTable(int maxSeries) : table(maxSeries) {}
+
+  /** Returns the number of counters from the table. */
+  int getNumSeries() { return table.getNumSeries(); }
+
+  /**
+   * Finds a counter, creating it if it doesn't exist.
+   * @param created Output parameter, set to true if the counter was 
+   * created (in this case it has no previous sample).
+   * @return The counter or NULL if it could not be created (the table is
+   * full or there is not enough memory).
+   */
+  CounterSeries *lookup(const char *clusterName, const char *nodeName, 
+			const char *paramName, bool *created);
+
+  /**
+   * Fills an array with the counters from the table, which remain owned 
+   * by the table.
+   * @param list The array, with room for getNumSeries() elements.
+   * @return The number of counters put in the array.
+   */
+  int getSeries(CounterSeries **list);
+};
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * \file deadband.cpp
+ * This file contains the implementation of the DeadbandTable class.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "deadband.h"
+#include <math.h>
+
+DeadbandTable::DeadbandTable() : states(MAX_DEADBAND_SERIES) {
+  nRules = 0;
+  defaultRule = -1;
+}
+
+DeadbandTable::~DeadbandTable() {
+  int i;
+
+  reset();
+  for (i = 0; i < nRules; i++)
+    free(rules[i].paramName);
+}
+
+void DeadbandTable::reset() {
+  unsigned long i;
+  DeadbandState *s;
+
+  for (i = 0; i < states.getCapacity(); i++) {
+    if ((s = states.getSlot(i)) != NULL)
+      free(s -> str);
+  }
+  states.clear();
+}
+
+int DeadbandTable::setRule(const char *paramName, double deadband, 
+			   bool relative, long maxSilence) {
+  int i;
+
+  for (i = 0; i < nRules; i++) {
+    if (strcmp(rules[i].paramName, paramName) == 0)
+      break;
+  }
+
+  if (deadband < 0) {
+    /* remove the rule */
+    if (i == nRules)
+      return RET_SUCCESS;
+    free(rules[i].paramName);
+    rules[i] = rules[--nRules];
+  } else {
+    if (i == nRules) {
+      if (nRules == MAX_DEADBAND_RULES)
+	return RET_ERROR;
+      rules[i].paramName = strdup(paramName);
+      if (rules[i].paramName == NULL)
+	return RET_ERROR;
+      nRules++;
+    }
+    rules[i].deadband = deadband;
+    rules[i].relative = relative;
+    rules[i].maxSilence = (maxSilence > 0) ? maxSilence : 0;
+  }
+
+  defaultRule = -1;
+  for (i = 0; i < nRules; i++) {
+    if (strcmp(rules[i].paramName, "*") == 0)
+      defaultRule = i;
+  }
+  /* the rules recorded in the states are not valid anymore */
+  reset();
+  return RET_SUCCESS;
+}
+
+DeadbandState *DeadbandTable::lookup(const char *clusterName, 
+				     const char *nodeName, 
+				     const char *paramName) {
+  DeadbandState *s;
+  bool created;
+  int r;
+
+  s = states.lookup(clusterName, nodeName, paramName, &created);
+  if (created) {
+    s -> rule = defaultRule;
+    for (r = 0; r < nRules; r++) {
+      if (strcmp(rules[r].paramName, paramName) == 0) {
+	s -> rule = r;
+	break;
+      }
+    }
+    s -> str = NULL;
+    s -> lastSent = -1;
+  }
+  return s;
+}
+
+bool DeadbandTable::check(const char *clusterName, const char *nodeName,
+			  const char *paramName, int valueType, 
+			  const char *value, long long now,
+			  DeadbandUpdate *update) {
+  double v = 0, threshold;
+  DeadbandRule *rule;
+  DeadbandState *s;
+
+  update -> paramName = NULL;
+  if (value == NULL)
+    return true;
+  s = lookup(clusterName, nodeName, paramName);
+  if (s == NULL || s -> rule < 0)
+    return true;
+  rule = &rules[s -> rule];
+
+  switch (valueType) {
+  case XDR_INT32:
+    v = *(int *)value;
+    break;
+  case XDR_REAL32:
+    v = *(float *)value;
+    break;
+  case XDR_REAL64:
+    v = *(double *)value;
+    break;
+  }
+
+  if (s -> lastSent >= 0 && 
+      (rule -> maxSilence == 0 || 
+       now - s -> lastSent < rule -> maxSilence * 1000000000LL)) {
+    if (valueType == XDR_STRING) {
+      /* the strings are sent only when they change */
+      if (s -> str != NULL && strcmp(s -> str, value) == 0)
+	return false;
+    } else if (s -> str == NULL) {
+      threshold = rule -> relative ? 
+	rule -> deadband / 100 * fabs(s -> value) : rule -> deadband;
+      /* (the NaN values are always sent) */
+      if (fabs(v - s -> value) <= threshold)
+	return false;
+    }
+  }
+
+  update -> clusterName = clusterName;
+  update -> nodeName = nodeName;
+  update -> paramName = paramName;
+  update -> valueType = valueType;
+  update -> value = v;
+  update -> str = (valueType == XDR_STRING) ? value : NULL;
+  return true;
+}
+
+void DeadbandTable::commit(const DeadbandUpdate *update, long long now) {
+  DeadbandState *s;
+
+  if (update -> paramName == NULL)
+    return;
+  /* (the state is created again if the rules changed meanwhile) */
+  s = lookup(update -> clusterName, update -> nodeName, 
+	     update -> paramName);
+  if (s == NULL || s -> rule < 0)
+    return;
+
+  if (update -> valueType == XDR_STRING) {
+    if (s -> str == NULL || strcmp(s -> str, update -> str) != 0) {
+      free(s -> str);
+      s -> str = strdup(update -> str);
+      if (s -> str == NULL) {
+	/* the next value is sent, since it cannot be compared */
+	s -> lastSent = -1;
+	return;
+      }
+    }
+  } else {
+    free(s -> str);
+    s -> str = NULL;
+    s -> value = update -> value;
+  }
+  s -> lastSent = now;
+}
@@ -0,0 +1,186 @@
+/**
+ * \file deadband.h
+ * Declarations for the DeadbandTable class, which keeps the last value
+ * sent for each parameter, so that the values which didn't change 
+ * significantly are not sent again (see ApMon::setDeadband()).
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_deadband_h
+#define apmon_deadband_h
+
+#include "ApMon.h"
+#include "series_table.h"
+
+/**
+ * The suppression rule for a parameter name.
+ */
+typedef struct DeadbandRule {
+  /** The parameter name ("*" for the parameters without their own rule). */
+  char *paramName;
+  /** A value is sent if it differs from the last value sent by more than
+   * this amount. */
+  double deadband;
+  /** If it is true, the deadband is a percentage of the last value sent. */
+  bool relative;
+  /** A value is sent anyway if the last value was sent more than this
+   * number of seconds ago (0 if there is no such limit). */
+  long maxSilence;
+} DeadbandRule;
+
+/**
+ * The last value sent for a (cluster, node, parameter) series.
+ */
+typedef struct DeadbandState {
+  /** The cluster name of the series. */
+  char *clusterName;
+  /** The node name of the series. */
+  char *nodeName;
+  /** The parameter name of the series. */
+  char *paramName;
+  /** The index of the rule of the parameter (-1 if it has no rule, in 
+   * which case the state only records that the values are not checked). */
+  int rule;
+  /** The last value sent, if it was a number. */
+  double value;
+  /** A copy of the last value sent, if it was a string (NULL otherwise). */
+  char *str;
+  /** The moment when the last value was sent, on the monotonic clock (-1
+   * if no value was sent yet). */
+  long long lastSent;
+} DeadbandState;
+
+/**
+ * A value which passed the deadband of its series and which must be 
+ * recorded with DeadbandTable::commit() once its datagram is sent.
+ */
+typedef struct DeadbandUpdate {
+  /** The key of the series (paramName is NULL if the parameter has no 
+   * rule). The names point to the caller's names, which are not copied 
+   * before commit(). */
+  const char *clusterName, *nodeName, *paramName;
+  /** The type of the value. */
+  int valueType;
+  /** The value, if it is a number. */
+  double value;
+  /** The value, if it is a string (it points to the caller's value, 
+   * which is not copied before commit()). */
+  const char *str;
+} DeadbandUpdate;
+
+/**
+ * The suppression rules and the last values sent for the parameters which
+ * have a rule. The states of the series are kept in a SeriesTable, which
+ * also remembers the parameters without a rule, so that the rules are 
+ * searched only once for each series. The class is not thread-safe (ApMon
+ * protects it with a mutex).
+ */
+class DeadbandTable {
+ protected:
+  /** The rules. */
+  DeadbandRule rules[MAX_DEADBAND_RULES];
+  /** The number of rules. */
+  int nRules;
+  /** The index of the rule for "*" (-1 if there is no such rule). */
+  int defaultRule;
+
+  /** The states of the series. */
+  SeriesTable<DeadbandState> states;
+
+ private:
+  DeadbandTable(const DeadbandTable&);	// Not implemented
+  DeadbandTable& operator=(const DeadbandTable&);	// Not implemented
+
+ public:
+  /** Creates a table without rules (it throws runtime_error if the table
+   * cannot be allocated). */
+  DeadbandTable();
+
+  ~DeadbandTable();
+
+  /** Returns the number of rules. */
+  int getNumRules() { return nRules; }
+
+  /**
+   * Adds, replaces or removes the rule for a parameter name. The states
+   * of all the series are reset.
+   * @param paramName The parameter name ("*" for all the parameters which
+   * don't have their own rule).
+   * @param deadband The deadband; if it is negative, the rule is removed.
+   * @param relative If it is true, the deadband is a percentage of the
+   * last value sent.
+   * @param maxSilence The maximum time (in sec) between two values sent.
+   * @return RET_SUCCESS or RET_ERROR if there are too many rules.
+   */
+  int setRule(const char *paramName, double deadband, bool relative, 
+	      long maxSilence);
+
+  /**
+   * Decides if a value must be sent. The value is not recorded as the 
+   * last value of its series until commit() is called for the update,
+   * after the datagram is sent.
+   * @param clusterName The cluster name.
+   * @param nodeName The node name.
+   * @param paramName The parameter name.
+   * @param valueType The type of the value.
+   * @param value The value.
+   * @param now The current moment on the monotonic clock.
+   * @param update Receives the update to commit, if the value must be
+   * sent.
+   * @return false if the value must be suppressed.
+   */
+  bool check(const char *clusterName, const char *nodeName, 
+	     const char *paramName, 
+	     int valueType, const char *value, long long now,
+	     DeadbandUpdate *update);
+
+  /**
+   * Records a value returned by check() as the last value sent for its 
+   * series.
+   * @param update The update filled by check().
+   * @param now The moment when the value was sent.
+   */
+  void commit(const DeadbandUpdate *update, long long now);
+
+ protected:
+  /** Removes the states of all the series. */
+  void reset();
+
+  /** Finds the state of a series, creating it if needed (NULL if the 
+   * table is full). The created state has the rule of its parameter and
+   * lastSent -1. */
+  DeadbandState *lookup(const char *clusterName, const char *nodeName, 
+			const char *paramName);
+};
+
+#endif
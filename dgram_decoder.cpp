@@ -0,0 +1,130 @@
+/**
+ * \file dgram_decoder.cpp
+ * Implementation of the DatagramDecoder class.
+ */
+
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "dgram_decoder.h"
+
+DatagramDecoder::DatagramDecoder() : params(NULL), paramsEnd(NULL), 
+  paramDec(NULL, 0), crtParam(0), version(NULL), versionLen(0),
+  password(NULL), passwordLen(0), instanceId(0), seqNr(0), cluster(NULL),
+  clusterLen(0), node(NULL), nodeLen(0), nParams(0), timestamp(-1) {
+}
+
+int DatagramDecoder::decode(const char *buf, int len) {
+  XdrDecoder dec(buf, len);
+  const char *header;
+  int headerLen, i;
+
+  /* the header is "v:<version>p:<password>", in a single string, 
+     followed by the instance ID and the sequence number */
+  if (!dec.getString(&header, &headerLen) || !dec.getInt(&instanceId) ||
+      !dec.getInt(&seqNr))
+    return RET_ERROR;
+  if (headerLen < 4 || header[0] != 'v' || header[1] != ':')
+    return RET_ERROR;
+  for (i = 2; i + 1 < headerLen; i++)
+    if (header[i] == 'p' && header[i + 1] == ':')
+      break;
+  if (i + 1 >= headerLen)
+    return RET_ERROR;
+  version = header + 2;
+  versionLen = i - 2;
+  password = header + i + 2;
+  passwordLen = headerLen - i - 2;
+
+  return parseBody(buf + dec.offset(), dec.remaining());
+}
+
+int DatagramDecoder::decodeBody(const char *body, int len) {
+  version = password = NULL;
+  versionLen = passwordLen = instanceId = seqNr = 0;
+  return parseBody(body, len);
+}
+
+int DatagramDecoder::parseBody(const char *body, int len) {
+  XdrDecoder dec(body, len);
+  DecodedParam param;
+  int i;
+
+  params = paramsEnd = NULL;
+  crtParam = nParams = 0;
+  timestamp = -1;
+  if (!dec.getString(&cluster, &clusterLen) || 
+      !dec.getString(&node, &nodeLen) || !dec.getInt(&nParams) ||
+      nParams < 0) {
+    nParams = 0;
+    return RET_ERROR;
+  }
+
+  /* check the parameters once, so that nextParam() cannot fail; the
+     timestamp follows them, if there is one */
+  params = body + dec.offset();
+  for (i = 0; i < nParams; i++)
+    if (!getParam(&dec, &param)) {
+      nParams = 0;
+      return RET_ERROR;
+    }
+  paramsEnd = body + dec.offset();
+  if (!dec.getInt(&timestamp))
+    timestamp = -1;
+  else if (dec.remaining() > 0) {
+    nParams = 0;
+    return RET_ERROR;
+  }
+
+  rewind();
+  return RET_SUCCESS;
+}
+
+bool DatagramDecoder::getParam(XdrDecoder *dec, DecodedParam *param) {
+  if (!dec -> getString(&(param -> name), &(param -> nameLen)) || 
+      !dec -> getInt(&(param -> type)))
+    return false;
+
+  param -> strValue = NULL;
+  param -> strLen = 0;
+  switch (param -> type) {
+  case XDR_STRING:
+    return dec -> getString(&(param -> strValue), &(param -> strLen));
+  case XDR_INT32:
+    return dec -> getInt(&(param -> value.i));
+  case XDR_REAL32:
+    return dec -> getFloat(&(param -> value.f));
+  case XDR_REAL64:
+    return dec -> getDouble(&(param -> value.d));
+  }
+  return false;
+}
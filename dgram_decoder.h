@@ -0,0 +1,161 @@
+/**
+ * \file dgram_decoder.h
+ * Declarations for the DatagramDecoder class, which parses the datagrams
+ * sent by ApMon without copying them.
+ */
+
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_dgram_decoder_h
+#define apmon_dgram_decoder_h
+
+#include "ApMon.h"
+#include "xdr_decoder.h"
+
+/**
+ * A parameter from a decoded datagram. The strings point inside the 
+ * buffer of the datagram and they are not null-terminated.
+ */
+typedef struct DecodedParam {
+  /** The name of the parameter. */
+  const char *name;
+  /** The length of the name. */
+  int nameLen;
+  /** The XDR type of the value (XDR_STRING, XDR_INT32, XDR_REAL32 or 
+   * XDR_REAL64). */
+  int type;
+  /** The value of an XDR_STRING parameter. */
+  const char *strValue;
+  /** The length of the XDR_STRING value. */
+  int strLen;
+  /** The value of a numeric parameter, according to its type. */
+  union {
+    int i;
+    float f;
+    double d;
+  } value;
+} DecodedParam;
+
+/**
+ * Decoder for the datagrams produced by ApMon (the inverse of 
+ * encodeHeader() and encodeParams()): the header with the version, the
+ * password, the instance ID and the sequence number, followed by the 
+ * cluster name, the node name, the parameters and the optional timestamp.
+ * The decoder keeps pointers in the buffer of the datagram, which must 
+ * not be modified or freed while the decoded values are used. The whole
+ * datagram is checked by decode(), so that nextParam() only has to walk
+ * over the parameters.
+ */
+class DatagramDecoder {
+ protected:
+  /** The beginning of the first parameter. */
+  const char *params;
+  /** The end of the last parameter. */
+  const char *paramsEnd;
+  /** Decoder positioned at the parameter returned by nextParam(). */
+  XdrDecoder paramDec;
+  /** The number of parameters returned by nextParam(). */
+  int crtParam;
+
+ public:
+  /** The version of ApMon which sent the datagram (e.g. "2.2.8_cpp"). */
+  const char *version;
+  /** The length of the version. */
+  int versionLen;
+  /** The password for the destination. */
+  const char *password;
+  /** The length of the password. */
+  int passwordLen;
+  /** The ID of the ApMon instance which sent the datagram. */
+  int instanceId;
+  /** The sequence number of the datagram. */
+  int seqNr;
+  /** The cluster name. */
+  const char *cluster;
+  /** The length of the cluster name. */
+  int clusterLen;
+  /** The node name. */
+  const char *node;
+  /** The length of the node name. */
+  int nodeLen;
+  /** The number of parameters. */
+  int nParams;
+  /** The timestamp of the datagram, or -1 if it wasn't sent with 
+   * sendTimedParameters(). */
+  int timestamp;
+
+  /** Creates a decoder with no datagram. */
+  DatagramDecoder();
+
+  /**
+   * Decodes a whole datagram, as received from the network.
+   * @param buf The datagram.
+   * @param len The length of the datagram.
+   * @return RET_SUCCESS, or RET_ERROR if the datagram is not valid.
+   */
+  int decode(const char *buf, int len);
+
+  /**
+   * Decodes the body of a datagram (without the header, as it is kept in
+   * the datagram log). The fields of the header are set to NULL and 0.
+   * @return RET_SUCCESS, or RET_ERROR if the body is not valid.
+   */
+  int decodeBody(const char *body, int len);
+
+  /**
+   * Returns the next parameter of the datagram.
+   * @param param Receives the parameter.
+   * @return true if there was a parameter, false after the last one.
+   */
+  bool nextParam(DecodedParam *param) {
+    if (crtParam >= nParams)
+      return false;
+    crtParam++;
+    return getParam(&paramDec, param);
+  }
+
+  /** Makes nextParam() start again with the first parameter. */
+  void rewind() {
+    paramDec = XdrDecoder(params, (int)(paramsEnd - params));
+    crtParam = 0;
+  }
+
+  /** Decodes a parameter from the current position of an XdrDecoder. */
+  static bool getParam(XdrDecoder *dec, DecodedParam *param);
+
+ protected:
+  /** Decodes the body, without changing the fields of the header. */
+  int parseBody(const char *body, int len);
+};
+
+#endif
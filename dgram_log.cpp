@@ -0,0 +1,217 @@
+/**
+ * \file dgram_log.cpp
+ * This file contains the implementation of the DatagramLog class.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "dgram_log.h"
+#include "dgram_decoder.h"
+
+DatagramLog::DatagramLog() {
+  unsigned long i;
+
+  records = (DgramLogRecord *)malloc(DGRAM_LOG_RECORDS * 
+				     sizeof(DgramLogRecord));
+  arena = (char *)malloc(DGRAM_LOG_ARENA_SIZE);
+  if (records == NULL || arena == NULL) {
+    free(records);
+    free(arena);
+    throw runtime_error("[ DatagramLog() ] Cannot allocate the datagram log");
+  }
+  for (i = 0; i < DGRAM_LOG_RECORDS; i++)
+    records[i].stamp = 0;
+  recPos = arenaPos = readPos = 0;
+}
+
+DatagramLog::~DatagramLog() {
+  free(records);
+  free(arena);
+}
+
+void DatagramLog::add(int seq, unsigned long destMask, long destGeneration,
+		      const char *body, int len) {
+  DgramLogRecord *rec;
+  unsigned long pos, apos, off;
+  int first;
+
+  if (len < 0 || len > MAX_DGRAM_SIZE)
+    return;
+
+  /* reserve a record and room for the body */
+  pos = APMON_ATOMIC_ADD(&recPos, 1) - 1;
+  apos = APMON_ATOMIC_ADD(&arenaPos, (unsigned long)len) - len;
+
+  off = apos & (DGRAM_LOG_ARENA_SIZE - 1);
+  first = (off + len <= DGRAM_LOG_ARENA_SIZE) ? len : 
+    (int)(DGRAM_LOG_ARENA_SIZE - off);
+  memcpy(arena + off, body, first);
+  memcpy(arena, body + first, len - first);
+
+  rec = &records[pos & (DGRAM_LOG_RECORDS - 1)];
+  rec -> stamp = 0;
+  APMON_MEMORY_BARRIER();
+  rec -> time = time(NULL);
+  rec -> seq = seq;
+  rec -> len = len;
+  rec -> arenaPos = apos;
+  rec -> destMask = destMask;
+  rec -> destGeneration = destGeneration;
+  APMON_MEMORY_BARRIER();
+  rec -> stamp = pos + 1;
+}
+
+int DatagramLog::writeNew(FILE *f, ApMonDestTable *table, 
+			  long destGeneration) {
+  unsigned long end = recPos;
+  int n;
+
+  if (end - readPos > DGRAM_LOG_RECORDS) {
+    fprintf(f, "%lu datagrams were not logged (the log was full)\n",
+	    end - DGRAM_LOG_RECORDS - readPos);
+    readPos = end - DGRAM_LOG_RECORDS;
+  }
+  n = write(f, readPos, end, table, destGeneration);
+  readPos = end;
+  return n;
+}
+
+int DatagramLog::writeAll(FILE *f, ApMonDestTable *table, 
+			  long destGeneration) {
+  unsigned long end = recPos;
+
+  return write(f, (end > DGRAM_LOG_RECORDS) ? end - DGRAM_LOG_RECORDS : 0,
+	       end, table, destGeneration);
+}
+
+int DatagramLog::write(FILE *f, unsigned long from, unsigned long to,
+		       ApMonDestTable *table, long destGeneration) {
+  DgramLogRecord *rec, crt;
+  char body[MAX_DGRAM_SIZE], text[2 * MAX_DGRAM_SIZE], time_s[30];
+  unsigned long pos, off;
+  int i, first, n = 0;
+  const char *sep;
+
+  for (pos = from; pos != to; pos++) {
+    /* copy the record and the body, then check that they were not 
+       overwritten in the meantime */
+    rec = &records[pos & (DGRAM_LOG_RECORDS - 1)];
+    if (rec -> stamp != pos + 1)
+      continue;
+    APMON_MEMORY_BARRIER();
+    memcpy(&crt, rec, sizeof(crt));
+    if (crt.len < 0 || crt.len > MAX_DGRAM_SIZE)
+      continue;
+    off = crt.arenaPos & (DGRAM_LOG_ARENA_SIZE - 1);
+    first = (off + crt.len <= DGRAM_LOG_ARENA_SIZE) ? crt.len : 
+      (int)(DGRAM_LOG_ARENA_SIZE - off);
+    memcpy(body, arena + off, first);
+    memcpy(body + first, arena, crt.len - first);
+    APMON_MEMORY_BARRIER();
+    if (rec -> stamp != pos + 1 || 
+	arenaPos - crt.arenaPos > DGRAM_LOG_ARENA_SIZE)
+      continue;
+
+#ifndef WIN32
+    char cbuf[50];
+    strncpy(time_s, ctime_r(&crt.time, cbuf), 29);
+#else
+    strncpy(time_s, ctime(&crt.time), 29);
+#endif
+    time_s[29] = 0;
+    time_s[strlen(time_s) - 1] = 0;
+
+    fprintf(f, "[%s] Datagram with size %d, sequence number %d, sent to", 
+	    time_s, crt.len, crt.seq);
+    sep = " ";
+    for (i = 0; i < MAX_N_DESTINATIONS; i++) {
+      if (!(crt.destMask & (1UL << i)))
+	continue;
+      if (table != NULL && crt.destGeneration == destGeneration &&
+	  i < table -> nDestinations)
+	fprintf(f, "%s%s", sep, table -> destinations[i].address);
+      else
+	fprintf(f, "%sdestination #%d", sep, i);
+      sep = ", ";
+    }
+    decodeBody(body, crt.len, text, sizeof(text));
+    fprintf(f, "; %s\n", text);
+    n++;
+  }
+  return n;
+}
+
+int DatagramLog::decodeBody(const char *body, int len, char *text, 
+			    int textSize) {
+  const char * const typeNames[] = {"XDR_STRING", "", "XDR_INT32", "", 
+				    "XDR_REAL32", "XDR_REAL64"};
+  DatagramDecoder dec;
+  DecodedParam param;
+  int i, crt = 0;
+
+  text[0] = 0;
+  if (dec.decodeBody(body, len) != RET_SUCCESS) {
+    snprintf(text, textSize, "invalid datagram body");
+    return RET_ERROR;
+  }
+  crt += snprintf(text + crt, textSize - crt, 
+		  "cluster %.*s, node %.*s, parameters:", dec.clusterLen, 
+		  dec.cluster, dec.nodeLen, dec.node);
+
+  for (i = 0; crt < textSize && dec.nextParam(&param); i++) {
+    crt += snprintf(text + crt, textSize - crt, "%s %.*s (%s) ", 
+		    (i > 0) ? "," : "", param.nameLen, param.name, 
+		    typeNames[param.type]);
+    if (crt >= textSize)
+      break;
+    switch (param.type) {
+    case XDR_STRING:
+      crt += snprintf(text + crt, textSize - crt, "%.*s", param.strLen, 
+		      param.strValue);
+      break;
+    case XDR_INT32:
+      crt += snprintf(text + crt, textSize - crt, "%d", param.value.i);
+      break;
+    case XDR_REAL32:
+      crt += snprintf(text + crt, textSize - crt, "%f", param.value.f);
+      break;
+    case XDR_REAL64:
+      crt += snprintf(text + crt, textSize - crt, "%lf", param.value.d);
+      break;
+    }
+  }
+
+  if (crt < textSize && dec.timestamp >= 0)
+    crt += snprintf(text + crt, textSize - crt, ", timestamp %d", 
+		    dec.timestamp);
+  return (crt < textSize) ? crt : textSize - 1;
+}
@@ -0,0 +1,147 @@
+/**
+ * \file dgram_log.h
+ * Declarations for the DatagramLog class, which keeps a compact record of
+ * the datagrams sent by ApMon and decodes them to text only when they are
+ * written.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_dgram_log_h
+#define apmon_dgram_log_h
+
+#include "ApMon.h"
+
+/**
+ * A datagram from the log. The body of the datagram is kept in the arena
+ * of the log, where it is overwritten after DGRAM_LOG_ARENA_SIZE more 
+ * bytes are logged.
+ */
+typedef struct DgramLogRecord {
+  /** The position of the record in the log + 1 (0 while the record is
+   * being written). */
+  volatile unsigned long stamp;
+  /** The moment when the datagram was sent. */
+  time_t time;
+  /** The sequence number of the datagram. */
+  int seq;
+  /** The length of the body. */
+  int len;
+  /** The position of the body in the arena (not reduced modulo the size
+   * of the arena, so that an overwritten body can be detected). */
+  unsigned long arenaPos;
+  /** The destinations to which the datagram was sent (bit i is set for 
+   * the i-th destination of the table). */
+  unsigned long destMask;
+  /** The generation of the destination table. */
+  long destGeneration;
+} DgramLogRecord;
+
+/**
+ * Ring buffer with the datagrams sent, in which the threads which send 
+ * datagrams only copy the encoded body and a few numbers, without locks 
+ * (the positions are reserved with atomic additions). The datagrams are
+ * decoded to text only when the log is written, by the background thread 
+ * or on demand. The oldest datagrams are overwritten when the buffer is 
+ * full.
+ */
+class DatagramLog {
+ protected:
+  /** The records (DGRAM_LOG_RECORDS of them). */
+  DgramLogRecord *records;
+  /** The bodies of the datagrams (DGRAM_LOG_ARENA_SIZE bytes). */
+  char *arena;
+  /** The number of records added so far. */
+  volatile unsigned long recPos;
+  /** The number of bytes added to the arena so far. */
+  volatile unsigned long arenaPos;
+  /** The position of the first record not written yet by writeNew(). */
+  unsigned long readPos;
+
+ private:
+  DatagramLog(const DatagramLog&);	// Not implemented
+  DatagramLog& operator=(const DatagramLog&);	// Not implemented
+
+ public:
+  /** Creates an empty log (throws runtime_error if there is not enough
+   * memory). */
+  DatagramLog();
+
+  ~DatagramLog();
+
+  /**
+   * Adds a datagram to the log (this can be called by several threads at
+   * the same time).
+   * @param seq The sequence number of the datagram.
+   * @param destMask The destinations to which it was sent.
+   * @param destGeneration The generation of the destination table.
+   * @param body The encoded body.
+   * @param len The length of the body.
+   */
+  void add(int seq, unsigned long destMask, long destGeneration,
+	   const char *body, int len);
+
+  /**
+   * Writes the datagrams added since the previous call (the calls of 
+   * writeNew() and writeAll() must not overlap).
+   * @param f The file.
+   * @param table The destination table, used to show the addresses.
+   * @param destGeneration The generation of the table.
+   * @return The number of datagrams written.
+   */
+  int writeNew(FILE *f, ApMonDestTable *table, long destGeneration);
+
+  /** Marks the datagrams added so far as written by writeNew(). */
+  void skipNew() {
+    readPos = recPos;
+  }
+
+  /** Writes all the datagrams which are still in the log (see 
+   * writeNew()). */
+  int writeAll(FILE *f, ApMonDestTable *table, long destGeneration);
+
+  /**
+   * Decodes the body of a datagram to text: the cluster name, the node 
+   * name and the parameters, with their types and values.
+   * @return The length of the text, or RET_ERROR if the body is not a 
+   * valid datagram.
+   */
+  static int decodeBody(const char *body, int len, char *text, 
+			int textSize);
+
+ protected:
+  /** Writes the records between two positions. */
+  int write(FILE *f, unsigned long from, unsigned long to, 
+	    ApMonDestTable *table, long destGeneration);
+};
+
+#endif
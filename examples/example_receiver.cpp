@@ -0,0 +1,248 @@
+/**
+ * \file example_receiver.cpp
+ * Local receiver for the datagrams sent by ApMon, which can be used to
+ * measure the throughput of a sender or to check its datagrams without a
+ * MonALISA service. The datagrams are received in batches with recvmmsg()
+ * (where it is available) and parsed in place with DatagramDecoder. The
+ * receiver counts the datagrams, detects the gaps in the sequence numbers
+ * of each ApMon instance and prints the number of datagrams received each
+ * second.
+ * Usage: example_receiver [-p port] [-t number_of_seconds] [-v]
+ * (-v prints the contents of each datagram)
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ApMon.h"
+#include "dgram_decoder.h"
+
+/** The number of datagrams received with a system call. */
+#define BATCH_SIZE 64
+/** The size of the table with the state of the ApMon instances. */
+#define MAX_INSTANCES 4096
+
+/** The sequence numbers seen from an ApMon instance. */
+typedef struct InstanceState {
+  bool used;
+  int id;
+  int lastSeq;
+  long received;
+  /** The datagrams missing from the gaps in the sequence numbers. */
+  long lost;
+  /** The datagrams which arrived after a larger sequence number. */
+  long late;
+} InstanceState;
+
+static InstanceState instances[MAX_INSTANCES];
+static int nInstances = 0;
+static char bufs[BATCH_SIZE][MAX_DGRAM_SIZE];
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Returns the state of an instance, or NULL if the table is full. */
+static InstanceState *findInstance(int id) {
+  unsigned int h = ((unsigned int)id * 2654435761U) % MAX_INSTANCES;
+  int i;
+
+  for (i = 0; i < MAX_INSTANCES; i++) {
+    InstanceState *st = &instances[(h + i) % MAX_INSTANCES];
+    if (!st -> used) {
+      st -> used = true;
+      st -> id = id;
+      st -> lastSeq = -1;
+      nInstances++;
+      return st;
+    }
+    if (st -> id == id)
+      return st;
+  }
+  return NULL;
+}
+
+/** Updates the state of an instance with the sequence number of a
+    datagram (the sequence numbers wrap at TWO_BILLION). */
+static void checkSequence(InstanceState *st, int seq, long *lost,
+			  long *late) {
+  long long diff;
+
+  st -> received++;
+  if (st -> lastSeq >= 0) {
+    diff = ((long long)seq - (st -> lastSeq + 1) + TWO_BILLION) %
+      TWO_BILLION;
+    if (diff >= TWO_BILLION / 2) {
+      /* an older datagram, which filled a gap or is a duplicate */
+      st -> late++;
+      (*late)++;
+      if (st -> lost > 0) {
+	st -> lost--;
+	(*lost)--;
+      }
+      return;
+    }
+    st -> lost += diff;
+    *lost += diff;
+  }
+  st -> lastSeq = seq;
+}
+
+static void printDatagram(DatagramDecoder *dec) {
+  DecodedParam param;
+
+  printf("instance %d, seq %d, version %.*s, cluster %.*s, node %.*s",
+	 dec -> instanceId, dec -> seqNr, dec -> versionLen, dec -> version,
+	 dec -> clusterLen, dec -> cluster, dec -> nodeLen, dec -> node);
+  if (dec -> timestamp >= 0)
+    printf(", timestamp %d", dec -> timestamp);
+  printf("\n");
+  while (dec -> nextParam(&param)) {
+    printf("    %.*s = ", param.nameLen, param.name);
+    switch (param.type) {
+    case XDR_STRING:
+      printf("%.*s\n", param.strLen, param.strValue);
+      break;
+    case XDR_INT32:
+      printf("%d\n", param.value.i);
+      break;
+    case XDR_REAL32:
+      printf("%f\n", param.value.f);
+      break;
+    case XDR_REAL64:
+      printf("%lf\n", param.value.d);
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int port = DEFAULT_PORT, duration = 0, sock, n, i, rcvBuf = 4 << 20;
+  bool verbose = false;
+  struct sockaddr_in addr;
+  struct timeval timeout;
+  DatagramDecoder dec;
+  InstanceState *st;
+  int lens[BATCH_SIZE];
+  long total = 0, totalBytes = 0, invalid = 0, lost = 0, late = 0;
+  long intervalDgrams = 0, intervalBytes = 0, intervalParams = 0;
+  double start, lastReport, t;
+#ifdef APMON_HAVE_SENDMMSG
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iovs[BATCH_SIZE];
+#endif
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      duration = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-v") == 0)
+      verbose = true;
+    else {
+      fprintf(stderr, "Usage: %s [-p port] [-t number_of_seconds] [-v]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  /* a large buffer for the bursts of the sender; the timeout lets the
+     statistics be printed when no datagrams arrive */
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 200000;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#ifdef APMON_HAVE_SENDMMSG
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < BATCH_SIZE; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = MAX_DGRAM_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+#endif
+
+  printf("Listening on port %d...\n", port);
+  start = lastReport = now();
+  while (duration <= 0 || now() - start < duration) {
+#ifdef APMON_HAVE_SENDMMSG
+    n = recvmmsg(sock, msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+    for (i = 0; i < n; i++)
+      lens[i] = (int)msgs[i].msg_len;
+#else
+    n = recv(sock, bufs[0], MAX_DGRAM_SIZE, 0);
+    if (n >= 0) {
+      lens[0] = n;
+      n = 1;
+    }
+#endif
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("recv");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      intervalDgrams++;
+      intervalBytes += lens[i];
+      if (dec.decode(bufs[i], lens[i]) != RET_SUCCESS) {
+	invalid++;
+	continue;
+      }
+      intervalParams += dec.nParams;
+      st = findInstance(dec.instanceId);
+      if (st != NULL)
+	checkSequence(st, dec.seqNr, &lost, &late);
+      if (verbose)
+	printDatagram(&dec);
+    }
+
+    t = now();
+    if (t - lastReport >= 1) {
+      printf("%.0f datagrams/s, %.1f KB/s, %.0f parameters/s; lost %ld, "
+	     "late %ld, invalid %ld, instances %d\n",
+	     intervalDgrams / (t - lastReport),
+	     intervalBytes / 1024.0 / (t - lastReport),
+	     intervalParams / (t - lastReport), lost, late, invalid,
+	     nInstances);
+      fflush(stdout);
+      total += intervalDgrams;
+      totalBytes += intervalBytes;
+      intervalDgrams = intervalBytes = intervalParams = 0;
+      lastReport = t;
+    }
+  }
+
+  total += intervalDgrams;
+  totalBytes += intervalBytes;
+  t = now() - start;
+  printf("\nReceived %ld datagrams (%ld bytes) in %.1f s, %.0f datagrams/s;"
+	 " lost %ld, late %ld, invalid %ld\n", total, totalBytes, t,
+	 (t > 0) ? total / t : 0, lost, late, invalid);
+  for (i = 0; i < MAX_INSTANCES; i++)
+    if (instances[i].used)
+      printf("  instance %d: %ld datagrams, last sequence number %d, "
+	     "lost %ld, late %ld\n", instances[i].id, instances[i].received,
+	     instances[i].lastSeq, instances[i].lost, instances[i].late);
+  return 0;
+}
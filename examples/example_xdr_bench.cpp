@@ -0,0 +1,159 @@
+/**
+ * \file example_xdr_bench.cpp
+ * Microbenchmark which compares the encoding of a datagram body with the
+ * XDR streams from xdr.cpp (the method used by the previous versions of
+ * ApMon) and with the inline XdrEncoder. It also checks that the two 
+ * methods produce the same bytes.
+ * Usage: example_xdr_bench [number_of_iterations]
+ */ 
+#include <stdlib.h> 
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "ApMon.h"
+#include "xdr_encoder.h"
+
+#define N_PARAMS 10
+
+static char *paramNames[N_PARAMS] = {
+  (char *)"cpu_usr", (char *)"cpu_sys", (char *)"load1", (char *)"processes",
+  (char *)"mem_used", (char *)"net_in", (char *)"net_out", 
+  (char *)"disk_free", (char *)"uptime", (char *)"os_type"
+};
+static int valueTypes[N_PARAMS] = {
+  XDR_REAL64, XDR_REAL64, XDR_REAL32, XDR_INT32, XDR_REAL64, XDR_REAL64,
+  XDR_REAL64, XDR_INT32, XDR_REAL64, XDR_STRING
+};
+
+static double elapsed(struct timeval *t1, struct timeval *t2) {
+  return (t2 -> tv_sec - t1 -> tv_sec) + 
+    (t2 -> tv_usec - t1 -> tv_usec) / 1000000.0;
+}
+
+/** Encodes a datagram body with the XDR streams from xdr.cpp. */
+static int encodeXdrmem(char *buf, char **values, int timestamp) {
+  XDR xdrs;
+  char *cluster = (char *)"BenchCluster", *node = (char *)"bench.node.org";
+  int i, n = N_PARAMS, len;
+
+  xdrmem_create(&xdrs, buf, MAX_DGRAM_SIZE, XDR_ENCODE);
+  xdr_string(&xdrs, &cluster, strlen(cluster) + 1);
+  xdr_string(&xdrs, &node, strlen(node) + 1);
+  xdr_int(&xdrs, &n);
+  for (i = 0; i < N_PARAMS; i++) {
+    xdr_string(&xdrs, &(paramNames[i]), strlen(paramNames[i]) + 1);
+    xdr_int(&xdrs, &(valueTypes[i]));
+    switch (valueTypes[i]) {
+    case XDR_STRING:
+      xdr_string(&xdrs, &(values[i]), strlen(values[i]) + 1);
+      break;
+    case XDR_INT32:
+      xdr_int(&xdrs, (int *)values[i]);
+      break;
+    case XDR_REAL32:
+      xdr_float(&xdrs, (float *)values[i]);
+      break;
+    case XDR_REAL64:
+      xdr_double(&xdrs, (double *)values[i]);
+      break;
+    }
+  }
+  xdr_int(&xdrs, &timestamp);
+  len = xdr_getpos(&xdrs);
+  xdr_destroy(&xdrs);
+  return len;
+}
+
+/** Encodes a datagram body with XdrEncoder. */
+static int encodeInline(char *buf, char **values, int timestamp) {
+  XdrEncoder enc(buf, MAX_DGRAM_SIZE);
+  int i;
+
+  enc.putString("BenchCluster");
+  enc.putString("bench.node.org");
+  enc.putInt(N_PARAMS);
+  for (i = 0; i < N_PARAMS; i++) {
+    enc.putString(paramNames[i]);
+    enc.putInt(valueTypes[i]);
+    switch (valueTypes[i]) {
+    case XDR_STRING:
+      enc.putString(values[i]);
+      break;
+    case XDR_INT32:
+      enc.putInt(*(int *)values[i]);
+      break;
+    case XDR_REAL32:
+      enc.putFloat(*(float *)values[i]);
+      break;
+    case XDR_REAL64:
+      enc.putDouble(*(double *)values[i]);
+      break;
+    }
+  }
+  enc.putInt(timestamp);
+  return enc.length();
+}
+
+int main(int argc, char **argv) {
+  char buf1[MAX_DGRAM_SIZE], buf2[MAX_DGRAM_SIZE];
+  double d[N_PARAMS];
+  float f = 0.75f;
+  int ints[N_PARAMS];
+  char *values[N_PARAMS];
+  int i, k, len1 = 0, len2 = 0, nIter = 1000000;
+  unsigned long check = 0;
+  struct timeval t1, t2;
+  double t_xdrmem, t_inline;
+
+  if (argc == 2)
+    nIter = atoi(argv[1]);
+
+  for (i = 0; i < N_PARAMS; i++) {
+    d[i] = i * 1.5 + 0.1;
+    ints[i] = i * 1000 - 3;
+    switch (valueTypes[i]) {
+    case XDR_STRING:
+      values[i] = (char *)"Linux";
+      break;
+    case XDR_INT32:
+      values[i] = (char *)&ints[i];
+      break;
+    case XDR_REAL32:
+      values[i] = (char *)&f;
+      break;
+    default:
+      values[i] = (char *)&d[i];
+    }
+  }
+
+  len1 = encodeXdrmem(buf1, values, 1234567890);
+  len2 = encodeInline(buf2, values, 1234567890);
+  if (len1 != len2 || memcmp(buf1, buf2, len1) != 0) {
+    fprintf(stderr, "The encodings differ!\n");
+    return 1;
+  }
+
+  gettimeofday(&t1, NULL);
+  for (k = 0; k < nIter; k++) {
+    d[0] = k;
+    check += encodeXdrmem(buf1, values, k + 1) + buf1[40];
+  }
+  gettimeofday(&t2, NULL);
+  t_xdrmem = elapsed(&t1, &t2);
+
+  gettimeofday(&t1, NULL);
+  for (k = 0; k < nIter; k++) {
+    d[0] = k;
+    check += encodeInline(buf2, values, k + 1) + buf2[40];
+  }
+  gettimeofday(&t2, NULL);
+  t_inline = elapsed(&t1, &t2);
+
+  printf("%d datagrams of %d bytes (checksum %lu)\n", nIter, len1, check);
+  printf("xdrmem:      %8.1f ns/datagram\n", t_xdrmem * 1e9 / nIter);
+  printf("XdrEncoder:  %8.1f ns/datagram\n", t_inline * 1e9 / nIter);
+  if (t_inline > 0)
+    printf("speedup:     %8.2fx\n", t_xdrmem / t_inline);
+  return 0;
+}
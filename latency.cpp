@@ -0,0 +1,114 @@
+/**
+ * \file latency.cpp
+ * Implementation of the LatencyHistogram class.
+ */
+
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "latency.h"
+#include "utils.h"
+
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+void LatencyHistogram::reset() {
+  memset(counts, 0, sizeof(counts));
+  count = 0;
+  sum = min = max = 0;
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other) {
+  int b;
+
+  if (other.count == 0)
+    return;
+  for (b = 0; b < LATENCY_BUCKETS; b++)
+    counts[b] += other.counts[b];
+  if (count == 0 || other.min < min)
+    min = other.min;
+  if (other.max > max)
+    max = other.max;
+  sum += other.sum;
+  count += other.count;
+}
+
+long long LatencyHistogram::bucketLow(int bucket) {
+  int e;
+
+  /* the first two powers of two have buckets of width 1 */
+  if (bucket < (2 << LATENCY_SUB_BITS))
+    return bucket;
+  e = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+  return (long long)((1 << LATENCY_SUB_BITS) + 
+		     (bucket & ((1 << LATENCY_SUB_BITS) - 1))) << 
+    (e - LATENCY_SUB_BITS);
+}
+
+long long LatencyHistogram::bucketWidth(int bucket) {
+  if (bucket < (2 << LATENCY_SUB_BITS))
+    return 1;
+  return 1LL << ((bucket >> LATENCY_SUB_BITS) - 1);
+}
+
+long long LatencyHistogram::quantile(double q) const {
+  long long v;
+  int b;
+
+  if (count == 0)
+    return 0;
+  b = apmon_utils::quantileBucket(counts, LATENCY_BUCKETS, count, q);
+  v = bucketLow(b) + bucketWidth(b) / 2;
+  if (v < min)
+    v = min;
+  if (v > max)
+    v = max;
+  return v;
+}
+
+void LatencyHistogram::write(FILE *f, const char *name) const {
+  fprintf(f, "%s: count %ld, min %.3f, avg %.3f, p50 %.3f, p90 %.3f, "
+	  "p99 %.3f, p99.9 %.3f, max %.3f (us)\n", name, count, min / 1e3,
+	  getMean() / 1e3, quantile(0.5) / 1e3, quantile(0.9) / 1e3, 
+	  quantile(0.99) / 1e3, quantile(0.999) / 1e3, max / 1e3);
+}
+
+long long LatencyHistogram::now() {
+#if !defined(WIN32) && defined(CLOCK_MONOTONIC_RAW)
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0)
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+  return apmon_utils::getMonotonicTime();
+}
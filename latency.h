@@ -0,0 +1,173 @@
+/**
+ * \file latency.h
+ * Declarations for the LatencyHistogram class, which counts the durations
+ * of the stages of sending a datagram in log-linear buckets.
+ */
+
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_latency_h
+#define apmon_latency_h
+
+#include "ApMon.h"
+
+/** log2 of the number of buckets for each power of two (the relative 
+    error of the values read from a histogram is at most 
+    1 / 2^(LATENCY_SUB_BITS+1)); the durations below 2^LATENCY_SUB_BITS ns
+    are counted exactly. */
+#define LATENCY_SUB_BITS 5
+/** The largest power of two (in ns) covered by the histograms (the longer
+    durations are counted in the last bucket). */
+#define LATENCY_MAX_EXP 40
+/** The number of buckets of a histogram. */
+#define LATENCY_BUCKETS \
+  ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+/**
+ * Histogram of durations (in ns), in the style of HdrHistogram: the 
+ * buckets have the same relative width, so that a histogram has a fixed
+ * size and the tail of the distribution is kept with the same precision
+ * as its middle. A histogram is updated by a single thread, without 
+ * atomic operations; the histograms of several threads are combined with
+ * add().
+ */
+class LatencyHistogram {
+ protected:
+  /** The number of durations from each bucket. */
+  unsigned int counts[LATENCY_BUCKETS];
+  /** The number of durations recorded. */
+  long count;
+  /** The sum of the durations recorded. */
+  long long sum;
+  /** The minimum duration recorded. */
+  long long min;
+  /** The maximum duration recorded. */
+  long long max;
+
+ public:
+  /** Creates an empty histogram. */
+  LatencyHistogram();
+
+  /** Empties the histogram. */
+  void reset();
+
+  /** Records a duration (in ns). */
+  void record(long long duration) {
+    if (duration < 0)
+      duration = 0;
+    counts[bucketOf(duration)]++;
+    if (count == 0 || duration < min)
+      min = duration;
+    if (duration > max)
+      max = duration;
+    sum += duration;
+    count++;
+  }
+
+  /** Adds the durations from another histogram to this one. */
+  void add(const LatencyHistogram &other);
+
+  /** Returns the number of durations recorded. */
+  long getCount() const { return count; }
+
+  /** Returns the minimum duration recorded (0 if there is none). */
+  long long getMin() const { return min; }
+
+  /** Returns the maximum duration recorded (0 if there is none). */
+  long long getMax() const { return max; }
+
+  /** Returns the average duration (0 if there is none). */
+  double getMean() const { return count > 0 ? (double)sum / count : 0; }
+
+  /**
+   * Estimates a quantile of the durations.
+   * @param q The quantile, between 0 and 1.
+   * @return The estimate (the middle of the bucket in which the quantile
+   * falls), between the minimum and the maximum duration.
+   */
+  long long quantile(double q) const;
+
+  /** Returns the number of durations from a bucket. */
+  unsigned int getBucketCount(int bucket) const { return counts[bucket]; }
+
+  /** Returns the bucket of a duration. */
+  static int bucketOf(long long duration) {
+    int e;
+
+    if (duration < (1 << LATENCY_SUB_BITS))
+      return (int)duration;
+    e = highestBit(duration);
+    if (e > LATENCY_MAX_EXP)
+      return LATENCY_BUCKETS - 1;
+    return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+      (int)((duration >> (e - LATENCY_SUB_BITS)) & 
+	    ((1 << LATENCY_SUB_BITS) - 1));
+  }
+
+  /** Returns the smallest duration counted in a bucket. */
+  static long long bucketLow(int bucket);
+
+  /** Returns the width of a bucket. */
+  static long long bucketWidth(int bucket);
+
+  /**
+   * Writes a summary of the histogram in a file: the number of durations,
+   * the minimum, the average, some quantiles and the maximum, in 
+   * microseconds.
+   * @param f The file.
+   * @param name The name of the histogram, at the beginning of the line.
+   */
+  void write(FILE *f, const char *name) const;
+
+  /** Returns the current time in ns, from the clock used for the 
+   * durations (CLOCK_MONOTONIC_RAW where it is available, which is not 
+   * adjusted by NTP). */
+  static long long now();
+
+ protected:
+  /** Returns the position of the most significant bit set (the value 
+   * must be positive). */
+  static int highestBit(long long value) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll((unsigned long long)value);
+#else
+    int e = 0;
+
+    while ((value >>= 1) != 0)
+      e++;
+    return e;
+#endif
+  }
+};
+
+#endif
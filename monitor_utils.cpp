@@ -144,6 +144,7 @@ void ApMon::updateJobInfo(MonitoredJob job) {
 void ApMon::sendOneJobInfo(MonitoredJob job) {
   int i;
   int nParams = 0;
+  long long start;
 
   char **paramNames, **paramValues;
   int *valueTypes;
@@ -157,7 +158,9 @@ void ApMon::sendOneJobInfo(MonitoredJob job) {
     currentJobVals[i] = 0;
   }
     
+  start = getMonotonicTime();
   updateJobInfo(job);
+  addCollectorTime(COLLECTOR_JOB_INFO, start);
 
   for (i = 0; i < nJobMonitorParams; i++) {
     if (actJobMonitorParams[i] && jobRetResults[i] != RET_ERROR) {
@@ -369,8 +372,9 @@ void ApMon::updateSysInfo() {
 void ApMon::sendSysInfo() {
 #ifndef WIN32
   int nParams = 0, maxNParams;
-  int i;
+  int i, prevPriority;
   long crtTime;
+  long long bootMoment, start;
 
   int *valueTypes;
   char **paramNames, **paramValues;
@@ -381,10 +385,13 @@ void ApMon::sendSysInfo() {
   /* make some initializations only the first time this
      function is called */
   if (this -> sysInfo_first) {
+    /* the network counters started from 0 at the moment of the previous 
+       datagram (the boot time) */
+    bootMoment = getMonotonicTime() - 
+      (long long)(crtTime - this -> lastSysInfoSend) * 1000000000LL;
     for (i = 0; i < this -> nInterfaces; i++) {
-     this -> lastBytesSent[i] = this -> lastBytesReceived[i] = 0.0;
-     this -> lastNetErrs[i] = 0;
-     
+      this -> netInCounters[i].start(0, bootMoment);
+      this -> netOutCounters[i].start(0, bootMoment);
     }
     this -> sysInfo_first = FALSE;
   }
@@ -409,7 +416,9 @@ void ApMon::sendSysInfo() {
       sysRetResults[i] = RET_ERROR;
   }
 
+  start = getMonotonicTime();
   updateSysInfo();
+  addCollectorTime(COLLECTOR_SYS_INFO, start);
 
   for (i = 0; i < nSysMonitorParams; i++) {
     if (i == SYS_NET_IN || i == SYS_NET_OUT || i == SYS_NET_ERRS ||
@@ -531,6 +540,9 @@ void ApMon::sendSysInfo() {
     }
   }
 
+  /* the system monitoring datagrams are the first ones to be dropped when
+     the maximum message rate is approached */
+  prevPriority = setThreadPriority(PRIORITY_BULK);
   try {
     if (nParams > 0)
       sendParameters(sysMonCluster, sysMonNode, nParams, 
@@ -538,6 +550,8 @@ void ApMon::sendSysInfo() {
   } catch (runtime_error& err) {
     logger(WARNING, err.what());
   }
+  if (prevPriority >= 0)
+    setThreadPriority(prevPriority);
 
   this -> lastSysInfoSend = crtTime;
 
@@ -593,8 +607,9 @@ void ApMon::updateGeneralInfo() {
 
 void ApMon::sendGeneralInfo() {
 #ifndef WIN32
-  int nParams, maxNParams, i;
+  int nParams, maxNParams, i, prevPriority;
   long crtTime;
+  long long start;
   char tmp_s[50];
   
   char **paramNames, **paramValues;
@@ -610,7 +625,9 @@ void ApMon::sendGeneralInfo() {
   
   nParams = 0;
 
+  start = getMonotonicTime();
   updateGeneralInfo();
+  addCollectorTime(COLLECTOR_GEN_INFO, start);
 
   if (actGenMonitorParams[GEN_HOSTNAME]) {
     paramNames[nParams] = strdup(genMonitorParams[GEN_HOSTNAME]);
@@ -677,6 +694,9 @@ void ApMon::sendGeneralInfo() {
     } 
   }
 
+  /* the system monitoring datagrams are the first ones to be dropped when
+     the maximum message rate is approached */
+  prevPriority = setThreadPriority(PRIORITY_BULK);
   try {
     if (nParams > 0)
       sendParameters(sysMonCluster, sysMonNode, nParams, 
@@ -684,6 +704,8 @@ void ApMon::sendGeneralInfo() {
   } catch (runtime_error& err) {
     logger(WARNING, err.what());
   }
+  if (prevPriority >= 0)
+    setThreadPriority(prevPriority);
 
   for (i = 0; i < nParams; i++)
     free(paramNames[i]);
@@ -695,22 +717,98 @@ void ApMon::sendGeneralInfo() {
 
 void ApMon::initMonitoring() {
   int i;
+  long long bootMoment;
 
   this -> autoDisableMonitoring = true;
   this -> sysMonitoring = false;
   this -> jobMonitoring = false;
   this -> genMonitoring = false;
   this -> confCheck = false;
+  this -> connectedSockets = false;
+  this -> nDestinations = 0;
+  this -> destAddresses = NULL;
+  this -> destPorts = NULL;
+  this -> destPasswds = NULL;
+  /* an empty destination table, until the configuration is loaded */
+  this -> destTable = (ApMonDestTable *)malloc(sizeof(ApMonDestTable));
+  this -> destTable -> nDestinations = 0;
+  this -> destTable -> destinations = NULL;
+  this -> destTable -> refs = 1;
+  this -> destGeneration = 0;
+  this -> threadContexts = NULL;
+  this -> defaultNames = NULL;
+  this -> registeredNames = NULL;
+  this -> preparedSchemas = NULL;
+
+  this -> asyncSend = false;
+  this -> asyncQueueSize = ASYNC_QUEUE_SIZE;
+  this -> asyncOverflowPolicy = ASYNC_DROP_NEWEST;
+  this -> sendQueue = NULL;
+  this -> asyncEnabled = false;
+  this -> asyncProducers = 0;
+  this -> stopAsyncThread = false;
+  this -> asyncDropped = 0;
+
+  this -> coalesce = false;
+  this -> coalesceInterval = COALESCE_INTERVAL;
+  this -> coalesceChanged = false;
+  this -> coalesceEnabled = false;
+  this -> nCoalesceBufs = 0;
+  for (i = 0; i < MAX_COALESCE_BUFFERS; i++)
+    this -> coalesceBufs[i] = NULL;
+
+  this -> aggregate = false;
+  this -> aggregateInterval = AGGREGATE_INTERVAL;
+  this -> aggregateChanged = false;
+  this -> aggregateEnabled = false;
+  this -> retiredAgg = NULL;
+  this -> counterTable = NULL;
+  this -> lastCounterSample = 0;
+  this -> nQuantiles = 3;
+  this -> quantiles[0] = 0.5;
+  this -> quantiles[1] = 0.9;
+  this -> quantiles[2] = 0.99;
+  this -> deadbandTable = NULL;
+  this -> deadbandEnabled = false;
+  this -> dgramLog = NULL;
+  this -> dgramLogSink = DGRAM_LOG_OFF;
+  this -> dgramLogFile = NULL;
+  this -> dgramLogFlush = false;
+  this -> dgramLogChanged = false;
+  this -> selfStats = false;
+  this -> selfStatsInterval = SELF_STATS_INTERVAL;
+  this -> selfStatsChanged = false;
+  this -> selfStatsEnabled = false;
+  memset(&this -> retiredStats, 0, sizeof(this -> retiredStats));
+  for (i = 0; i < N_COLLECTORS; i++) {
+    this -> collectorRuns[i] = 0;
+    this -> collectorTime[i] = 0;
+  }
+  this -> latencyEnabled = false;
+  this -> retiredLatency = NULL;
+#ifndef WIN32
+  this -> latencyDump = false;
+  this -> latencyDumpPath = NULL;
+  this -> latencyPipe[0] = this -> latencyPipe[1] = -1;
+#endif
 
 #ifndef WIN32
   pthread_mutex_init(&this -> mutex, NULL);
+  pthread_mutex_init(&this -> mutexDest, NULL);
+  pthread_key_create(&this -> ctxKey, &ApMon::threadContextDestructor);
   pthread_mutex_init(&this -> mutexBack, NULL);
+  pthread_mutex_init(&this -> mutexDeadband, NULL);
+  pthread_mutex_init(&this -> mutexDgramLog, NULL);
   pthread_mutex_init(&this -> mutexCond, NULL);
   pthread_cond_init(&this -> confChangedCond, NULL);
 #else
   logger(INFO, "init mutexes...");
   this -> mutex     = CreateMutex(NULL, FALSE, NULL);
+  this -> mutexDest = CreateMutex(NULL, FALSE, NULL);
+  this -> ctxKey = TlsAlloc();
   this -> mutexBack = CreateMutex(NULL, FALSE, NULL);
+  this -> mutexDeadband = CreateMutex(NULL, FALSE, NULL);
+  this -> mutexDgramLog = CreateMutex(NULL, FALSE, NULL);
   this -> mutexCond = CreateMutex(NULL, FALSE, NULL);
   this -> confChangedCond = CreateEvent(NULL, FALSE, FALSE, NULL);
 
@@ -758,8 +856,12 @@ void ApMon::initMonitoring() {
     this -> lastSysInfoSend = 0;
   } 
 
+  /* the counters of the system parameters started from 0 when the system
+     booted */
+  bootMoment = getMonotonicTime() - 
+    (long long)(time(NULL) - this -> lastSysInfoSend) * 1000000000LL;
   for (i = 0; i < nSysMonitorParams; i++)
-    this -> lastSysVals[i] = 0;
+    this -> sysCounters[i].start(0, bootMoment);
 
   //this -> lastUsrTime = this -> lastSysTime = 0;
   //this -> lastNiceTime = this -> lastIdleTime = 0;
@@ -780,13 +882,25 @@ void ApMon::initMonitoring() {
   }
 
   this -> maxMsgRate = MAX_MSG_RATE;
+  this -> defaultBucket.clusterName = NULL;
+  this -> defaultBucket.ownLimit = true;
+  this -> defaultBucket.priority = -1;
+  this -> defaultBucket.maxRate = 0;
+  this -> defaultBucket.burst = 0;
+  this -> defaultBucket.refillTime = 0;
+  this -> defaultBucket.nSent = 0;
+  this -> defaultBucket.nDropped = 0;
+  this -> nRateGroups = 0;
 }
 
 void ApMon::parseXApMonLine(char *line) {
   bool flag, found;
   int ind;
+  long maxSilence;
+  int nq;
+  double q[MAX_QUANTILES];
   char tmp[MAX_STRING_LEN], logmsg[200];
-  char *param, *value;
+  char *param, *value, *tok;
 //  char sbuf[MAX_STRING_LEN];
 //  char *pbuf = sbuf;
   char *sep = (char *)" =";
@@ -797,6 +911,77 @@ void ApMon::parseXApMonLine(char *line) {
   param = strtok/*_r*/(tmp2, sep);//, &pbuf);
   value = strtok/*_r*/(NULL, sep);//, &pbuf);
 
+  /* the clusters with their own message rate or priority (this doesn't
+     need mutexBack) */
+  if (strstr(param, "maxMsgRate_") == param) {
+    setClusterMsgRate(param + strlen("maxMsgRate_"), atoi(value));
+    return;
+  }
+  if (strstr(param, "priority_") == param) {
+    if (strcmp(value, "critical") == 0)
+      ind = PRIORITY_CRITICAL;
+    else if (strcmp(value, "bulk") == 0)
+      ind = PRIORITY_BULK;
+    else
+      ind = PRIORITY_NORMAL;
+    setClusterPriority(param + strlen("priority_"), ind);
+    return;
+  }
+  /* xApMon_deadband_<param> = <deadband>[%] [<max_silence>] */
+  if (strstr(param, "deadband_") == param) {
+    maxSilence = 0;
+    if ((tok = strtok(NULL, sep)) != NULL)
+      maxSilence = atol(tok);
+    setDeadband(param + strlen("deadband_"), atof(value), 
+		strchr(value, '%') != NULL, maxSilence);
+    return;
+  }
+  /* xApMon_quantiles = <q1>,<q2>,... */
+  if (strcmp(param, "quantiles") == 0) {
+    nq = 0;
+    for (tok = strtok(value, ","); tok != NULL && nq < MAX_QUANTILES; 
+	 tok = strtok(NULL, ","))
+      q[nq++] = atof(tok);
+    if (setQuantiles(nq, q) != RET_SUCCESS)
+      logger(WARNING, "Invalid quantiles in the configuration file");
+    return;
+  }
+
+  /* xApMon_datagram_log = off | memory | stderr | <file> */
+  if (strcmp(param, "datagram_log") == 0) {
+    if (strcmp(value, "off") == 0)
+      setDatagramLog(DGRAM_LOG_OFF);
+    else if (strcmp(value, "memory") == 0)
+      setDatagramLog(DGRAM_LOG_MEMORY);
+    else
+      setDatagramLog(DGRAM_LOG_FILE, value);
+    return;
+  }
+
+  /* xApMon_latency_histograms = on | off */
+  if (strcmp(param, "latency_histograms") == 0) {
+    setLatencyHistograms(strcmp(value, "on") == 0);
+    return;
+  }
+  /* xApMon_latency_dump = off | stderr | <file> (written on SIGUSR1) */
+  if (strcmp(param, "latency_dump") == 0) {
+    if (strcmp(value, "off") == 0)
+      setLatencyDumpSignal(false);
+    else
+      setLatencyDumpSignal(true, value);
+    return;
+  }
+
+  /* the log output is global */
+  if (strcmp(param, "log_file") == 0) {
+    setLogFile(value);
+    return;
+  }
+  if (strcmp(param, "async_log") == 0) {
+    setAsyncLogging(strcmp(value, "on") == 0);
+    return;
+  }
+
   /* if it is an on/off parameter, assign its value to flag */
   if (strcmp(value, "on") == 0)
     flag = true;
@@ -833,7 +1018,52 @@ void ApMon::parseXApMonLine(char *line) {
     found = true;
   }
   if (strcmp(param, "maxMsgRate") == 0) {
-    this -> maxMsgRate = atoi(value);
+    setMaxMsgRate(atoi(value));
+    found = true;
+  }
+  if (strcmp(param, "connected_sockets") == 0) {
+    this -> connectedSockets = flag;
+    found = true;
+  }
+  if (strcmp(param, "async_send") == 0) {
+    this -> asyncSend = flag;
+    found = true;
+  }
+  if (strcmp(param, "async_queue_size") == 0) {
+    this -> asyncQueueSize = atoi(value);
+    found = true;
+  }
+  if (strcmp(param, "async_overflow") == 0) {
+    if (strcmp(value, "drop_oldest") == 0)
+      this -> asyncOverflowPolicy = ASYNC_DROP_OLDEST;
+    else if (strcmp(value, "block") == 0)
+      this -> asyncOverflowPolicy = ASYNC_BLOCK;
+    else
+      this -> asyncOverflowPolicy = ASYNC_DROP_NEWEST;
+    found = true;
+  }
+  if (strcmp(param, "coalesce") == 0) {
+    this -> coalesce = flag;
+    found = true;
+  }
+  if (strcmp(param, "coalesce_interval") == 0) {
+    this -> coalesceInterval = atol(value);
+    found = true;
+  }
+  if (strcmp(param, "aggregate") == 0) {
+    this -> aggregate = flag;
+    found = true;
+  }
+  if (strcmp(param, "aggregate_interval") == 0) {
+    this -> aggregateInterval = atol(value);
+    found = true;
+  }
+  if (strcmp(param, "self_stats") == 0) {
+    this -> selfStats = flag;
+    found = true;
+  }
+  if (strcmp(param, "self_stats_interval") == 0) {
+    this -> selfStatsInterval = atol(value);
     found = true;
   }
 
@@ -46,6 +46,28 @@
 
 using namespace apmon_utils;
 
+/** Sets the value of a counter and returns its increase since the previous
+ * sample. */
+static double counterDelta(RateCounter& counter, double value, 
+			   long long now) {
+  double delta = 0;
+
+  counter.set(value);
+  counter.sample(now, &delta, NULL);
+  return delta;
+}
+
+/** Sets the value of a counter and returns its rate since the previous 
+ * sample (0 if it cannot be computed). */
+static double counterRate(RateCounter& counter, double value, 
+			  long long now) {
+  double rate = 0;
+
+  counter.set(value);
+  counter.rate(now, &rate);
+  return rate;
+}
+
 void ProcUtils::getCPUUsage(ApMon& apm, double& cpuUsage, 
 			       double& cpuUsr, double& cpuSys, 
 			       double& cpuNice, double& cpuIdle,
@@ -69,6 +91,9 @@ void ProcUtils::getCPUUsage(ApMon& apm, double& cpuUsage,
     stealTime = RET_ERROR , 
     guestTime = RET_ERROR, 
     totalTime = 0 ;
+  double dUsr, dSys, dNice = 0, dIdle, dIOWait, dIRQ = 0, dSoftIRQ = 0, 
+    dSteal = 0, dGuest = 0;
+  long long now;
     
   int indU, indS, indN, indI, indIOWAIT, indIRQ, indSOFTIRQ, indSTEAL, indGUEST;
 
@@ -128,70 +153,49 @@ void ProcUtils::getCPUUsage(ApMon& apm, double& cpuUsage,
   indSTEAL   = getVectIndex("cpu_steal"  , apm.sysMonitorParams, apm.nSysMonitorParams);
   indGUEST   = getVectIndex("cpu_guest"  , apm.sysMonitorParams, apm.nSysMonitorParams);
 
-  if (idleTime < apm.lastSysVals[indI]) {
-    apm.lastSysVals[indU] = usrTime;
-    apm.lastSysVals[indS] = sysTime;
-    apm.lastSysVals[indI] = idleTime;
-    apm.lastSysVals[indIOWAIT] = iowaitTime;
-#ifndef __SUNOS
-    apm.lastSysVals[indN] = niceTime;
-    apm.lastSysVals[indIRQ] = irqTime;
-    apm.lastSysVals[indSOFTIRQ] = softirqTime;
-    apm.lastSysVals[indSTEAL] = stealTime;
-    apm.lastSysVals[indGUEST] = guestTime;
-#endif
-
-    return;
-  }
-
   if (numCPUs == 0)
     return;
 
   //printf("### crtTime %ld lastSysInfo %ld\n", crtTime, apm.lastSysInfoSend);  
   if (crtTime <= apm.lastSysInfoSend)
     return;
-  
-  totalTime = (usrTime - apm.lastSysVals[indU]) + 
-    (sysTime -apm.lastSysVals[indS]) +
-    (idleTime - apm.lastSysVals[indI]) +
-    (iowaitTime - apm.lastSysVals[indIOWAIT])
+
+  /* the times since the previous datagram (the counters take care of the
+     wraps and the resets) */
+  now = getMonotonicTime();
+  dUsr     = counterDelta(apm.sysCounters[indU]     , usrTime    , now);
+  dSys     = counterDelta(apm.sysCounters[indS]     , sysTime    , now);
+  dIdle    = counterDelta(apm.sysCounters[indI]     , idleTime   , now);
+  dIOWait  = counterDelta(apm.sysCounters[indIOWAIT], iowaitTime , now);
 #ifndef __SUNOS
-    + (niceTime - apm.lastSysVals[indN])
-    + (irqTime - apm.lastSysVals[indIRQ])
-    + (softirqTime - apm.lastSysVals[indSOFTIRQ])
-    + (stealTime - apm.lastSysVals[indSTEAL])
-    + (guestTime - apm.lastSysVals[indGUEST])
+  dNice    = counterDelta(apm.sysCounters[indN]      , niceTime   , now);
+  dIRQ     = counterDelta(apm.sysCounters[indIRQ]    , irqTime    , now);
+  dSoftIRQ = counterDelta(apm.sysCounters[indSOFTIRQ], softirqTime, now);
+  dSteal   = counterDelta(apm.sysCounters[indSTEAL]  , stealTime  , now);
+  dGuest   = counterDelta(apm.sysCounters[indGUEST]  , guestTime  , now);
 #endif
-    ;
 
-  cpuUsr     = 100 * (usrTime     - apm.lastSysVals[indU]      ) / totalTime;
-  cpuSys     = 100 * (sysTime     - apm.lastSysVals[indS]      ) / totalTime;
-  cpuIdle    = 100 * (idleTime    - apm.lastSysVals[indI]      ) / totalTime;
-  cpuIOWait  = 100 * (iowaitTime  - apm.lastSysVals[indIOWAIT] ) / totalTime;
+  totalTime = dUsr + dSys + dIdle + dIOWait + dNice + dIRQ + dSoftIRQ + 
+    dSteal + dGuest;
+  if (totalTime <= 0)
+    return;
+
+  cpuUsr     = 100 * dUsr     / totalTime;
+  cpuSys     = 100 * dSys     / totalTime;
+  cpuIdle    = 100 * dIdle    / totalTime;
+  cpuIOWait  = 100 * dIOWait  / totalTime;
 
 #ifndef __SUNOS
-  cpuNice    = 100 * (niceTime    - apm.lastSysVals[indN]      ) / totalTime;
-  cpuIRQ     = 100 * (irqTime     - apm.lastSysVals[indIRQ]    ) / totalTime;
-  cpuSoftIRQ = 100 * (softirqTime - apm.lastSysVals[indSOFTIRQ]) / totalTime;
-  cpuSteal   = 100 * (stealTime   - apm.lastSysVals[indSTEAL]  ) / totalTime;
-  cpuGuest   = 100 * (guestTime   - apm.lastSysVals[indGUEST]  ) / totalTime;
+  cpuNice    = 100 * dNice    / totalTime;
+  cpuIRQ     = 100 * dIRQ     / totalTime;
+  cpuSoftIRQ = 100 * dSoftIRQ / totalTime;
+  cpuSteal   = 100 * dSteal   / totalTime;
+  cpuGuest   = 100 * dGuest   / totalTime;
 #else
   cpuNice = cpuIRQ = cpuSoftIRQ = cpuSteal = cpuGuest = RET_ERROR;
 #endif
 
-  cpuUsage   = 100 * (totalTime - (idleTime - apm.lastSysVals[indI])) / totalTime;
-
-  apm.lastSysVals[indU]       = usrTime;
-  apm.lastSysVals[indI]       = idleTime;
-  apm.lastSysVals[indS]       = sysTime;
-  apm.lastSysVals[indIOWAIT]  = iowaitTime;
-#ifndef __SUNOS
-  apm.lastSysVals[indN]       = niceTime;
-  apm.lastSysVals[indIRQ]     = irqTime;
-  apm.lastSysVals[indSOFTIRQ] = softirqTime;
-  apm.lastSysVals[indSTEAL]   = stealTime;
-  apm.lastSysVals[indGUEST]   = guestTime;
-#endif
+  cpuUsage   = 100 * (totalTime - dIdle) / totalTime;
 
 #endif
 }
@@ -208,6 +212,7 @@ void ProcUtils::getSwapPages(ApMon& apm, double& pagesIn,
   int ind1, ind2;
 
   time_t crtTime = time(NULL);
+  long long now = getMonotonicTime();
 
   foundPages = foundSwap = false;
 
@@ -236,15 +241,13 @@ void ProcUtils::getSwapPages(ApMon& apm, double& pagesIn,
 				if (strcmp(w3, "in")==0){
 					index = getVectIndex("swap_in", apm.sysMonitorParams, apm.nSysMonitorParams);
 					foundSwap = true;
-					if (tmp >= apm.lastSysVals[index])
-						swapIn = (tmp - apm.lastSysVals[index]) / (crtTime - apm.lastSysInfoSend);
+					swapIn = counterRate(apm.sysCounters[index], tmp, now);
 				}
 				else
 				if (strcmp(w3, "out")==0){
 					foundSwap = true;
 					index = getVectIndex("swap_out", apm.sysMonitorParams, apm.nSysMonitorParams);
-					if (tmp >= apm.lastSysVals[index])
-						swapOut = (tmp - apm.lastSysVals[index]) / (crtTime - apm.lastSysInfoSend);
+					swapOut = counterRate(apm.sysCounters[index], tmp, now);
 				}
 			}
 			else
@@ -252,22 +255,17 @@ void ProcUtils::getSwapPages(ApMon& apm, double& pagesIn,
 				if (strcmp(w3, "in")==0){
 					foundPages = true;
 					index = getVectIndex("pages_in", apm.sysMonitorParams, apm.nSysMonitorParams);
-					if (tmp >= apm.lastSysVals[index])
-						pagesIn = (tmp - apm.lastSysVals[index]) / (crtTime - apm.lastSysInfoSend);
+					pagesIn = counterRate(apm.sysCounters[index], tmp, now);
 				}
 				else
 				if (strcmp(w3, "out")==0){
 					foundPages = true;
 					index = getVectIndex("pages_out", apm.sysMonitorParams, apm.nSysMonitorParams);
-					if (tmp >= apm.lastSysVals[index])
-						pagesOut = (tmp - apm.lastSysVals[index]) / (crtTime - apm.lastSysInfoSend);
+					pagesOut = counterRate(apm.sysCounters[index], tmp, now);
 
 				}
 			}
 		}
-
-		if (index>=0)
-			apm.lastSysVals[index] = tmp;
 	}
 	
 	pclose(fp1);
@@ -286,15 +284,8 @@ void ProcUtils::getSwapPages(ApMon& apm, double& pagesIn,
 
       ind1 = getVectIndex("pages_in", apm.sysMonitorParams, apm.nSysMonitorParams);
       ind2 = getVectIndex("pages_out", apm.sysMonitorParams, apm.nSysMonitorParams);
-      if (p_in < apm.lastSysVals[ind1] || p_out < apm.lastSysVals[ind2]) {
-	apm.lastSysVals[ind1] = p_in;
-	apm.lastSysVals[ind2] = p_out;
-	return;
-      }
-      pagesIn = (p_in - apm.lastSysVals[ind1]) / (crtTime - apm.lastSysInfoSend);
-      pagesOut = (p_out - apm.lastSysVals[ind2]) / (crtTime - apm.lastSysInfoSend);
-      apm.lastSysVals[ind1] = p_in;
-      apm.lastSysVals[ind2] = p_out;
+      pagesIn = counterRate(apm.sysCounters[ind1], p_in, now);
+      pagesOut = counterRate(apm.sysCounters[ind2], p_out, now);
 
     }
 
@@ -304,15 +295,8 @@ void ProcUtils::getSwapPages(ApMon& apm, double& pagesIn,
 
       ind1 = getVectIndex("swap_in", apm.sysMonitorParams, apm.nSysMonitorParams);
       ind2 = getVectIndex("swap_out", apm.sysMonitorParams, apm.nSysMonitorParams);
-      if (s_in < apm.lastSysVals[ind1] || s_out < apm.lastSysVals[ind2]) {
-	apm.lastSysVals[ind1] = s_in;
-	apm.lastSysVals[ind2] = s_out;
-	return;
-      }
-      swapIn = (s_in - apm.lastSysVals[ind1]) / (crtTime - apm.lastSysInfoSend);
-      swapOut = (s_out - apm.lastSysVals[ind2]) / (crtTime - apm.lastSysInfoSend);
-      apm.lastSysVals[ind1] = s_in;
-      apm.lastSysVals[ind2] = s_out;
+      swapIn = counterRate(apm.sysCounters[ind1], s_in, now);
+      swapOut = counterRate(apm.sysCounters[ind2], s_out, now);
 
     }
   }
@@ -747,20 +731,11 @@ void ProcUtils::getNetInfo(ApMon& apm, double **vNetIn,
 //  char buf[MAX_STRING_LEN];
 //  char *pbuf = buf;
   char *tmp, *tok;
-  double bootTime = 0;
   FILE *fp1;
   time_t crtTime = time(NULL);
+  long long now = getMonotonicTime();
   int ind, i;
 
-  if (apm.lastSysInfoSend == 0) {
-    try {
-      bootTime = getBootTime();
-    } catch (procutils_error& err) {
-      logger(WARNING, "[ getNetInfo() ] Error obtaining boot time. The first system monitoring datagram will contain incorrect data.");
-      bootTime = 0;
-    }
-  }
-
   if (crtTime <= apm.lastSysInfoSend)
     return;
 
@@ -861,37 +836,14 @@ void ProcUtils::getNetInfo(ApMon& apm, double **vNetIn,
     errs += atoi(tok);
 #endif
 
-    //printf("### bytesReceived %lf lastRecv %lf\n", bytesReceived, 
-    // apm.lastBytesReceived[ind]); 
-    if (bytesReceived < apm.lastBytesReceived[ind] || bytesSent < 
-	apm.lastBytesSent[ind] || errs < apm.lastNetErrs[ind]) {
-      apm.lastBytesReceived[ind] = bytesReceived;
-      apm.lastBytesSent[ind] = bytesSent;
-      apm.lastNetErrs[ind] = errs;
-      fclose(fp1);
-      free(netIn); free(netOut); free(netErrs);
-      return;
-    }
-
-    if (apm.lastSysInfoSend == 0) {
-      netIn[ind] = bytesReceived/(crtTime - bootTime);
-      netOut[ind] = bytesSent/(crtTime - bootTime);
-      netErrs[ind] = errs;
-    }
-    else {
-      netIn[ind] = (bytesReceived - apm.lastBytesReceived[ind]) / (crtTime -
-						     apm.lastSysInfoSend);
-      netIn[ind] /= 1024; /* netIn is measured in KBps */
-      netOut[ind] = (bytesSent - apm.lastBytesSent[ind]) / (crtTime - 
-						     apm.lastSysInfoSend);
-      netOut[ind] /= 1024; /* netOut is measured in KBps */
-      /* for network errors give the total number */
-      netErrs[ind] = errs; // - apm.lastNetErrs[ind];
-    }
-
-    apm.lastBytesReceived[ind] = bytesReceived;
-    apm.lastBytesSent[ind] = bytesSent;
-    apm.lastNetErrs[ind] = errs;
+    /* the rates since the previous datagram (the counters take care of 
+       the wraps and the resets) */
+    netIn[ind] = counterRate(apm.netInCounters[ind], bytesReceived, now);
+    netIn[ind] /= 1024; /* netIn is measured in KBps */
+    netOut[ind] = counterRate(apm.netOutCounters[ind], bytesSent, now);
+    netOut[ind] /= 1024; /* netOut is measured in KBps */
+    /* for network errors give the total number */
+    netErrs[ind] = errs;
 
 #ifndef __SUNOS
   }
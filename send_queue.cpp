@@ -0,0 +1,194 @@
+/**
+ * \file send_queue.cpp
+ * This file contains the implementation of the SendQueue class.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "send_queue.h"
+
+#ifndef WIN32
+
+SendQueue::SendQueue(int size) {
+  unsigned long i;
+
+  /* the number of slots must be a power of two */
+  capacity = 2;
+  while (capacity < (unsigned long)size)
+    capacity <<= 1;
+
+  slots = (SendQueueSlot *)malloc(capacity * sizeof(SendQueueSlot));
+  if (slots == NULL)
+    throw runtime_error("[ SendQueue() ] Cannot allocate the send queue");
+
+  for (i = 0; i < capacity; i++)
+    slots[i].seq = i;
+  enqPos = deqPos = 0;
+
+  consumerWaiting = 0;
+  producersWaiting = 0;
+  pthread_mutex_init(&mutexWait, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+  pthread_cond_init(&notFull, NULL);
+}
+
+SendQueue::~SendQueue() {
+  pthread_mutex_destroy(&mutexWait);
+  pthread_cond_destroy(&notEmpty);
+  pthread_cond_destroy(&notFull);
+  free(slots);
+}
+
+SendQueueSlot *SendQueue::claim() {
+  SendQueueSlot *slot;
+  unsigned long pos = enqPos;
+  long dif;
+
+  while (1) {
+    slot = &slots[pos & (capacity - 1)];
+    dif = (long)(slot -> seq - pos);
+    if (dif == 0) {
+      /* the slot is free, try to claim it */
+      if (APMON_ATOMIC_CAS(&enqPos, pos, pos + 1))
+	break;
+      pos = enqPos;
+    } else if (dif < 0) {
+      /* the slot still holds a datagram from the previous round */
+      return NULL;
+    } else {
+      /* another producer claimed the slot */
+      pos = enqPos;
+    }
+  }
+
+  slot -> pos = pos;
+  return slot;
+}
+
+void SendQueue::publish(SendQueueSlot *slot, int len) {
+  slot -> len = len;
+  APMON_MEMORY_BARRIER();
+  slot -> seq = slot -> pos + 1;
+}
+
+SendQueueSlot *SendQueue::take() {
+  SendQueueSlot *slot;
+  unsigned long pos = deqPos;
+  long dif;
+
+  while (1) {
+    slot = &slots[pos & (capacity - 1)];
+    dif = (long)(slot -> seq - (pos + 1));
+    if (dif == 0) {
+      /* the slot was published; the producers that drop the oldest 
+	 datagrams may take it too */
+      if (APMON_ATOMIC_CAS(&deqPos, pos, pos + 1))
+	break;
+      pos = deqPos;
+    } else if (dif < 0) {
+      /* empty queue, or the oldest slot is not published yet */
+      return NULL;
+    } else {
+      pos = deqPos;
+    }
+  }
+
+  APMON_MEMORY_BARRIER();
+  slot -> pos = pos;
+  return slot;
+}
+
+void SendQueue::release(SendQueueSlot *slot) {
+  APMON_MEMORY_BARRIER();
+  slot -> seq = slot -> pos + capacity;
+}
+
+/* Computes the absolute time for pthread_cond_timedwait() */
+static void deadline(struct timespec *ts, int timeoutMillis) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  ts -> tv_sec = now.tv_sec + timeoutMillis / 1000;
+  ts -> tv_nsec = now.tv_usec * 1000 + (timeoutMillis % 1000) * 1000000L;
+  if (ts -> tv_nsec >= 1000000000L) {
+    ts -> tv_sec++;
+    ts -> tv_nsec -= 1000000000L;
+  }
+}
+
+void SendQueue::waitNotEmpty(int timeoutMillis) {
+  struct timespec ts;
+  SendQueueSlot *slot;
+
+  deadline(&ts, timeoutMillis);
+  pthread_mutex_lock(&mutexWait);
+  consumerWaiting = 1;
+  APMON_MEMORY_BARRIER();
+  /* check again, a datagram may have been published before the flag was
+     set (in this case the producer didn't signal) */
+  slot = &slots[deqPos & (capacity - 1)];
+  if ((long)(slot -> seq - (deqPos + 1)) < 0)
+    pthread_cond_timedwait(&notEmpty, &mutexWait, &ts);
+  consumerWaiting = 0;
+  pthread_mutex_unlock(&mutexWait);
+}
+
+void SendQueue::waitNotFull(int timeoutMillis) {
+  struct timespec ts;
+
+  deadline(&ts, timeoutMillis);
+  pthread_mutex_lock(&mutexWait);
+  producersWaiting++;
+  pthread_cond_timedwait(&notFull, &mutexWait, &ts);
+  producersWaiting--;
+  pthread_mutex_unlock(&mutexWait);
+}
+
+void SendQueue::notifyProducers() {
+  APMON_MEMORY_BARRIER();
+  if (producersWaiting > 0) {
+    pthread_mutex_lock(&mutexWait);
+    pthread_cond_broadcast(&notFull);
+    pthread_mutex_unlock(&mutexWait);
+  }
+}
+
+void SendQueue::notifyConsumer() {
+  APMON_MEMORY_BARRIER();
+  if (consumerWaiting) {
+    pthread_mutex_lock(&mutexWait);
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutexWait);
+  }
+}
+
+#endif // ~WIN32
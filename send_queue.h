@@ -0,0 +1,156 @@
+/**
+ * \file send_queue.h
+ * Declarations for the SendQueue class, a bounded lock-free queue of 
+ * encoded datagrams which is used when ApMon sends the datagrams 
+ * asynchronously, from a dedicated thread.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_send_queue_h
+#define apmon_send_queue_h
+
+#include "ApMon.h"
+
+#ifndef WIN32
+
+/**
+ * A slot of the queue, which holds an encoded datagram body.
+ */
+typedef struct SendQueueSlot {
+  /** Sequence number used to synchronize the producers and the consumers. */
+  volatile unsigned long seq;
+  /** The position of the slot in the queue when it was claimed. */
+  unsigned long pos;
+  /** The length of the encoded body, or 0 if the slot doesn't hold a 
+   * datagram (the datagram was not sent, e.g. because of the rate limit). */
+  int len;
+  /** The encoded body of the datagram. */
+  char data[MAX_DGRAM_SIZE];
+} SendQueueSlot;
+
+/**
+ * Bounded queue with multiple producers (the threads which call the 
+ * sendParameter() functions) and one consumer (the sender thread). The
+ * datagrams are encoded directly in the slots of the queue. The claim/take 
+ * operations don't use locks: each slot has a sequence number which tells 
+ * if the slot is free, claimed by a producer or ready to be sent (see
+ * D. Vyukov, "Bounded MPMC queue"). Locks are used only to put to sleep
+ * the consumer when the queue is empty, or the producers when the queue is 
+ * full and they choose to wait.
+ */
+class SendQueue {
+ protected:
+  /** The slots of the queue. */
+  SendQueueSlot *slots;
+  /** The number of slots (a power of two). */
+  unsigned long capacity;
+  /** The position where the next datagram will be added. */
+  volatile unsigned long enqPos;
+  /** The position from where the next datagram will be taken. */
+  volatile unsigned long deqPos;
+
+  /** Used together with the condition variables below. */
+  pthread_mutex_t mutexWait;
+  /** Signaled when datagrams are added to the queue. */
+  pthread_cond_t notEmpty;
+  /** Signaled when slots are released. */
+  pthread_cond_t notFull;
+  /** True if the consumer sleeps (waiting for datagrams). */
+  volatile int consumerWaiting;
+  /** The number of producers which wait for free slots. */
+  volatile int producersWaiting;
+
+ private:
+  SendQueue(const SendQueue&);	// Not implemented
+  SendQueue& operator=(const SendQueue&);	// Not implemented
+
+ public:
+  /**
+   * Creates a queue.
+   * @param size The number of slots, rounded up to a power of two.
+   */
+  SendQueue(int size);
+
+  ~SendQueue();
+
+  /** Returns the number of slots of the queue. */
+  int getCapacity() { return (int)capacity; }
+
+  /**
+   * Claims a free slot, where a producer can encode a datagram.
+   * The slot must be published afterwards with publish().
+   * @return The slot or NULL if the queue is full.
+   */
+  SendQueueSlot *claim();
+
+  /**
+   * Makes a claimed slot available to the consumer.
+   * @param slot The slot.
+   * @param len The length of the datagram from the slot (0 if the slot
+   * doesn't contain a datagram).
+   */
+  void publish(SendQueueSlot *slot, int len);
+
+  /**
+   * Takes the oldest datagram from the queue. The slot must be released
+   * with release() after the datagram is sent.
+   * @return The slot or NULL if the queue is empty (or if the oldest slot 
+   * was claimed but not published yet).
+   */
+  SendQueueSlot *take();
+
+  /** Releases a slot obtained with take(), so that it can be reused. */
+  void release(SendQueueSlot *slot);
+
+  /**
+   * Waits until datagrams are published or until the timeout expires.
+   * Called by the consumer when take() returned NULL.
+   */
+  void waitNotEmpty(int timeoutMillis);
+
+  /**
+   * Waits until slots are released or until the timeout expires.
+   * Called by the producers when claim() returned NULL.
+   */
+  void waitNotFull(int timeoutMillis);
+
+  /** Wakes up the producers that wait for free slots, if there are any. */
+  void notifyProducers();
+
+  /** Wakes up the consumer, if it waits for datagrams. */
+  void notifyConsumer();
+};
+
+#endif // ~WIN32
+
+#endif
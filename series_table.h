@@ -0,0 +1,257 @@
+/**
+ * \file series_table.h
+ * Declarations for the SeriesTable class template, the hash table of the
+ * series identified by a cluster name, a node name and a parameter name.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_series_table_h
+#define apmon_series_table_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+/** The initial number of slots of a series table. */
+#define SERIES_INITIAL_CAPACITY 64
+
+/** FNV-1a hash of the key of a series (never 0, which marks the empty
+ * slots of a SeriesTable). */
+inline unsigned int hashSeriesKey(const char *clusterName, 
+				  const char *nodeName,
+				  const char *paramName) {
+  const char *keys[3];
+  const unsigned char *p;
+  unsigned int h = 2166136261U;
+  int i;
+
+  keys[0] = clusterName; keys[1] = nodeName; keys[2] = paramName;
+  for (i = 0; i < 3; i++) {
+    for (p = (const unsigned char *)keys[i]; *p != 0; p++) {
+      h ^= *p;
+      h *= 16777619U;
+    }
+    /* separate the strings, so that ("ab", "c") differs from ("a", "bc") */
+    h *= 16777619U;
+  }
+  return (h != 0) ? h : 1;
+}
+
+/**
+ * Hash table with the series identified by the cluster name, the node 
+ * name and the parameter name, used for the aggregated series, for the
+ * counters and for the deadbands. The table uses open addressing with 
+ * linear probing: the hashes of the keys are kept in a separate compact 
+ * array, so that a lookup touches a single series. The table is kept at 
+ * most 3/4 full and it is not thread safe.
+ *
+ * The type T must be a plain structure with the char * members 
+ * clusterName, nodeName and paramName, which are copied by the table when
+ * a series is created and freed with it; the other members are 
+ * initialized and freed by the owner of the table.
+ */
+template <class T> class SeriesTable {
+ protected:
+  /** The hashes of the keys from each slot (0 for the empty slots). */
+  unsigned int *hashes;
+  /** The series from each slot. */
+  T *series;
+  /** The number of slots (a power of two). */
+  unsigned long capacity;
+  /** The number of series in the table. */
+  unsigned long nSeries;
+  /** The maximum number of series in the table. */
+  unsigned long maxSeries;
+
+ private:
+  SeriesTable(const SeriesTable&);	// Not implemented
+  SeriesTable& operator=(const SeriesTable&);	// Not implemented
+
+ public:
+  /**
+   * Creates an empty table.
+   * @param maxSeries The maximum number of series which can be kept in
+   * the table.
+   */
+  SeriesTable(int maxSeries) {
+    capacity = SERIES_INITIAL_CAPACITY;
+    nSeries = 0;
+    this -> maxSeries = (maxSeries > 0) ? maxSeries : 1;
+
+    hashes = (unsigned int *)calloc(capacity, sizeof(unsigned int));
+    series = (T *)malloc(capacity * sizeof(T));
+    if (hashes == NULL || series == NULL) {
+      free(hashes);
+      free(series);
+      throw std::runtime_error("[ SeriesTable() ] Cannot allocate the table");
+    }
+  }
+
+  /** Frees the names of the series and the slots. */
+  ~SeriesTable() {
+    clear();
+    free(hashes);
+    free(series);
+  }
+
+  /** Returns the number of series from the table. */
+  int getNumSeries() { return (int)nSeries; }
+
+  /** Returns the number of slots. */
+  unsigned long getCapacity() { return capacity; }
+
+  /** Returns the series from a slot (NULL if the slot is empty). */
+  T *getSlot(unsigned long i) { 
+    return (hashes[i] != 0) ? &series[i] : NULL; 
+  }
+
+  /**
+   * Finds a series, creating it if it doesn't exist. Only the names of a 
+   * created series are set.
+   * @param created Output parameter, set to true if the series was 
+   * created.
+   * @return The series or NULL if it could not be created (the table is 
+   * full or there is not enough memory).
+   */
+  T *lookup(const char *clusterName, const char *nodeName, 
+	    const char *paramName, bool *created) {
+    unsigned int h;
+    unsigned long i, mask;
+    T *s;
+
+    *created = false;
+    h = hashSeriesKey(clusterName, nodeName, paramName);
+    mask = capacity - 1;
+    for (i = h & mask; hashes[i] != 0; i = (i + 1) & mask) {
+      s = &series[i];
+      if (hashes[i] == h && strcmp(s -> paramName, paramName) == 0 &&
+	  strcmp(s -> clusterName, clusterName) == 0 &&
+	  strcmp(s -> nodeName, nodeName) == 0)
+	return s;
+    }
+
+    /* a new series; the table is kept at most 3/4 full */
+    if (nSeries >= maxSeries)
+      return NULL;
+    if ((nSeries + 1) * 4 > capacity * 3) {
+      if (!rehash(capacity * 2, NULL))
+	return NULL;
+      mask = capacity - 1;
+      for (i = h & mask; hashes[i] != 0; i = (i + 1) & mask)
+	;
+    }
+
+    s = &series[i];
+    s -> clusterName = strdup(clusterName);
+    s -> nodeName = strdup(nodeName);
+    s -> paramName = strdup(paramName);
+    if (s -> clusterName == NULL || s -> nodeName == NULL || 
+	s -> paramName == NULL) {
+      free(s -> clusterName);
+      free(s -> nodeName);
+      free(s -> paramName);
+      return NULL;
+    }
+    hashes[i] = h;
+    nSeries++;
+    *created = true;
+    return s;
+  }
+
+  /**
+   * Moves the series to new arrays of slots.
+   * @param newCapacity The number of slots of the new arrays (a power of
+   * two).
+   * @param drop If it is not NULL, it is called for each series; if it
+   * returns true, the series is removed from the table (the function 
+   * must free the members of the series other than the names).
+   * @return false if the arrays could not be allocated (the table is not
+   * changed).
+   */
+  bool rehash(unsigned long newCapacity, bool (*drop)(T *)) {
+    unsigned int *newHashes;
+    T *newSeries, *s;
+    unsigned long i, j, mask;
+
+    newHashes = (unsigned int *)calloc(newCapacity, sizeof(unsigned int));
+    newSeries = (T *)malloc(newCapacity * sizeof(T));
+    if (newHashes == NULL || newSeries == NULL) {
+      free(newHashes);
+      free(newSeries);
+      return false;
+    }
+
+    mask = newCapacity - 1;
+    for (i = 0; i < capacity; i++) {
+      if (hashes[i] == 0)
+	continue;
+      s = &series[i];
+      if (drop != NULL && drop(s)) {
+	free(s -> clusterName);
+	free(s -> nodeName);
+	free(s -> paramName);
+	nSeries--;
+	continue;
+      }
+      for (j = hashes[i] & mask; newHashes[j] != 0; j = (j + 1) & mask)
+	;
+      newHashes[j] = hashes[i];
+      newSeries[j] = *s;
+    }
+
+    free(hashes);
+    free(series);
+    hashes = newHashes;
+    series = newSeries;
+    capacity = newCapacity;
+    return true;
+  }
+
+  /** Removes all the series, freeing their names (the owner must free 
+   * their other members first). */
+  void clear() {
+    unsigned long i;
+
+    for (i = 0; i < capacity; i++) {
+      if (hashes[i] == 0)
+	continue;
+      free(series[i].clusterName);
+      free(series[i].nodeName);
+      free(series[i].paramName);
+      hashes[i] = 0;
+    }
+    nSeries = 0;
+  }
+};
+
+#endif
@@ -36,6 +36,7 @@
 
 #include "ApMon.h"
 #include "utils.h"
+#include <math.h>
 
 bool apmon_utils::urlModified(char *url, char *lastModified) {
   char temp_filename[300]; 
@@ -423,6 +424,8 @@ void apmon_utils::logParameters(int level, int nParams, char **paramNames,
 
   int remaining = MAX_STRING_LEN-1;
 
+  if (!isLoggable(level))
+    return;
   for (i = 0; i < nParams; i++) {
     if (paramNames[i] == NULL || (valueTypes[i] == XDR_STRING &&
 				  paramValues[i] == NULL))
@@ -444,7 +447,7 @@ void apmon_utils::logParameters(int level, int nParams, char **paramNames,
       break;  
     }
     
-    strncat(logmsg, val,remaining);
+    strncat(logmsg, val, MAX_STRING_LEN - 1 - strlen(logmsg));
     logger(level, logmsg);
     
     remaining -= strlen(val);
@@ -488,29 +491,73 @@ int apmon_utils::getVectIndex(const char *item, char **vect, int vectDim) {
   return -1;
 }
   
-void apmon_utils::logger(int msgLevel, const char *msg, int newLevel) {
-  char time_s[30];
-  int len;
-  long crtTime = time(NULL);
-  const char * const levels[5] = {"FATAL", "WARNING", "INFO", "FINE", "DEBUG"};
-  static int loglevel = INFO;
+long long apmon_utils::getMonotonicTime() {
 #ifndef WIN32
-  static pthread_mutex_t logger_mutex;
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
 #else
-  static HANDLE logger_mutex;
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (long long)(count.QuadPart / freq.QuadPart) * 1000000000LL +
+    (long long)(count.QuadPart % freq.QuadPart) * 1000000000LL / 
+    freq.QuadPart;
 #endif
-  static bool firstTime = true;
+}
+
+int apmon_utils::quantileBucket(const unsigned int *counts, int nBuckets,
+				long count, double q) {
+  long rank, n = 0;
+  int b;
+
+  rank = (long)ceil(q * count);
+  if (rank < 1)
+    rank = 1;
+  if (rank > count)
+    rank = count;
+  for (b = 0; b < nBuckets - 1; b++) {
+    n += counts[b];
+    if (n >= rank)
+      break;
+  }
+  return b;
+}
+
+/** The current logging level. */
+static volatile int loglevel = INFO;
+
+static const char * const levelNames[5] = {"FATAL", "WARNING", "INFO", 
+					   "FINE", "DEBUG"};
 
-  if (firstTime) {
+/** The file in which the messages are written (NULL for stdout). */
+static FILE *logFile = NULL;
+
+/** Lock for the writing of the messages (it is not taken by the threads
+    which log asynchronously). */
 #ifndef WIN32
-    pthread_mutex_init(&logger_mutex, NULL);
+static pthread_mutex_t logger_mutex = PTHREAD_MUTEX_INITIALIZER;
 #else
-	logger_mutex = CreateMutex(NULL, FALSE, NULL);
+static HANDLE logger_mutex = CreateMutex(NULL, FALSE, NULL);
 #endif
-    firstTime = false;
-  }
 
-  pthread_mutex_lock(&logger_mutex);
+bool apmon_utils::isLoggable(int msgLevel) {
+  return msgLevel <= loglevel;
+}
+
+/* Writes a message with the time given; logger_mutex must be locked. */
+static void writeLogMessage(time_t crtTime, const char *level, 
+			    const char *msg) {
+  char time_s[30];
+  int len;
 
 #ifndef WIN32
   char cbuf[50];
@@ -518,19 +565,257 @@ void apmon_utils::logger(int msgLevel, const char *msg, int newLevel) {
 #else
   strncpy(time_s, ctime(&crtTime), 29);
 #endif
-
+  time_s[29] = 0;
   len = strlen(time_s); time_s[len - 1] = 0;
 
+  if (level != NULL)
+    fprintf(logFile != NULL ? logFile : stdout, "[%s] [%s] %s\n", time_s, 
+	    level, msg);
+  else
+    fprintf(logFile != NULL ? logFile : stdout, "[%s] %s\n", time_s, msg);
+}
+
+#ifndef WIN32
+/** A message in the ring buffer of the asynchronous logging. */
+typedef struct LogSlot {
+  /** Sequence number, as in SendQueue (the slot is free when it is equal
+   * to the position, and published when it is equal to the position + 1).
+   */
+  volatile unsigned long seq;
+  int level;
+  time_t time;
+  char msg[MAX_STRING_LEN];
+} LogSlot;
+
+/** The ring buffer (allocated when the asynchronous logging is first 
+    enabled and never freed, because other threads may still use it). */
+static LogSlot *logRing = NULL;
+static volatile unsigned long logEnqPos = 0;
+static unsigned long logDeqPos = 0;
+/** True if the messages are put in the ring buffer. */
+static volatile int logAsync = 0;
+static volatile long logDropped = 0;
+static long logDroppedReported = 0;
+
+static pthread_t logWriterThread;
+static volatile int logWriterWaiting = 0;
+static pthread_mutex_t logWaitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logNotEmpty = PTHREAD_COND_INITIALIZER;
+
+/* Puts a message in the ring buffer; returns false if it is full. */
+static bool enqueueLogMessage(int level, const char *msg) {
+  LogSlot *slot;
+  unsigned long pos = logEnqPos;
+  long dif;
+
+  while (1) {
+    slot = &logRing[pos & (LOG_RING_SIZE - 1)];
+    dif = (long)(slot -> seq - pos);
+    if (dif == 0) {
+      if (APMON_ATOMIC_CAS(&logEnqPos, pos, pos + 1))
+	break;
+      pos = logEnqPos;
+    } else if (dif < 0) {
+      return false;
+    } else {
+      pos = logEnqPos;
+    }
+  }
+
+  slot -> level = level;
+  slot -> time = time(NULL);
+  strncpy(slot -> msg, msg, MAX_STRING_LEN - 1);
+  slot -> msg[MAX_STRING_LEN - 1] = 0;
+  APMON_MEMORY_BARRIER();
+  slot -> seq = pos + 1;
+
+  APMON_MEMORY_BARRIER();
+  if (logWriterWaiting) {
+    pthread_mutex_lock(&logWaitMutex);
+    pthread_cond_signal(&logNotEmpty);
+    pthread_mutex_unlock(&logWaitMutex);
+  }
+  return true;
+}
+
+/* Writes the messages from the ring buffer and returns their number; 
+   logger_mutex must be locked. */
+static int drainLogRing() {
+  LogSlot *slot;
+  long dropped;
+  char msg[100];
+  int n = 0;
+
+  while (1) {
+    slot = &logRing[logDeqPos & (LOG_RING_SIZE - 1)];
+    if ((long)(slot -> seq - (logDeqPos + 1)) != 0)
+      break;
+    APMON_MEMORY_BARRIER();
+    writeLogMessage(slot -> time, levelNames[slot -> level], slot -> msg);
+    APMON_MEMORY_BARRIER();
+    slot -> seq = logDeqPos + LOG_RING_SIZE;
+    logDeqPos++;
+    n++;
+  }
+
+  dropped = logDropped;
+  if (dropped != logDroppedReported) {
+    snprintf(msg, 99, "%ld log messages were dropped (the buffer was full)",
+	     dropped - logDroppedReported);
+    writeLogMessage(time(NULL), levelNames[WARNING], msg);
+    logDroppedReported = dropped;
+  }
+  if (n > 0)
+    fflush(logFile != NULL ? logFile : stdout);
+  return n;
+}
+
+/* The background thread which writes the messages logged asynchronously.
+ */
+static void *logWriterTask(void *param) {
+  struct timeval now;
+  struct timespec ts;
+  int n;
+
+  while (1) {
+    pthread_mutex_lock(&logger_mutex);
+    n = drainLogRing();
+    pthread_mutex_unlock(&logger_mutex);
+    if (n > 0)
+      continue;
+    if (!logAsync)
+      break;
+
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + 1;
+    ts.tv_nsec = now.tv_usec * 1000;
+    pthread_mutex_lock(&logWaitMutex);
+    logWriterWaiting = 1;
+    APMON_MEMORY_BARRIER();
+    /* check again, a message may have been published before the flag was
+       set */
+    if ((long)(logRing[logDeqPos & (LOG_RING_SIZE - 1)].seq - 
+	       (logDeqPos + 1)) != 0 && logAsync)
+      pthread_cond_timedwait(&logNotEmpty, &logWaitMutex, &ts);
+    logWriterWaiting = 0;
+    pthread_mutex_unlock(&logWaitMutex);
+  }
+  return NULL;
+}
+#endif
+
+void apmon_utils::logger(int msgLevel, const char *msg, int newLevel) {
+  char levelMsg[100];
+
+  /* the messages which are not logged don't cost more than a comparison */
+  if (newLevel < 0 && msgLevel >= 0 && msgLevel <= 4 && msgLevel > loglevel)
+    return;
+
+#ifndef WIN32
+  if (newLevel < 0 && msgLevel >= 0 && msgLevel <= 4 && logAsync) {
+    if (!enqueueLogMessage(msgLevel, msg))
+      APMON_ATOMIC_ADD(&logDropped, 1);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&logger_mutex);
   if (newLevel >= 0 && newLevel <=4) {
     loglevel = newLevel;
-    if (loglevel>=2)
-      printf("[%s] Changed the logging level to %s\n", time_s, levels[newLevel]);
+    if (loglevel>=2) {
+      snprintf(levelMsg, 99, "Changed the logging level to %s", 
+	       levelNames[newLevel]);
+      writeLogMessage(time(NULL), NULL, levelMsg);
+    }
   } else {
-    if (msgLevel >= 0 && msgLevel <= 4) {
-      if (msgLevel <= loglevel)
-	printf("[%s] [%s] %s\n",time_s, levels[msgLevel], msg);
-    } else
-      printf("[WARNING] Invalid logging level %d!\n", msgLevel);
+    if (msgLevel >= 0 && msgLevel <= 4)
+      writeLogMessage(time(NULL), levelNames[msgLevel], msg);
+    else
+      fprintf(logFile != NULL ? logFile : stdout, 
+	      "[WARNING] Invalid logging level %d!\n", msgLevel);
   }
   pthread_mutex_unlock(&logger_mutex);
 }
+
+int apmon_utils::setLogFile(const char *path) {
+  FILE *f = NULL;
+
+  if (path != NULL && strcmp(path, "stdout") != 0) {
+    if (strcmp(path, "stderr") == 0)
+      f = stderr;
+    else {
+      f = fopen(path, "a");
+      if (f == NULL)
+	return RET_ERROR;
+      setvbuf(f, NULL, _IOLBF, 0);
+    }
+  }
+
+  pthread_mutex_lock(&logger_mutex);
+  fflush(logFile != NULL ? logFile : stdout);
+  if (logFile != NULL && logFile != stderr)
+    fclose(logFile);
+  logFile = f;
+  pthread_mutex_unlock(&logger_mutex);
+  return RET_SUCCESS;
+}
+
+int apmon_utils::setAsyncLogging(bool enable) {
+#ifndef WIN32
+  static bool atexitRegistered = false;
+  unsigned long i;
+  int ret = RET_SUCCESS;
+
+  pthread_mutex_lock(&logWaitMutex);
+  if (enable && !logAsync) {
+    if (logRing == NULL) {
+      logRing = (LogSlot *)malloc(LOG_RING_SIZE * sizeof(LogSlot));
+      if (logRing != NULL) {
+	for (i = 0; i < LOG_RING_SIZE; i++)
+	  logRing[i].seq = i;
+      }
+    }
+    /* the flag is set first, so that the writer doesn't exit at once */
+    logAsync = 1;
+    if (logRing == NULL || 
+	pthread_create(&logWriterThread, NULL, logWriterTask, NULL) != 0) {
+      logAsync = 0;
+      ret = RET_ERROR;
+    } else {
+      if (!atexitRegistered) {
+	atexit(flushLog);
+	atexitRegistered = true;
+      }
+    }
+    pthread_mutex_unlock(&logWaitMutex);
+  } else if (!enable && logAsync) {
+    /* the writer writes the remaining messages and exits */
+    logAsync = 0;
+    pthread_cond_signal(&logNotEmpty);
+    pthread_mutex_unlock(&logWaitMutex);
+    pthread_join(logWriterThread, NULL);
+  } else
+    pthread_mutex_unlock(&logWaitMutex);
+  return ret;
+#else
+  return enable ? RET_ERROR : RET_SUCCESS;
+#endif
+}
+
+void apmon_utils::flushLog() {
+#ifndef WIN32
+  pthread_mutex_lock(&logger_mutex);
+  if (logRing != NULL)
+    drainLogRing();
+  fflush(logFile != NULL ? logFile : stdout);
+  pthread_mutex_unlock(&logger_mutex);
+#endif
+}
+
+long apmon_utils::getDroppedLogMessages() {
+#ifndef WIN32
+  return logDropped;
+#else
+  return 0;
+#endif
+}
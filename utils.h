@@ -54,6 +54,10 @@
 #define FINE 3 /**< Logging level with detailed information. */
 #define DEBUG 4 /**< Logging level for debugging. */
 
+/** The number of messages in the ring buffer of the asynchronous logging
+    (a power of two). */
+#define LOG_RING_SIZE 1024
+
 using namespace std;
 
 namespace apmon_utils {
@@ -152,6 +156,49 @@ namespace apmon_utils {
    * newLevel and ignore the first two parameters.
   */
   void logger(int msgLevel, const char *msg, int newLevel = -1);
+
+  /** Returns the time in nanoseconds from a monotonic clock (which is
+   * not affected by the changes of the system time). */
+  long long getMonotonicTime();
+
+  /** Returns the bucket of a histogram in which a quantile falls: the 
+   * bucket of the value with the rank ceil(q * count), between 1 and 
+   * count, in the ascending order. Used by the histograms of the 
+   * distributions and of the latencies, so that they estimate the 
+   * quantiles in the same way.
+   * @param counts The number of values from each bucket.
+   * @param nBuckets The number of buckets (the last one is returned if 
+   * the counts add up to less than the rank).
+   * @param count The number of values (it must be positive).
+   * @param q The quantile, between 0 and 1.
+   */
+  int quantileBucket(const unsigned int *counts, int nBuckets, long count,
+		     double q);
+
+  /** Returns true if the messages with the given level are logged 
+   * (i.e., the current logging level is greater than or equal to it). */
+  bool isLoggable(int msgLevel);
+
+  /** Writes the log messages in the given file, which is opened in append
+   * mode ("stdout" or NULL for the standard output, "stderr" for the 
+   * standard error). Returns RET_SUCCESS, or RET_ERROR if the file cannot
+   * be opened. */
+  int setLogFile(const char *path);
+
+  /** Enables or disables the asynchronous logging: the messages are put in
+   * a lock-free ring buffer and written by a background thread, so that the
+   * threads which log don't wait for the output (if the buffer is full, 
+   * the messages are dropped). Not available on Windows. Returns 
+   * RET_SUCCESS or RET_ERROR. */
+  int setAsyncLogging(bool enable);
+
+  /** Writes the messages which are in the buffer of the asynchronous 
+   * logging. */
+  void flushLog();
+
+  /** Returns the number of messages dropped because the buffer of the 
+   * asynchronous logging was full. */
+  long getDroppedLogMessages();
 }
 
 #endif
@@ -114,7 +114,9 @@ xdr_int(XDR *xdrs, int *ip)
         (void) (xdr_short(xdrs, (short *)ip));
         return (xdr_long(xdrs, (uint32_t *)ip));
 #else
-        if (sizeof (int) == sizeof (long)) {
+        /* XDR integers have 32 bits; long has 64 bits on LP64 systems,
+           so compare with the size of the XDR unit instead */
+        if (sizeof (int) == sizeof (uint32_t)) {
                 return (xdr_long(xdrs, (uint32_t *)ip));
         } else {
                 return (xdr_short(xdrs, (short *)ip));
@@ -129,7 +131,6 @@ xdr_int(XDR *xdrs, int *ip)
 bool_t
 xdr_long(XDR *xdrs, uint32_t *lp)
 {
-	printf("long\n");
 
         if (xdrs->x_op == XDR_ENCODE)
                 return (XDR_PUTLONG(xdrs, lp));
@@ -225,7 +226,7 @@ xdr_u_int(XDR *xdrs, u_int *up)
         (void) (xdr_short(xdrs, (short *)up));
         return (xdr_u_long(xdrs, (uint32_t *)up));
 #else
-        if (sizeof (u_int) == sizeof (u_long)) {
+        if (sizeof (u_int) == sizeof (uint32_t)) {
                 return (xdr_u_long(xdrs, (uint32_t *)up));
         } else {
                 return (xdr_short(xdrs, (short *)up));
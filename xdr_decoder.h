@@ -0,0 +1,145 @@
+/**
+ * \file xdr_decoder.h
+ * Declarations for the XdrDecoder class, an inline XDR decoder which 
+ * reads the values from a memory buffer, checking its bounds.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_xdr_decoder_h
+#define apmon_xdr_decoder_h
+
+#include "xdr_encoder.h"
+
+/**
+ * Decodes values in the XDR format from a memory buffer (e.g. a datagram
+ * sent by ApMon). Since the data may come from the network, each get*() 
+ * function checks that the value lies inside the buffer and returns false
+ * otherwise, without moving the position. 
+ */
+class XdrDecoder {
+ protected:
+  /** The beginning of the buffer. */
+  const char *start;
+  /** The position of the next value. */
+  const char *pos;
+  /** The end of the buffer. */
+  const char *end;
+
+ public:
+  /**
+   * Initializes the decoder.
+   * @param buf The buffer with the encoded data.
+   * @param size The size of the data.
+   */
+  XdrDecoder(const char *buf, int size) : start(buf), pos(buf), 
+    end(buf + size) {}
+
+  /** Returns the number of bytes decoded so far. */
+  int offset() const {
+    return (int)(pos - start);
+  }
+
+  /** Returns the number of bytes which were not decoded yet. */
+  int remaining() const {
+    return (int)(end - pos);
+  }
+
+  /** Decodes an unsigned 32-bit value. */
+  bool getUInt32(uint32_t *value) {
+    uint32_t w;
+
+    if (end - pos < 4)
+      return false;
+    memcpy(&w, pos, 4);
+    *value = APMON_HTONL(w);
+    pos += 4;
+    return true;
+  }
+
+  /** Decodes an integer (encoded with xdr_int()). */
+  bool getInt(int *value) {
+    uint32_t w;
+
+    if (!getUInt32(&w))
+      return false;
+    *value = (int)w;
+    return true;
+  }
+
+  /** Decodes a float (encoded with xdr_float()). */
+  bool getFloat(float *value) {
+    uint32_t w;
+
+    if (!getUInt32(&w))
+      return false;
+    memcpy(value, &w, 4);
+    return true;
+  }
+
+  /** Decodes a double (encoded with xdr_double(), with the second 32-bit
+   * word of the value first). */
+  bool getDouble(double *value) {
+    uint32_t w[2];
+
+    if (end - pos < 8)
+      return false;
+    getUInt32(&w[1]);
+    getUInt32(&w[0]);
+    memcpy(value, w, 8);
+    return true;
+  }
+
+  /**
+   * Decodes a string (encoded with xdr_string()). The string is not copied
+   * and it is not null-terminated in the buffer.
+   * @param s Receives the address of the characters in the buffer.
+   * @param len Receives the length of the string.
+   */
+  bool getString(const char **s, int *len) {
+    uint32_t n;
+
+    if (end - pos < 4)
+      return false;
+    memcpy(&n, pos, 4);
+    n = APMON_HTONL(n);
+    if (n > (uint32_t)(end - pos - 4) || 
+	XdrEncoder::stringSize((int)n) > end - pos)
+      return false;
+    *s = pos + 4;
+    *len = (int)n;
+    pos += XdrEncoder::stringSize((int)n);
+    return true;
+  }
+};
+
+#endif
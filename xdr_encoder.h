@@ -0,0 +1,163 @@
+/**
+ * \file xdr_encoder.h
+ * Declarations for the XdrEncoder class, an inline XDR encoder which 
+ * writes the values directly in a memory buffer.
+ */
+
+/*
+ * ApMon - Application Monitoring Tool
+ *
+ * Copyright (C) 2006 California Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to use, copy and modify 
+ * this software and its documentation (the "Software") for any
+ * purpose, provided that existing copyright notices are retained in 
+ * all copies and that this notice is included verbatim in any distributions
+ * or substantial portions of the Software. 
+ * This software is a part of the MonALISA framework (http://monalisa.cacr.caltech.edu).
+ * Users of the Software are asked to feed back problems, benefits,
+ * and/or suggestions about the software to the MonALISA Development Team
+ * (developers@monalisa.cern.ch). Support for this software - fixing of bugs,
+ * incorporation of new features - is done on a best effort basis. All bug
+ * fixes and enhancements will be made available under the same terms and
+ * conditions as the original software,
+
+ * IN NO EVENT SHALL THE AUTHORS OR DISTRIBUTORS BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES ARISING OUT
+ * OF THE USE OF THIS SOFTWARE, ITS DOCUMENTATION, OR ANY DERIVATIVES THEREOF,
+ * EVEN IF THE AUTHORS HAVE BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ * THE AUTHORS AND DISTRIBUTORS SPECIFICALLY DISCLAIM ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT. THIS SOFTWARE IS
+ * PROVIDED ON AN "AS IS" BASIS, AND THE AUTHORS AND DISTRIBUTORS HAVE NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef apmon_xdr_encoder_h
+#define apmon_xdr_encoder_h
+
+#include <string.h>
+#include "xdr.h"
+
+/* conversion of a 32-bit value to the network byte order */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define APMON_HTONL(x) __builtin_bswap32(x)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define APMON_HTONL(x) (x)
+#elif defined(_MSC_VER)
+#include <stdlib.h>
+#define APMON_HTONL(x) _byteswap_ulong(x)
+#else
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+#define APMON_HTONL(x) htonl(x)
+#endif
+
+/**
+ * Encodes values in the XDR format in a memory buffer. The encoding is 
+ * identical to the one produced by the xdr_*() functions from xdr.cpp with
+ * an XDR stream created by xdrmem_create(), but the functions are inline
+ * and the put*() functions don't check if there is enough room in the 
+ * buffer: the caller should compute the size of the encoded data and 
+ * check it once, with fits().
+ */
+class XdrEncoder {
+ protected:
+  /** The beginning of the buffer. */
+  char *start;
+  /** The position where the next value will be written. */
+  char *pos;
+  /** The end of the buffer. */
+  char *end;
+
+ public:
+  /**
+   * Initializes the encoder.
+   * @param buf The buffer where the data will be encoded.
+   * @param size The size of the buffer.
+   */
+  XdrEncoder(char *buf, int size) : start(buf), pos(buf), end(buf + size) {}
+
+  /** Returns the size of the XDR representation of a string with the
+   * given length. */
+  static int stringSize(int len) {
+    return 4 + ((len + 3) & ~3);
+  }
+
+  /** Returns true if there is room for n more bytes in the buffer. */
+  bool fits(int n) const {
+    return n >= 0 && n <= end - pos;
+  }
+
+  /** Returns the number of bytes encoded so far. */
+  int length() const {
+    return (int)(pos - start);
+  }
+
+  /** Encodes an unsigned 32-bit value. */
+  void putUInt32(uint32_t value) {
+    value = APMON_HTONL(value);
+    memcpy(pos, &value, 4);
+    pos += 4;
+  }
+
+  /** Encodes an integer (same as xdr_int()). */
+  void putInt(int value) {
+    putUInt32((uint32_t)value);
+  }
+
+  /** Encodes an integer at a position where room for it was reserved 
+   * earlier (e.g., a count which is known only at the end). */
+  void putIntAt(int offset, int value) {
+    uint32_t w = APMON_HTONL((uint32_t)value);
+
+    memcpy(start + offset, &w, 4);
+  }
+
+  /** Encodes a float (same as xdr_float()). */
+  void putFloat(float value) {
+    uint32_t w;
+
+    memcpy(&w, &value, 4);
+    putUInt32(w);
+  }
+
+  /** Encodes a double (same as xdr_double(), which writes the second
+   * 32-bit word of the value first). */
+  void putDouble(double value) {
+    uint32_t w[2];
+
+    memcpy(w, &value, 8);
+    putUInt32(w[1]);
+    putUInt32(w[0]);
+  }
+
+  /** Copies len bytes which are already encoded. */
+  void putBytes(const char *data, int len) {
+    memcpy(pos, data, len);
+    pos += len;
+  }
+
+  /** Encodes a string with the given length (same as xdr_string()): the
+   * length, the characters and the zeros which pad them to a multiple 
+   * of 4 bytes. */
+  void putString(const char *s, int len) {
+    int pad = (4 - (len & 3)) & 3;
+
+    putUInt32((uint32_t)len);
+    memcpy(pos, s, len);
+    pos += len;
+    while (pad-- > 0)
+      *pos++ = 0;
+  }
+
+  /** Encodes a null-terminated string. */
+  void putString(const char *s) {
+    putString(s, (int)strlen(s));
+  }
+};
+
+#endif